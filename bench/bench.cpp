@@ -0,0 +1,359 @@
+/**
+ * @file bench.cpp
+ * @brief Benchmarks of wb hot paths
+ * @details Each case is run in this process for wall time, then re-run under strace(1) to count syscalls and
+ * forks per operation.  Fixtures(fake VM root, mock QMP/QGA sockets, image files) are set up in this process
+ * and shared with traced children through WB_BENCH_DIR so that only the operation itself is traced.
+ * Counts of a run with zero iterations are subtracted to exclude process startup.
+ */
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#include <libsmartcols/libsmartcols.h>
+#include <nlohmann/json.hpp>
+
+#include "../vm.h"
+#include "../volume.h"
+#include "../install.h"
+#include "../image.h"
+#include "../invoke.h"
+#include "../misc.h"
+
+static const size_t num_vms = 50;
+static const size_t num_volumes = 8;
+static const uint64_t image_size = 64 * 1024 * 1024;
+
+static std::filesystem::path bench_dir;
+
+struct Case {
+    std::string name;
+    size_t iterations;
+    std::function<void()> setup; // run only once in untraced process
+    std::function<void()> run;
+};
+
+/**
+ * @brief Answer QMP/QGA requests just enough for wb to be satisfied
+ */
+static void serve_mock(int sock, bool qmp, int n)
+{
+    if (qmp) {
+        std::string greeting = nlohmann::json({{"QMP", {{"version", nlohmann::json::object()}, {"capabilities", nlohmann::json::array()}}}}).dump() + "\n";
+        send(sock, greeting.data(), greeting.size(), MSG_NOSIGNAL);
+    }
+    std::string buf;
+    char chunk[4096];
+    while (true) {
+        auto r = read(sock, chunk, sizeof(chunk));
+        if (r <= 0) break;
+        //else
+        buf.append(chunk, r);
+        size_t eol;
+        while ((eol = buf.find('\n')) != std::string::npos) {
+            auto line = buf.substr(0, eol);
+            buf.erase(0, eol + 1);
+            auto start = line.find('{'); // skip 0xff sent by QGA client
+            if (start == std::string::npos) continue;
+            //else
+            auto request = nlohmann::json::parse(line.substr(start), nullptr, false);
+            if (request.is_discarded() || !request.contains("execute")) continue;
+            //else
+            auto command = request["execute"].get<std::string>();
+            nlohmann::json ret = nlohmann::json::object();
+            std::string prefix;
+            if (command == "guest-sync-delimited") {
+                prefix = "\xff";
+                ret = request["arguments"]["id"];
+            } else if (command == "query-cpus-fast") {
+                ret = nlohmann::json::array({nlohmann::json::object(), nlohmann::json::object()});
+            } else if (command == "query-memory-size-summary") {
+                ret = {{"base-memory", 1024ULL * 1024 * 1024}};
+            } else if (command == "query-blockstats") {
+                ret = nlohmann::json::array({{{"device", "vda"}, {"stats", {{"rd_bytes", 0}, {"wr_bytes", 0}}}}});
+            } else if (command == "guest-network-get-interfaces") {
+                ret = nlohmann::json::array({{
+                    {"name", "eth0"},
+                    {"ip-addresses", {{{"ip-address-type", "ipv4"}, {"ip-address", "10.0.0." + std::to_string(n + 1)}}}},
+                    {"statistics", {{"rx-bytes", 0}, {"tx-bytes", 0}}}
+                }});
+            }
+            auto response = prefix + nlohmann::json({{"return", ret}}).dump() + "\n";
+            send(sock, response.data(), response.size(), MSG_NOSIGNAL);
+        }
+    }
+    close(sock);
+}
+
+static void listen_mock(const std::filesystem::path& path, bool qmp, int n)
+{
+    auto sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) throw std::runtime_error("socket() failed");
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+        throw std::runtime_error("Listening on " + path.string() + " failed");
+    }
+    std::thread([sock,qmp,n]() {
+        while (true) {
+            auto fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            std::thread(serve_mock, fd, qmp, n).detach();
+        }
+    }).detach();
+}
+
+static void setup_vms()
+{
+    auto vm_root = bench_dir / "vm";
+    auto run_dir = bench_dir / "run" / "vm";
+    for (size_t i = 0; i < num_vms; i++) {
+        auto name = "bench" + std::to_string(i);
+        std::filesystem::create_directories(vm_root / name);
+        std::ofstream(vm_root / name / "vm.ini") << "memory=1024" << std::endl << "cpu=2" << std::endl;
+        std::filesystem::create_directories(run_dir / name);
+        listen_mock(run_dir / name / "qmp.sock", true, i);
+        listen_mock(run_dir / name / "qga.sock", false, i);
+    }
+}
+
+static void setup_volumes()
+{
+    for (size_t i = 0; i < num_volumes; i++) {
+        auto volume_dir = bench_dir / "vm" / ("@vol" + std::to_string(i));
+        std::filesystem::create_directories(volume_dir);
+        std::ofstream(volume_dir / ".uuid") << "00000000-0000-0000-0000-00000000000" << i << std::endl;
+    }
+}
+
+static void setup_image()
+{
+    // half random, half zero so that both paths of the copy loop are taken
+    auto raw = bench_dir / "system.img";
+    std::ifstream urandom("/dev/urandom", std::ios::binary);
+    std::ofstream f(raw, std::ios::binary);
+    std::vector<char> buf(1024 * 1024);
+    for (uint64_t written = 0; written < image_size / 2; written += buf.size()) {
+        urandom.read(buf.data(), buf.size());
+        f.write(buf.data(), buf.size());
+    }
+    f.close();
+    std::filesystem::resize_file(raw, image_size);
+    image::create(raw, bench_dir / "system.wbimg");
+}
+
+static void invoke_request(const std::string& request)
+{
+    auto request_file = bench_dir / "request.json";
+    std::ofstream(request_file) << request;
+    auto fd = open(request_file.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("open() failed");
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+    clearerr(stdin);
+    std::cin.clear();
+    invoke::invoke();
+}
+
+/**
+ * @brief Run wb binary built from this tree and wait for it
+ */
+static void run_wb(const std::vector<std::string>& args)
+{
+    auto wb = std::filesystem::read_symlink("/proc/self/exe").parent_path().parent_path() / "wb";
+    std::vector<const char*> argv = {wb.c_str()};
+    for (const auto& arg : args) argv.push_back(arg.c_str());
+    argv.push_back(NULL);
+    auto pid = fork();
+    if (pid < 0) throw std::runtime_error("fork() failed");
+    if (pid == 0) {
+        _exit(execv(wb.c_str(), const_cast<char* const*>(argv.data())));
+    }
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+        throw std::runtime_error(wb.string() + " failed");
+}
+
+static std::vector<Case> cases()
+{
+    auto vm_root = bench_dir / "vm";
+    return {
+        {"vm-list", 20, setup_vms, [vm_root]() { vm::list(vm_root); }},
+        {"vm-list-json", 20, []() {}, [vm_root]() { vm::list(vm_root, {.json = true}); }},
+        {"volume-list", 100, setup_volumes, [vm_root]() { volume::list(vm_root); }},
+        {"enum-usable-disks", 100, []() {}, []() { install::enum_usable_disks(8ULL * 1024 * 1024 * 1024); }},
+        {"copy-to-many", 5, setup_image, []() {
+            copy_file_to_many(bench_dir / "system.img", {bench_dir / "copy0", bench_dir / "copy1"});
+        }},
+        {"image-extract", 5, []() {}, []() { image::extract(bench_dir / "system.wbimg", bench_dir / "extracted"); }},
+        {"invoke-echo", 1000, []() {}, []() { invoke_request("{\"execute\":\"echo\",\"arguments\":1}"); }},
+        {"invoke-system-status", 100, []() {}, []() { invoke_request("{\"execute\":\"system-status\"}"); }},
+        // process startup including dynamic linking and argument parser setup.  --help exits right after setup
+        {"startup", 100, []() {}, []() { run_wb({"list", "--help"}); }}
+    };
+}
+
+/**
+ * @brief Run operation repeatedly with stdout discarded
+ * @return Wall time per operation in seconds
+ */
+static double run(const Case& c, size_t iterations)
+{
+    std::cout << std::flush;
+    auto saved_stdout = dup(STDOUT_FILENO);
+    auto devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) c.run();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << std::flush;
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    return iterations > 0? elapsed.count() / iterations : 0.0;
+}
+
+/**
+ * @brief Run case in a child process under strace
+ * @return Number of syscalls and forks(clones without CLONE_THREAD)
+ */
+static std::optional<std::pair<uint64_t,uint64_t>> trace(const std::string& name, size_t iterations)
+{
+    auto summary = bench_dir / "strace.summary", log = bench_dir / "strace.log";
+    auto self = std::filesystem::read_symlink("/proc/self/exe");
+    auto spawn = [&](const std::vector<std::string>& strace_options, const std::filesystem::path& output) {
+        std::vector<std::string> args = {"strace", "-f", "-qq", "-o", output.string()};
+        args.insert(args.end(), strace_options.begin(), strace_options.end());
+        args.insert(args.end(), {self.string(), "--run", name, std::to_string(iterations)});
+        std::vector<const char*> argv;
+        for (const auto& arg : args) argv.push_back(arg.c_str());
+        argv.push_back(NULL);
+        auto pid = fork();
+        if (pid < 0) throw std::runtime_error("fork() failed");
+        if (pid == 0) {
+            auto devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            _exit(execvp("strace", const_cast<char* const*>(argv.data())));
+        }
+        int wstatus;
+        waitpid(pid, &wstatus, 0);
+        return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+    };
+
+    if (!spawn({"-c"}, summary)) return std::nullopt;
+    //else
+    uint64_t syscalls = 0;
+    {
+        std::ifstream f(summary);
+        std::string line;
+        while (std::getline(f, line)) {
+            std::istringstream s(line);
+            std::vector<std::string> fields;
+            std::string field;
+            while (s >> field) fields.push_back(field);
+            if (fields.size() >= 5 && fields.back() == "total") syscalls = std::stoull(fields[3]);
+        }
+    }
+
+    if (!spawn({"-e", "trace=fork,vfork,clone,clone3"}, log)) return std::nullopt;
+    //else
+    uint64_t forks = 0;
+    {
+        std::ifstream f(log);
+        std::string line;
+        while (std::getline(f, line)) {
+            if (line.find("resumed>") != std::string::npos || line.find("CLONE_THREAD") != std::string::npos) continue;
+            if (line.find("clone") != std::string::npos || line.find("fork") != std::string::npos) forks++;
+        }
+    }
+    return std::make_pair(syscalls, forks);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 4 && std::string(argv[1]) == "--run") {
+        // traced child.  fixtures are already there
+        bench_dir = getenv("WB_BENCH_DIR");
+        for (const auto& c : cases()) {
+            if (c.name == argv[2]) return (run(c, std::stoul(argv[3])), 0);
+        }
+        return 1;
+    }
+    //else
+    std::vector<std::string> selected(argv + 1, argv + argc);
+
+    char tmpl[] = "/tmp/wb-bench-XXXXXX";
+    if (!mkdtemp(tmpl)) throw std::runtime_error("mkdtemp() failed");
+    bench_dir = tmpl;
+    std::shared_ptr<void> cleanup(nullptr, [](auto) { std::error_code ec; std::filesystem::remove_all(bench_dir, ec); });
+    // keep D-Bus session reachable while VM runtime dir points at the mocks
+    if (auto xdg_runtime_dir = getenv("XDG_RUNTIME_DIR"); xdg_runtime_dir && std::filesystem::exists(std::filesystem::path(xdg_runtime_dir) / "bus")) {
+        std::filesystem::create_directories(bench_dir / "run");
+        std::filesystem::create_symlink(std::filesystem::path(xdg_runtime_dir) / "bus", bench_dir / "run" / "bus");
+    }
+    setenv("XDG_RUNTIME_DIR", (bench_dir / "run").c_str(), 1);
+    setenv("WB_BENCH_DIR", bench_dir.c_str(), 1);
+    std::filesystem::create_directories(bench_dir / "run");
+
+    bool strace = system("strace -V > /dev/null 2>&1") == 0;
+    if (!strace) std::cerr << "strace not found.  Syscalls and forks are not counted" << std::endl;
+
+    std::shared_ptr<libscols_table> table(scols_new_table(), scols_unref_table);
+    if (!table) throw std::runtime_error("scols_new_table() failed");
+    scols_table_new_column(table.get(), "CASE", 0.1, 0);
+    scols_table_new_column(table.get(), "ITERATIONS", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "WALL/OP", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "SYSCALLS/OP", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "FORKS/OP", 0.1, SCOLS_FL_RIGHT);
+
+    for (const auto& c : cases()) {
+        // setup is needed even if not selected as later cases may depend on it
+        c.setup();
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), c.name) == selected.end()) continue;
+        //else
+        std::cerr << "Running " << c.name << "..." << std::endl;
+        std::string wall = "failed", syscalls = "-", forks = "-";
+        try {
+            run(c, 1); // warm up
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.3fms", run(c, c.iterations) * 1000.0);
+            wall = buf;
+            auto traced = strace? trace(c.name, c.iterations) : std::nullopt;
+            auto baseline = strace? trace(c.name, 0) : std::nullopt;
+            if (traced && baseline) {
+                snprintf(buf, sizeof(buf), "%.1f", ((double)traced->first - baseline->first) / c.iterations);
+                syscalls = buf;
+                snprintf(buf, sizeof(buf), "%.2f", ((double)traced->second - baseline->second) / c.iterations);
+                forks = buf;
+            }
+        }
+        catch (const std::exception& err) {
+            std::cerr << c.name << ": " << err.what() << std::endl;
+        }
+        auto line = scols_table_new_line(table.get(), NULL);
+        if (!line) throw std::runtime_error("scols_table_new_line() failed");
+        scols_line_set_data(line, 0, c.name.c_str());
+        scols_line_set_data(line, 1, std::to_string(c.iterations).c_str());
+        scols_line_set_data(line, 2, wall.c_str());
+        scols_line_set_data(line, 3, syscalls.c_str());
+        scols_line_set_data(line, 4, forks.c_str());
+    }
+    scols_print_table(table.get());
+    return 0;
+}
@@ -0,0 +1,357 @@
+/**
+ * @file blockdev.cpp
+ * @brief Block device metadata
+ */
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+
+#include <cstdlib>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <blkid/blkid.h>
+
+#include "blockdev.h"
+#include "trace.h"
+
+/**
+ * @brief Collect whole disks which the device(sysfs directory) resides on
+ */
+static void collect_disks(const std::filesystem::path& sysfs_dir, std::map<std::string,std::string>& disks)
+{
+    // device-mapper, md etc. are on their "slaves"
+    bool has_slaves = false;
+    std::error_code ec;
+    for (const auto& slave : std::filesystem::directory_iterator(sysfs_dir / "slaves", ec)) {
+        has_slaves = true;
+        collect_disks(std::filesystem::canonical(slave.path()), disks);
+    }
+    if (has_slaves) return;
+    //else
+    auto disk = std::filesystem::exists(sysfs_dir / "partition")? sysfs_dir.parent_path() : sysfs_dir;
+    std::ifstream f(disk / "dev");
+    std::string devno;
+    if (f >> devno) disks[disk.filename().string()] = devno;
+}
+
+static std::optional<std::string> read_attr(const std::filesystem::path& path)
+{
+    std::ifstream f(path);
+    std::string value;
+    if (!f || !std::getline(f, value)) return std::nullopt;
+    //else
+    // trim as some attributes(eg. model) are padded with spaces
+    auto end = value.find_last_not_of(" \t\n");
+    value.erase(end == std::string::npos? 0 : end + 1);
+    auto start = value.find_first_not_of(" \t");
+    value.erase(0, start == std::string::npos? value.size() : start);
+    if (value.empty()) return std::nullopt;
+    //else
+    return value;
+}
+
+template <typename T> static T read_number(const std::filesystem::path& path, T default_value)
+{
+    auto value = read_attr(path);
+    if (!value) return default_value;
+    //else
+    try {
+        return (T)std::stoull(*value);
+    }
+    catch (const std::logic_error&) {
+        return default_value;
+    }
+}
+
+static std::string devno_of(dev_t dev)
+{
+    return std::to_string(major(dev)) + ':' + std::to_string(minor(dev));
+}
+
+/**
+ * @brief Mountpoints(and swap) indexed by device number
+ * @details btrfs reports anonymous device number in mountinfo, so the mount source is also stat'ed.
+ */
+static std::map<std::string,std::vector<std::filesystem::path>> get_mountpoints()
+{
+    std::map<std::string,std::vector<std::filesystem::path>> mountpoints;
+    trace::Scope scope("mount", "parse mountinfo");
+    std::ifstream mountinfo("/proc/self/mountinfo");
+    std::string line;
+    while (std::getline(mountinfo, line)) {
+        std::istringstream is(line);
+        std::string id, parent, devno, root, target;
+        if (!(is >> id >> parent >> devno >> root >> target)) continue;
+        //else
+        std::string field, fstype, source;
+        while (is >> field && field != "-") ;
+        is >> fstype >> source;
+        std::set<std::string> devnos = { devno };
+        struct stat st;
+        if (source.starts_with("/dev/") && stat(source.c_str(), &st) == 0 && S_ISBLK(st.st_mode)) devnos.insert(devno_of(st.st_rdev));
+        for (const auto& d : devnos) mountpoints[d].push_back(target);
+    }
+    std::ifstream swaps("/proc/swaps");
+    if (std::getline(swaps, line)) { // skip header
+        while (std::getline(swaps, line)) {
+            auto source = line.substr(0, line.find_first_of(" \t"));
+            struct stat st;
+            if (stat(source.c_str(), &st) == 0 && S_ISBLK(st.st_mode)) mountpoints[devno_of(st.st_rdev)].push_back("[SWAP]");
+        }
+    }
+    return mountpoints;
+}
+
+/**
+ * @brief Get transport type from the sysfs path of the device in the same manner as lsblk
+ */
+static std::optional<std::string> get_tran(const std::string& name, const std::filesystem::path& sysfs_dir)
+{
+    if (name.starts_with("nvme")) return "nvme";
+    if (name.starts_with("mmcblk")) return "mmc";
+    //else
+    std::error_code ec;
+    auto device = std::filesystem::canonical(sysfs_dir / "device", ec).string();
+    if (ec) return std::nullopt;
+    //else
+    if (device.find("/usb") != std::string::npos) return "usb";
+    if (device.find("/session") != std::string::npos) return "iscsi";
+    if (device.find("/rport-") != std::string::npos) return "fc";
+    if (device.find("/end_device-") != std::string::npos) return "sas";
+    if (device.find("/ata") != std::string::npos) return "sata";
+    //else
+    return std::nullopt; // virtio etc.
+}
+
+static std::string get_type(const std::string& name, const std::filesystem::path& sysfs_dir)
+{
+    if (std::filesystem::exists(sysfs_dir / "partition")) return "part";
+    if (name.starts_with("loop")) return "loop";
+    if (name.starts_with("dm-")) return "dm";
+    if (name.starts_with("md")) return "md";
+    if (read_number<int>(sysfs_dir / "device/type", 0) == 5/*TYPE_ROM*/) return "rom";
+    //else
+    return "disk";
+}
+
+static blockdev::Device read_device(const std::filesystem::path& sysfs_dir,
+    const std::map<std::string,std::vector<std::filesystem::path>>& mountpoints)
+{
+    auto name = sysfs_dir.filename().string();
+    auto type = get_type(name, sysfs_dir);
+    // partitions don't have queue and device of their own
+    auto disk_dir = type == "part"? sysfs_dir.parent_path() : sysfs_dir;
+    blockdev::Device device = {
+        .name = name,
+        .devno = read_attr(sysfs_dir / "dev").value_or(""),
+        .type = type,
+        .size = read_number<uint64_t>(sysfs_dir / "size", 0) * 512, // always in 512-byte sectors
+        .ro = read_number<int>(sysfs_dir / "ro", 0) != 0,
+        .log_sec = read_number<uint16_t>(disk_dir / "queue/logical_block_size", 512),
+        .tran = type == "part"? std::nullopt : get_tran(name, sysfs_dir),
+        .model = type == "part"? std::nullopt : read_attr(sysfs_dir / "device/model"),
+        .wwid = type == "part"? std::nullopt : read_attr(sysfs_dir / "device/wwid"),
+        .partno = type == "part"? std::make_optional(read_number<uint16_t>(sysfs_dir / "partition", 0)) : std::nullopt
+    };
+    auto mp = mountpoints.find(device.devno);
+    if (mp != mountpoints.end()) device.mountpoints = mp->second;
+
+    std::error_code ec;
+    std::vector<std::filesystem::path> children;
+    for (const auto& d : std::filesystem::directory_iterator(sysfs_dir, ec)) {
+        if (std::filesystem::exists(d.path() / "partition")) children.push_back(d.path());
+    }
+    // device-mapper, md etc. built on this device(like lsblk, one on multiple devices appears under each of them)
+    for (const auto& d : std::filesystem::directory_iterator(sysfs_dir / "holders", ec)) {
+        children.push_back(std::filesystem::canonical(d.path()));
+    }
+    std::sort(children.begin(), children.end());
+    for (const auto& child : children) {
+        device.children.push_back(read_device(child, mountpoints));
+    }
+    return device;
+}
+
+namespace blockdev {
+
+std::vector<Device> get_block_devices()
+{
+    trace::Scope scope("sysfs", "get_block_devices");
+    auto mountpoints = get_mountpoints();
+    std::vector<std::filesystem::path> dirs;
+    std::error_code ec;
+    for (const auto& d : std::filesystem::directory_iterator("/sys/block", ec)) {
+        dirs.push_back(d.path());
+    }
+    std::sort(dirs.begin(), dirs.end());
+    std::vector<Device> devices;
+    for (const auto& dir : dirs) {
+        auto sysfs_dir = std::filesystem::canonical(dir, ec);
+        if (ec) continue;
+        //else
+        // devices built on others(eg. dm) appear as their children
+        if (!std::filesystem::is_empty(sysfs_dir / "slaves", ec) && !ec) continue;
+        //else
+        devices.push_back(read_device(sysfs_dir, mountpoints));
+    }
+    return devices;
+}
+
+bool is_free(const Device& device)
+{
+    if (!device.mountpoints.empty()) return false;
+    //else
+    for (const auto& child : device.children) {
+        if (child.type != "part" || !is_free(child)) return false;
+    }
+    return true;
+}
+
+std::optional<std::filesystem::path> get_partition(const std::filesystem::path& disk, uint16_t partno)
+{
+    struct stat s;
+    if (stat(disk.c_str(), &s) < 0 || !S_ISBLK(s.st_mode)) throw std::runtime_error(disk.string() + " is not a block device");
+    //else
+    std::error_code ec;
+    auto sysfs_dir = std::filesystem::canonical(std::filesystem::path("/sys/dev/block") / devno_of(s.st_rdev), ec);
+    if (ec) return std::nullopt;
+    //else
+    for (const auto& d : std::filesystem::directory_iterator(sysfs_dir, ec)) {
+        if (read_number<uint16_t>(d.path() / "partition", 0) != partno) continue;
+        //else
+        return std::filesystem::path("/dev") / d.path().filename();
+    }
+    return std::nullopt;
+}
+
+
+/**
+ * @brief Get filesystem UUID of the partition
+ * @details Only the specified device is probed(blkid_probe_all() would scan every block device on the system)
+ * @param partition Path to the partition
+ * @return UUID of the partition or std::nullopt if it cannot be probed or has no UUID
+ */
+std::optional<std::string> get_partition_uuid(const std::filesystem::path& partition)
+{
+    std::shared_ptr<blkid_struct_probe> pr(blkid_new_probe_from_filename(partition.c_str()), blkid_free_probe);
+    if (!pr) return std::nullopt;
+    //else
+    blkid_probe_enable_superblocks(pr.get(), 1);
+    blkid_probe_set_superblocks_flags(pr.get(), BLKID_SUBLKS_UUID);
+    if (blkid_do_safeprobe(pr.get()) != 0) return std::nullopt;
+    //else
+    const char* uuid;
+    if (blkid_probe_lookup_value(pr.get(), "UUID", &uuid, NULL) != 0) return std::nullopt;
+    //else
+    return std::string(uuid);
+}
+
+/**
+ * @brief Find devices of filesystem UUIDs all at once
+ * @details /dev/disk/by-uuid is read only once.  UUIDs udev didn't link are looked up from blkid cache
+ * which is shared by all the remaining lookups.
+ * @param uuids Filesystem UUIDs to find
+ * @return Map of UUID to device path.  UUIDs whose device is not found are not included
+ */
+std::map<std::string,std::filesystem::path> resolve_uuids(const std::set<std::string>& uuids)
+{
+    std::map<std::string,std::filesystem::path> devices;
+    std::filesystem::path by_uuid("/dev/disk/by-uuid");
+    std::error_code ec;
+    for (const auto& link : std::filesystem::directory_iterator(by_uuid, ec)) {
+        auto uuid = link.path().filename().string();
+        if (!uuids.contains(uuid)) continue;
+        //else
+        auto device = std::filesystem::canonical(link.path(), ec);
+        if (!ec) devices[uuid] = device;
+    }
+
+    blkid_cache cache = NULL;
+    for (const auto& uuid : uuids) {
+        if (devices.contains(uuid)) continue;
+        //else
+        auto device = blkid_evaluate_tag("UUID", uuid.c_str(), &cache);
+        if (!device) continue;
+        //else
+        devices[uuid] = device;
+        free(device);
+    }
+    if (cache) blkid_put_cache(cache);
+
+    return devices;
+}
+
+/**
+ * @brief Get whole disks under the block device
+ * @param device Block device(partition, device-mapper device etc.)
+ * @return Map of kernel disk name(eg. "sda") to its device number(MAJ:MIN).  Empty if device is not a block device
+ */
+std::map<std::string,std::string> get_underlying_disks(const std::filesystem::path& device)
+{
+    std::map<std::string,std::string> disks;
+    struct stat s;
+    if (stat(device.c_str(), &s) < 0 || !S_ISBLK(s.st_mode)) return disks;
+    //else
+    std::error_code ec;
+    auto sysfs_dir = std::filesystem::canonical(std::filesystem::path("/sys/dev/block")
+        / (std::to_string(major(s.st_rdev)) + ':' + std::to_string(minor(s.st_rdev))), ec);
+    if (!ec) collect_disks(sysfs_dir, disks);
+    return disks;
+}
+
+std::vector<std::filesystem::path> wait_for_partitions(const std::filesystem::path& disk, const std::vector<uint16_t>& partnos,
+    std::chrono::system_clock::time_point since, std::chrono::milliseconds timeout/* = std::chrono::seconds(10)*/)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::filesystem::path udev_data("/run/udev/data");
+    bool has_udev = std::filesystem::is_directory(udev_data);
+
+    auto inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify < 0) throw std::runtime_error("inotify_init1() failed");
+    std::shared_ptr<void> inotify_guard(nullptr, [inotify](auto){ close(inotify); });
+    inotify_add_watch(inotify, "/dev", IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+    if (has_udev) inotify_add_watch(inotify, udev_data.c_str(), IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+
+    // a partition is ready when its node exists and udev has (re)processed it after partitioning
+    auto is_ready = [&](uint16_t partno) -> std::optional<std::filesystem::path> {
+        auto partition = get_partition(disk, partno);
+        if (!partition) return std::nullopt;
+        //else
+        struct stat st;
+        if (stat(partition->c_str(), &st) < 0 || !S_ISBLK(st.st_mode)) return std::nullopt;
+        if (!has_udev) return partition;
+        //else
+        struct stat db;
+        if (stat((udev_data / ("b" + devno_of(st.st_rdev))).c_str(), &db) < 0) return std::nullopt;
+        auto mtime = std::chrono::system_clock::from_time_t(db.st_mtim.tv_sec) + std::chrono::nanoseconds(db.st_mtim.tv_nsec);
+        return mtime >= since? partition : std::nullopt;
+    };
+
+    while (true) {
+        std::vector<std::filesystem::path> partitions;
+        for (auto partno : partnos) {
+            auto partition = is_ready(partno);
+            if (!partition) break;
+            //else
+            partitions.push_back(*partition);
+        }
+        if (partitions.size() == partnos.size()) return partitions;
+        //else
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0) throw std::runtime_error("Timed out waiting for partitions of " + disk.string());
+        //else
+        // sysfs can't be watched.  wake up periodically too
+        struct pollfd pfd = { .fd = inotify, .events = POLLIN, .revents = 0 };
+        if (poll(&pfd, 1, std::min(remaining, 100L)) > 0) {
+            char buf[4096];
+            while (read(inotify, buf, sizeof(buf)) > 0) ; // drain
+        }
+    }
+}
+
+} // namespace blockdev
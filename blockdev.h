@@ -0,0 +1,52 @@
+#ifndef __BLOCKDEV_H__
+#define __BLOCKDEV_H__
+
+#include <map>
+#include <chrono>
+#include <set>
+#include <vector>
+#include <optional>
+#include <string>
+#include <filesystem>
+
+namespace blockdev {
+    struct Device {
+        std::string name; // kernel name(eg. "sda1")
+        std::string devno; // MAJ:MIN
+        std::string type; // "disk", "part", "rom", "loop", "dm" or "md"
+        uint64_t size; // in bytes
+        bool ro;
+        uint16_t log_sec;
+        std::optional<std::string> tran = std::nullopt;
+        std::optional<std::string> model = std::nullopt;
+        std::optional<std::string> wwid = std::nullopt;
+        std::optional<uint16_t> partno = std::nullopt;
+        std::vector<std::filesystem::path> mountpoints = {};
+        std::vector<Device> children = {}; // partitions and devices built on this(eg. dm)
+    };
+    /**
+     * @brief Build tree of block devices from sysfs
+     * @return Top level devices.  Devices built on others appear as their children
+     */
+    std::vector<Device> get_block_devices();
+    /**
+     * @brief Check if neither the device nor its descendants are in use(mounted, swap or used by dm etc.)
+     */
+    bool is_free(const Device& device);
+    std::optional<std::filesystem::path> get_partition(const std::filesystem::path& disk, uint16_t partno);
+    /**
+     * @brief Wait until the partitions of the disk are ready for use
+     * @details Device nodes in /dev and udev database in /run/udev/data are watched by inotify.  Unlike 'udevadm settle',
+     * events of other devices are not waited for.
+     * @param since Time before partitioning.  udev database entries older than this are regarded as stale
+     * @return Device paths of the partitions in the order of partnos
+     */
+    std::vector<std::filesystem::path> wait_for_partitions(const std::filesystem::path& disk, const std::vector<uint16_t>& partnos,
+        std::chrono::system_clock::time_point since, std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+    std::optional<std::string> get_partition_uuid(const std::filesystem::path& partition);
+    std::map<std::string,std::filesystem::path> resolve_uuids(const std::set<std::string>& uuids);
+    std::map<std::string,std::string/*MAJ:MIN*/> get_underlying_disks(const std::filesystem::path& device);
+}
+
+#endif // __BLOCKDEV_H__
@@ -0,0 +1,52 @@
+/**
+ * @file dl.cpp
+ * @brief Loading shared libraries on demand
+ */
+#include <dlfcn.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+
+#include "dl.h"
+#include "trace.h"
+
+namespace dl {
+
+void* symbol(const char* library, const char* name)
+{
+    static std::mutex mutex;
+    static std::map<std::string,void*> handles;
+
+    void* handle;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto i = handles.find(library);
+        if (i == handles.end()) {
+            trace::Scope scope("dl", library);
+            handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+            if (!handle) throw std::runtime_error(std::string("Loading ") + library + " failed: " + dlerror());
+            //else
+            handles[library] = handle;
+        } else {
+            handle = i->second;
+        }
+    }
+    auto sym = dlsym(handle, name);
+    if (!sym) throw std::runtime_error(std::string("Symbol ") + name + " not found in " + library);
+    //else
+    return sym;
+}
+
+} // namespace dl
+
+#ifdef __VSCODE_ACTIVE_FILE__
+#include <iostream>
+#include <curl/curl.h>
+int main()
+{
+    std::cout << WB_DLSYM(dl::libcurl, curl_version)() << std::endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,28 @@
+#ifndef __DL_H__
+#define __DL_H__
+
+/**
+ * Libraries loaded on first use instead of at startup
+ *
+ * Only a few subcommands need them(wg, detect-timezone, wayland-ping) while every invocation would pay for
+ * loading and relocating them if they were linked.  Headers of the libraries are still used for types.
+ */
+namespace dl {
+    inline constexpr const char* libcurl = "libcurl.so.4";
+    inline constexpr const char* libqrencode = "libqrencode.so.4";
+    inline constexpr const char* libwayland_client = "libwayland-client.so.0";
+
+    /**
+     * @brief Look up symbol in shared library which is loaded on first call
+     * @details Libraries stay loaded until exit.  Throws std::runtime_error if library or symbol is not available
+     */
+    void* symbol(const char* library, const char* name);
+    template <typename T> T* symbol(const char* library, const char* name) { return (T*)symbol(library, name); }
+}
+
+/**
+ * Resolve function declared in library header once per call site(eg. WB_DLSYM(dl::libcurl, curl_easy_init)())
+ */
+#define WB_DLSYM(library, func) ([]{ static auto f = dl::symbol<decltype(func)>(library, #func); return f; }())
+
+#endif // __DL_H__
@@ -0,0 +1,352 @@
+/**
+ * @file image.cpp
+ * @brief Chunked, zstd compressed system image container
+ */
+#include <fcntl.h>
+#include <endian.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <future>
+
+#include <zstd.h>
+#include <openssl/evp.h>
+
+#include "misc.h"
+#include "workerpool.h"
+#include "image.h"
+
+static const char MAGIC[8] = { 'W', 'B', 'I', 'M', 'A', 'G', 'E', 1 };
+
+struct __attribute__((packed)) Header {
+    char magic[8];
+    uint32_t chunk_size;
+    uint32_t reserved;
+    uint64_t image_size;
+    uint64_t num_chunks;
+};
+
+struct __attribute__((packed)) IndexEntry {
+    uint64_t offset;
+    uint32_t compressed_size; // 0 if all-zero
+    uint32_t reserved;
+    uint8_t sha256[32];
+};
+
+// on-disk integers are little endian so that containers are portable across architectures
+static Header to_le(Header header)
+{
+    header.chunk_size = htole32(header.chunk_size);
+    header.reserved = htole32(header.reserved);
+    header.image_size = htole64(header.image_size);
+    header.num_chunks = htole64(header.num_chunks);
+    return header;
+}
+
+static Header from_le(Header header)
+{
+    header.chunk_size = le32toh(header.chunk_size);
+    header.reserved = le32toh(header.reserved);
+    header.image_size = le64toh(header.image_size);
+    header.num_chunks = le64toh(header.num_chunks);
+    return header;
+}
+
+static IndexEntry to_le(IndexEntry entry)
+{
+    entry.offset = htole64(entry.offset);
+    entry.compressed_size = htole32(entry.compressed_size);
+    entry.reserved = htole32(entry.reserved);
+    return entry;
+}
+
+static IndexEntry from_le(IndexEntry entry)
+{
+    entry.offset = le64toh(entry.offset);
+    entry.compressed_size = le32toh(entry.compressed_size);
+    entry.reserved = le32toh(entry.reserved);
+    return entry;
+}
+
+struct Chunk {
+    IndexEntry entry;
+    std::vector<char> data; // compressed on pack.  uncompressed on unpack
+};
+
+static size_t default_concurrency(size_t concurrency)
+{
+    return concurrency > 0? concurrency : std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+static void sha256(const char* data, size_t len, uint8_t (&md)[32])
+{
+    if (!EVP_Digest(data, len, md, NULL, EVP_sha256(), NULL)) throw std::runtime_error("EVP_Digest() failed");
+}
+
+static bool is_zero(const char* data, size_t len)
+{
+    static const char zero[4096] = {};
+    for (size_t i = 0; i < len; i += sizeof(zero)) {
+        if (memcmp(data + i, zero, std::min(len - i, sizeof(zero))) != 0) return false;
+    }
+    return true;
+}
+
+static void read_fully(int fd, char* buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        auto n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error("pread() failed (" + std::string(strerror(errno)) + ")");
+        if (n == 0) throw std::runtime_error("Unexpected end of file");
+        //else
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+static void write_fully(int fd, const char* buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        auto n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error("pwrite() failed (" + std::string(strerror(errno)) + ")");
+        //else
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+/**
+ * @brief Process chunks in parallel and consume the results in order
+ * @details Number of chunks in flight is bounded so that memory usage doesn't depend on image size.
+ */
+static void pipeline(uint64_t num_chunks, size_t concurrency,
+    std::function<Chunk(uint64_t)> process, std::function<void(uint64_t, Chunk&)> consume)
+{
+    WorkerPool pool(concurrency);
+    std::deque<std::future<Chunk>> in_flight;
+    uint64_t next = 0, done = 0;
+    try {
+        while (done < num_chunks) {
+            while (next < num_chunks && in_flight.size() < concurrency * 2) {
+                in_flight.push_back(pool.submit([&process,next]() { return process(next); }));
+                next++;
+            }
+            auto chunk = in_flight.front().get(); // rethrows error in worker
+            in_flight.pop_front();
+            consume(done++, chunk);
+        }
+    }
+    catch (...) {
+        // tasks refer to caller's stack.  don't leave them running
+        pool.cancel();
+        pool.wait();
+        throw;
+    }
+}
+
+namespace image {
+
+bool is_image(const std::filesystem::path& path)
+{
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    //else
+    char magic[sizeof(MAGIC)];
+    auto n = read(fd, magic, sizeof(magic));
+    close(fd);
+    return n == sizeof(magic) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+void create(const std::filesystem::path& src, const std::filesystem::path& dst, const PackOptions& options/* = {}*/,
+    std::function<void(uint64_t,uint64_t)> progress/* = [](auto,auto){}*/)
+{
+    if (options.chunk_size == 0) throw std::runtime_error("Chunk size must not be 0");
+    //else
+    auto in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) throw std::runtime_error("Unable to open " + src.string());
+    std::shared_ptr<void> in_guard(nullptr, [in](auto){ close(in); });
+    struct stat statbuf;
+    if (fstat(in, &statbuf) < 0) throw std::runtime_error("Unable to stat " + src.string());
+    //else
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Header header = {
+        .chunk_size = options.chunk_size, .reserved = 0,
+        .image_size = (uint64_t)statbuf.st_size,
+        .num_chunks = ((uint64_t)statbuf.st_size + options.chunk_size - 1) / options.chunk_size
+    };
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+
+    auto out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (out < 0) throw std::runtime_error("Unable to open " + dst.string());
+    std::shared_ptr<void> out_guard(nullptr, [out](auto){ close(out); });
+
+    std::vector<IndexEntry> index(header.num_chunks);
+    uint64_t offset = sizeof(header) + sizeof(IndexEntry) * index.size();
+    pipeline(header.num_chunks, default_concurrency(options.concurrency), [&](uint64_t i) {
+        size_t len = std::min((uint64_t)header.chunk_size, header.image_size - i * header.chunk_size);
+        std::vector<char> buf(len);
+        read_fully(in, buf.data(), len, i * header.chunk_size);
+        Chunk chunk = {};
+        sha256(buf.data(), len, chunk.entry.sha256);
+        if (is_zero(buf.data(), len)) return chunk;
+        //else
+        chunk.data.resize(ZSTD_compressBound(len));
+        auto compressed = ZSTD_compress(chunk.data.data(), chunk.data.size(), buf.data(), len, options.level);
+        if (ZSTD_isError(compressed)) throw std::runtime_error(std::string("ZSTD_compress() failed: ") + ZSTD_getErrorName(compressed));
+        //else
+        chunk.data.resize(compressed);
+        chunk.entry.compressed_size = compressed;
+        return chunk;
+    }, [&](uint64_t i, Chunk& chunk) {
+        if (chunk.entry.compressed_size > 0) {
+            chunk.entry.offset = offset;
+            write_fully(out, chunk.data.data(), chunk.data.size(), offset);
+            offset += chunk.data.size();
+        }
+        index[i] = chunk.entry;
+        progress(std::min((i + 1) * header.chunk_size, header.image_size), header.image_size);
+    });
+
+    auto le_header = to_le(header);
+    for (auto& entry : index) entry = to_le(entry);
+    write_fully(out, (const char*)&le_header, sizeof(le_header), 0);
+    write_fully(out, (const char*)index.data(), sizeof(IndexEntry) * index.size(), sizeof(header));
+    if (fdatasync(out) < 0) throw std::runtime_error("fdatasync() failed on " + dst.string());
+}
+
+std::vector<std::optional<std::string>> extract(const std::filesystem::path& src, const std::vector<std::filesystem::path>& dsts,
+    std::function<void(uint64_t,uint64_t)> progress/* = [](auto,auto){}*/, size_t concurrency/* = 0*/)
+{
+    auto in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) throw std::runtime_error("Unable to open " + src.string());
+    std::shared_ptr<void> in_guard(nullptr, [in](auto){ close(in); });
+    Header header;
+    read_fully(in, (char*)&header, sizeof(header), 0);
+    header = from_le(header);
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) throw std::runtime_error(src.string() + " is not an image container");
+    if (header.chunk_size == 0 || header.num_chunks != (header.image_size + header.chunk_size - 1) / header.chunk_size) {
+        throw std::runtime_error(src.string() + " has broken header");
+    }
+    //else
+    std::vector<IndexEntry> index(header.num_chunks);
+    read_fully(in, (char*)index.data(), sizeof(IndexEntry) * index.size(), sizeof(header));
+    for (auto& entry : index) entry = from_le(entry);
+
+    std::vector<int> outs;
+    std::vector<std::optional<std::string>> errors(dsts.size());
+    std::shared_ptr<void> outs_guard(nullptr, [&outs](auto){ for (auto fd : outs) if (fd >= 0) close(fd); });
+    for (size_t i = 0; i < dsts.size(); i++) {
+        auto fd = open(dsts[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd < 0) errors[i] = "Unable to open " + dsts[i].string() + " (" + strerror(errno) + ")";
+        // reserve space upfront so that the destination doesn't get fragmented(failure is harmless)
+        else fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, header.image_size);
+        outs.push_back(fd);
+    }
+    // a failing destination is dropped and others go on
+    auto write_all = [&outs,&errors,&dsts](const std::string& what, std::function<int(int)> func) {
+        for (size_t i = 0; i < outs.size(); i++) {
+            if (outs[i] < 0) continue;
+            try {
+                if (func(outs[i]) < 0) throw std::runtime_error(what + " failed (" + strerror(errno) + ")");
+            }
+            catch (const std::runtime_error& e) {
+                errors[i] = dsts[i].string() + ": " + e.what();
+                close(outs[i]);
+                outs[i] = -1;
+            }
+        }
+    };
+
+    pipeline(header.num_chunks, default_concurrency(concurrency), [&](uint64_t i) {
+        const auto& entry = index[i];
+        Chunk chunk = { .entry = entry };
+        if (entry.compressed_size == 0) return chunk; // all-zero
+        //else
+        size_t len = std::min((uint64_t)header.chunk_size, header.image_size - i * header.chunk_size);
+        std::vector<char> compressed(entry.compressed_size);
+        read_fully(in, compressed.data(), compressed.size(), entry.offset);
+        chunk.data.resize(len);
+        auto decompressed = ZSTD_decompress(chunk.data.data(), len, compressed.data(), compressed.size());
+        if (ZSTD_isError(decompressed) || decompressed != len) {
+            throw std::runtime_error("Chunk " + std::to_string(i) + " of " + src.string() + " is corrupted");
+        }
+        uint8_t md[32];
+        sha256(chunk.data.data(), len, md);
+        if (memcmp(md, entry.sha256, sizeof(md)) != 0) {
+            throw std::runtime_error("Checksum mismatch in chunk " + std::to_string(i) + " of " + src.string());
+        }
+        return chunk;
+    }, [&](uint64_t i, Chunk& chunk) {
+        if (!chunk.data.empty()) {
+            write_all("pwrite()", [&](int fd) {
+                write_fully(fd, chunk.data.data(), chunk.data.size(), i * header.chunk_size);
+                return 0;
+            });
+        }
+        progress(std::min((i + 1) * header.chunk_size, header.image_size), header.image_size);
+    });
+
+    // extends the files over trailing all-zero chunks
+    write_all("ftruncate()", [&header](int fd) { return ftruncate(fd, header.image_size); });
+    // each destination is usually an independent disk.  flush them at once
+    std::vector<std::future<int>> syncs;
+    for (auto fd : outs) {
+        syncs.push_back(std::async(std::launch::async, [fd]() { return fd >= 0? fdatasync(fd) : 0; }));
+    }
+    for (size_t i = 0; i < syncs.size(); i++) {
+        if (syncs[i].get() < 0) errors[i] = "fdatasync() failed on " + dsts[i].string();
+    }
+    return errors;
+}
+
+uint64_t extract(const std::filesystem::path& src, const std::filesystem::path& dst,
+    std::function<void(uint64_t,uint64_t)> progress/* = [](auto,auto){}*/, size_t concurrency/* = 0*/)
+{
+    auto errors = extract(src, std::vector<std::filesystem::path>{dst}, progress, concurrency);
+    if (errors[0]) throw std::runtime_error(*errors[0]);
+    //else
+    return std::filesystem::file_size(dst);
+}
+
+int pack(const std::filesystem::path& src, const std::filesystem::path& dst, const PackOptions& options)
+{
+    bool tty = isatty(STDOUT_FILENO);
+    create(src, dst, options, [tty](uint64_t done, uint64_t total) {
+        if (tty) std::cout << "\r" << human_readable(done) << "/" << human_readable(total) << std::flush;
+    });
+    if (tty) std::cout << std::endl;
+    std::cout << dst.string() << ": " << human_readable(std::filesystem::file_size(dst)) << std::endl;
+    return 0;
+}
+
+int unpack(const std::filesystem::path& src, const std::filesystem::path& dst)
+{
+    bool tty = isatty(STDOUT_FILENO);
+    extract(src, dst, [tty](uint64_t done, uint64_t total) {
+        if (tty) std::cout << "\r" << human_readable(done) << "/" << human_readable(total) << std::flush;
+    });
+    if (tty) std::cout << std::endl;
+    return 0;
+}
+
+} // namespace image
+
+#ifdef __VSCODE_ACTIVE_FILE__
+int main(int argc, char* argv[])
+{
+    if (argc < 3) return 1;
+    image::create(argv[1], std::string(argv[2]) + ".wbimg");
+    return image::extract(std::string(argv[2]) + ".wbimg", argv[2]) > 0? 0 : 1;
+}
+#endif
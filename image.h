@@ -0,0 +1,49 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <functional>
+
+/**
+ * Chunked image container
+ *
+ * Layout(all integers are little endian):
+ *   Header  magic "WBIMAGE\1", chunk size(u32), reserved(u32), image size(u64), number of chunks(u64)
+ *   Index   per chunk: offset of compressed data(u64), compressed size(u32, 0 for all-zero chunk), reserved(u32),
+ *           SHA-256 of uncompressed data(32 bytes)
+ *   Data    zstd frames, one per non-zero chunk
+ */
+namespace image {
+    struct PackOptions {
+        uint32_t chunk_size = 4 * 1024 * 1024;
+        int level = 3; // zstd compression level
+        size_t concurrency = 0; // 0 for number of CPUs
+    };
+    bool is_image(const std::filesystem::path& path);
+    /**
+     * @brief Pack raw image into container
+     * @details Chunks are checksummed and compressed in parallel.  All-zero chunks are stored as index entry only.
+     */
+    void create(const std::filesystem::path& src, const std::filesystem::path& dst, const PackOptions& options = {},
+        std::function<void(uint64_t/*done*/,uint64_t/*total*/)> progress = [](auto,auto){});
+    /**
+     * @brief Decompress container into raw image
+     * @details Chunks are decompressed and verified in parallel and written sequentially.  All-zero chunks are not written.
+     * @return Size of the image
+     */
+    uint64_t extract(const std::filesystem::path& src, const std::filesystem::path& dst,
+        std::function<void(uint64_t/*done*/,uint64_t/*total*/)> progress = [](auto,auto){}, size_t concurrency = 0);
+    /**
+     * @brief Decompress container into multiple raw images at once
+     * @return Error for each destination(std::nullopt if succeeded).  A failing destination doesn't stop others
+     */
+    std::vector<std::optional<std::string>> extract(const std::filesystem::path& src, const std::vector<std::filesystem::path>& dsts,
+        std::function<void(uint64_t/*done*/,uint64_t/*total*/)> progress = [](auto,auto){}, size_t concurrency = 0);
+
+    int pack(const std::filesystem::path& src, const std::filesystem::path& dst, const PackOptions& options);
+    int unpack(const std::filesystem::path& src, const std::filesystem::path& dst);
+}
+
+#endif // __IMAGE_H__
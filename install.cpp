@@ -1,25 +1,29 @@
 #include <unistd.h>
-#include <glob.h>
+#include <string.h>
 #include <sys/mount.h>
-#include <sys/sysmacros.h>
-#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 
 #include <iostream>
+#include <fstream>
+#include <set>
+#include <mutex>
+#include <future>
 
 #include <libmount/libmount.h>
-#include <blkid/blkid.h>
 #include <libsmartcols/libsmartcols.h>
-
-#include <ext/stdio_filebuf.h> // for __gnu_cxx::stdio_filebuf
-#include <nlohmann/json.hpp>
+#include <libfdisk/libfdisk.h>
 
 #include "misc.h"
+#include "blockdev.h"
+#include "image.h"
+#include "workerpool.h"
+#include "trace.h"
 #include "install.h"
 
 static void exec_command(const std::string& cmd, const std::vector<std::string>& args)
 {
+    trace::Scope scope("exec", cmd);
     pid_t pid = fork();
     if (pid < 0) std::runtime_error("fork() failed");
     //else
@@ -39,133 +43,105 @@ static void exec_command(const std::string& cmd, const std::vector<std::string>&
     if (!WIFEXITED(status) || WEXITSTATUS(status)  != 0) throw std::runtime_error(cmd);
 }
 
-static int glob(const char* pattern, int flags, int errfunc(const char *epath, int eerrno), std::vector<std::filesystem::path>& match)
+struct PartitionSpec {
+    uint64_t start; // in bytes
+    std::optional<uint64_t> size; // in bytes.  to the end of disk if std::nullopt
+    bool esp; // EFI system partition(also marked active for BIOS on dos label)
+};
+
+/**
+ * @brief Write partition table with libfdisk
+ * @param dos true for MBR(dos) label, false for GPT
+ */
+static void write_partition_table(const std::filesystem::path& disk, bool dos, const std::vector<PartitionSpec>& partitions)
 {
-  glob_t globbuf;
-  match.clear();
-  int rst = glob(pattern, GLOB_NOESCAPE, NULL, &globbuf);
-  if (rst == GLOB_NOMATCH) return 0;
-  if (rst != 0) throw std::runtime_error("glob");
-  //else
-  for (int i = 0; i < globbuf.gl_pathc; i++) {
-    match.push_back(std::filesystem::path(globbuf.gl_pathv[i]));
-  }
-  globfree(&globbuf);
-  return match.size();
-}
-
-static std::optional<std::filesystem::path> get_partition(const std::filesystem::path& disk, uint8_t num)
-{
-  if (!std::filesystem::is_block_file(disk)) throw std::runtime_error("Not a block device");
-
-  struct stat s;
-  if (stat(disk.c_str(), &s) < 0) throw std::runtime_error("stat");
-
-  char pattern[128];
-  sprintf(pattern, "/sys/dev/block/%d:%d/*/partition",
-    major(s.st_rdev), minor(s.st_rdev));
-
-  std::vector<std::filesystem::path> match;
-  glob(pattern, GLOB_NOESCAPE, NULL, match);
-  for (auto& path: match) {
-    std::ifstream part(path);
-    uint16_t partno;
-    part >> partno;
-    if (partno == num) {
-      std::ifstream dev(path.replace_filename("dev"));
-      std::string devno;
-      dev >> devno;
-      std::filesystem::path devblock("/dev/block/");
-      auto devspecial = std::filesystem::read_symlink(devblock.replace_filename(devno));
-      return devspecial.is_absolute()? devspecial : std::filesystem::canonical(devblock.replace_filename(devspecial));
+    std::shared_ptr<fdisk_context> cxt(fdisk_new_context(), fdisk_unref_context);
+    if (!cxt) throw std::runtime_error("fdisk_new_context() failed");
+    if (fdisk_assign_device(cxt.get(), disk.c_str(), 0) < 0) throw std::runtime_error("Unable to open " + disk.string());
+    //else
+    fdisk_disable_dialogs(cxt.get(), 1);
+    fdisk_enable_wipe(cxt.get(), 1); // wipe signatures of old filesystems
+    if (fdisk_create_disklabel(cxt.get(), dos? "dos" : "gpt") < 0) {
+        fdisk_deassign_device(cxt.get(), 1);
+        throw std::runtime_error("Unable to create disk label on " + disk.string());
     }
-  }
-  return std::nullopt;
-}
-
-static std::optional<std::string> get_partition_uuid(const std::filesystem::path& partition)
-{
-  blkid_cache cache;
-  if (blkid_get_cache(&cache, "/dev/null") != 0) return std::nullopt;
-  // else
-  std::optional<std::string> rst = std::nullopt;
-  if (blkid_probe_all(cache) == 0) {
-    auto tag_value = blkid_get_tag_value(cache, "UUID", partition.c_str());
-    if (tag_value) rst = tag_value;
-  }
-  blkid_put_cache(cache);
-  return rst;
-}
-
-static bool is_all_descendants_free(nlohmann::json& blockdevice)
-{
-    if (!blockdevice.contains("children")) return true;
     //else
-    for (auto& child : blockdevice["children"]) {
-        if (!child["mountpoint"].is_null() || child["type"] != "part") return false;
-        //else
-        if (!is_all_descendants_free(child)) return false;
+    auto label = fdisk_get_label(cxt.get(), NULL);
+    auto sector_size = fdisk_get_sector_size(cxt.get());
+    for (size_t i = 0; i < partitions.size(); i++) {
+        const auto& spec = partitions[i];
+        std::shared_ptr<fdisk_partition> pa(fdisk_new_partition(), fdisk_unref_partition);
+        fdisk_partition_set_partno(pa.get(), i);
+        fdisk_partition_set_start(pa.get(), spec.start / sector_size);
+        if (spec.size) fdisk_partition_set_size(pa.get(), *spec.size / sector_size);
+        else fdisk_partition_end_follow_default(pa.get(), 1);
+        auto type = dos? fdisk_label_get_parttype_from_code(label, spec.esp? 0xef : 0x83)
+            : fdisk_label_get_parttype_from_string(label, spec.esp? "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"/*EFI System*/
+                : "0FC63DAF-8483-4772-8E79-3D69D8477DE4"/*Linux filesystem*/);
+        if (type) fdisk_partition_set_type(pa.get(), type);
+        size_t partno;
+        if (fdisk_add_partition(cxt.get(), pa.get(), &partno) < 0) {
+            fdisk_deassign_device(cxt.get(), 1);
+            throw std::runtime_error("Unable to add partition " + std::to_string(i + 1) + " to " + disk.string());
+        }
+        if (dos && spec.esp) fdisk_toggle_partition_flag(cxt.get(), partno, DOS_FLAG_ACTIVE);
     }
-    return true;
+    if (fdisk_write_disklabel(cxt.get()) < 0) {
+        fdisk_deassign_device(cxt.get(), 1);
+        throw std::runtime_error("Unable to write partition table to " + disk.string());
+    }
+    //else
+    fdisk_reread_partition_table(cxt.get());
+    if (fdisk_deassign_device(cxt.get(), 0) < 0) throw std::runtime_error("Unable to sync " + disk.string());
 }
 
-static nlohmann::json lsblk()
-{
-    auto fd = memfd_create("lsblk", 0);
-    if (fd < 0) throw std::runtime_error("memfd_create() failed");
-
-    __gnu_cxx::stdio_filebuf<char> filebuf(fd, std::ios::in); // this cleans up fd in dtor
-
-    auto pid = fork();
-    if (pid < 0) throw std::runtime_error("fork() failed");
-    if (pid == 0) {
-        dup2(fd, STDOUT_FILENO);
-        _exit(execlp("lsblk", "lsblk", "-b", "-n", "-J", "-o", "NAME,MODEL,TYPE,RO,MOUNTPOINT,SIZE,TRAN,LOG-SEC,MAJ:MIN", NULL));
+/**
+ * @brief Mount a device on a temporary directory for the lifetime of the object
+ */
+class TempMount {
+    std::filesystem::path _path;
+public:
+    TempMount(const std::filesystem::path& device, const char* fstype, int flags, const char* data)
+    {
+        struct libmnt_context *ctx = mnt_new_context();
+        if (!ctx) throw std::runtime_error("mnt_new_context");
+        // else
+
+        // device name is included as multiple disks may be installed at once
+        _path = std::filesystem::temp_directory_path() /= std::string("mount-") + std::to_string(getpid()) + "-" + device.filename().string();
+        std::filesystem::create_directory(_path);
+        mnt_context_set_fstype_pattern(ctx, fstype);
+        mnt_context_set_source(ctx, device.c_str());
+        mnt_context_set_target(ctx, _path.c_str());
+        mnt_context_set_mflags(ctx, flags);
+        mnt_context_set_options(ctx, data);
+        auto rst = mnt_context_mount(ctx);
+        auto status1 = mnt_context_get_status(ctx);
+        auto status2 = mnt_context_get_helper_status(ctx);
+        mnt_free_context(ctx);
+        if (rst != 0 || status1 != 1 || status2 != 0) {
+            std::filesystem::remove(_path);
+            if (rst != 0) throw std::runtime_error("mnt_context_mount");
+            if (status1 != 1) throw std::runtime_error("mnt_context_get_status");
+            throw std::runtime_error("mnt_context_get_helper_status");
+        }
     }
-    int wstatus;
-    if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
-        throw std::runtime_error("subprocess exited with error");
+    ~TempMount()
+    {
+        umount(_path.c_str());
+        std::filesystem::remove(_path);
     }
-    lseek(fd, 0, SEEK_SET);
-    std::istream f(&filebuf);
-    return nlohmann::json::parse(f)["blockdevices"];
-}
+    TempMount(const TempMount&) = delete;
+    TempMount& operator=(const TempMount&) = delete;
+
+    const std::filesystem::path& path() const { return _path; }
+};
 
 template <typename T> T with_tempmount(const std::filesystem::path& device, const char* fstype, int flags, const char* data,
     std::function<T(const std::filesystem::path&)> func)
 {
-    struct libmnt_context *ctx = mnt_new_context();
-    if (!ctx) throw std::runtime_error("mnt_new_context");
-    // else
-
-    auto path = std::filesystem::temp_directory_path() /= std::string("mount-") + std::to_string(getpid());
-    std::filesystem::create_directory(path);
-    mnt_context_set_fstype_pattern(ctx, fstype);
-    mnt_context_set_source(ctx, device.c_str());
-    mnt_context_set_target(ctx, path.c_str());
-    mnt_context_set_mflags(ctx, flags);
-    mnt_context_set_options(ctx, data);
-    auto rst = mnt_context_mount(ctx);
-    auto status1 = mnt_context_get_status(ctx);
-    auto status2 = mnt_context_get_helper_status(ctx);
-    mnt_free_context(ctx);
-    if (rst > 1) throw std::runtime_error("mnt_context_mount");
-    if (rst != 0) throw std::runtime_error("mnt_context_mount");
-    //else
-    if (status1 != 1) throw std::runtime_error("mnt_context_get_status");
-    if (status2 != 0) throw std::runtime_error("mnt_context_get_helper_status");
-    //else
-    try {
-        auto rst = func(path);
-        umount(path.c_str());
-        std::filesystem::remove(path);
-        return rst;
-    }
-    catch (...) {
-        umount(path.c_str());
-        std::filesystem::remove(path);
-        throw;
-    }
+    TempMount mnt(device, fstype, flags, data);
+    return func(mnt.path());
 }
 
 static void grub_mkimage(const std::filesystem::path& boot_partition_dir)
@@ -191,87 +167,147 @@ namespace install {
 std::map<std::string,Disk> enum_usable_disks(uint64_t least_size)
 {
     std::map<std::string,Disk> disks;
-    for (auto& blockdevice : lsblk()) {
-        if (blockdevice["type"] != "disk" || blockdevice["ro"] == true /*|| blockdevice["tran"].is_null() // virtio disks doesn't have this*/
-            || blockdevice["size"].get<uint64_t>() < least_size || !blockdevice["log-sec"].is_number_integer()
-            || !blockdevice["mountpoint"].is_null() || !is_all_descendants_free(blockdevice)) continue;
-        std::string name = blockdevice["name"];
-        disks["/dev/" + name] = {
-            .name = name,
-            .model = blockdevice["model"].is_null()? std::nullopt : std::make_optional(blockdevice["model"]),
-            .size = blockdevice["size"].get<uint64_t>(),
-            .tran = blockdevice["tran"].is_null()? std::nullopt : std::make_optional(blockdevice["tran"]),
-            .log_sec = blockdevice["log-sec"].get<uint16_t>()
+    for (const auto& device : blockdev::get_block_devices()) {
+        if (device.type != "disk" || device.ro /*|| !device.tran // virtio disks doesn't have this*/
+            || device.size < least_size || !blockdev::is_free(device)) continue;
+        disks["/dev/" + device.name] = {
+            .name = device.name,
+            .model = device.model,
+            .size = device.size,
+            .tran = device.tran,
+            .log_sec = device.log_sec
         };
     }
     return disks;
 }
 
-bool install(const std::filesystem::path& disk, uint64_t least_size, 
+std::map<std::string,std::optional<std::string>> install(const std::vector<std::filesystem::path>& disks, uint64_t least_size,
     const std::filesystem::path& system_img,
     const std::map<std::string,std::string>& grub_vars,
-    std::function<void(double)> progress/* = [](auto){}*/, 
-    std::function<void(const std::string&)> message/* = [](auto){}*/)
+    std::function<void(const std::string&,double)> progress/* = [](auto,auto){}*/,
+    std::function<void(const std::string&,const std::string&)> message/* = [](auto,auto){}*/)
 {
-    progress(0.01);
-    const auto disks = enum_usable_disks(least_size);
-    auto canonical_disk_name = std::filesystem::canonical(disk).string();
-    auto disk_i = disks.find(canonical_disk_name);
-    if (disk_i == disks.end()) throw std::runtime_error(canonical_disk_name + " is not a usable disk");
-    auto size = disk_i->second.size;
-    auto log_sec = disk_i->second.log_sec;
-
-    std::vector<std::string> parted_args = {"--script", disk.string()};
-    bool bios_compatible = (size <= 2199023255552L/*2TiB*/ && log_sec == 512);
-    parted_args.push_back(bios_compatible? "mklabel msdos" : "mklabel gpt");
-    bool has_secondary_partition = size >= 9000000000L; // more than 9GB
-
-    if (has_secondary_partition) {
-        parted_args.push_back("mkpart primary fat32 1MiB 8GiB");
-        parted_args.push_back("mkpart primary btrfs 8GiB -1");
-    } else {
-        message("Warning: Data area won't be created due to too small disk");
-        parted_args.push_back("mkpart primary fat32 1MiB -1");
-    }
-    parted_args.push_back("set 1 boot on");
-    if (bios_compatible) {
-        parted_args.push_back("set 1 esp on");
+    // callbacks are called from multiple threads
+    std::mutex callback_mutex;
+    auto _progress = [&](const std::string& disk, double fraction) {
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        progress(disk, fraction);
+    };
+    auto _message = [&](const std::string& disk, const std::string& msg) {
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        message(disk, msg);
+    };
+
+    struct Target {
+        std::string name; // canonical device path
+        Disk disk;
+        bool bios_compatible = false;
+        bool has_secondary_partition = false;
+        std::filesystem::path boot_partition;
+        std::optional<std::filesystem::path> data_partition = std::nullopt;
+        std::future<void> data_area = {}; // formatting of data partition
+        std::unique_ptr<TempMount> mnt;
+        std::optional<std::string> error = std::nullopt;
+    };
+    std::vector<Target> targets;
+    {
+        for (const auto& disk : disks) _progress(disk.string(), 0.01);
+        const auto usable_disks = enum_usable_disks(least_size); // enumerated only once for all targets
+        std::set<std::string> names;
+        for (const auto& disk : disks) {
+            auto canonical_disk_name = std::filesystem::canonical(disk).string();
+            auto disk_i = usable_disks.find(canonical_disk_name);
+            if (disk_i == usable_disks.end()) throw std::runtime_error(canonical_disk_name + " is not a usable disk");
+            if (!names.insert(canonical_disk_name).second) throw std::runtime_error(canonical_disk_name + " is specified more than once");
+            //else
+            targets.push_back({ .name = canonical_disk_name, .disk = disk_i->second });
+        }
     }
 
-    message("Creating partitions...");
-    std::flush(std::cout);
-    exec_command("parted", parted_args);
-    exec_command("udevadm", {"settle"});
-    message("Creating partitions done.");
+    // run func for each target still alive in parallel
+    WorkerPool pool(targets.size());
+    auto for_each_target = [&pool,&targets,&_message](std::function<void(Target&)> func) {
+        std::vector<std::future<void>> futures;
+        for (auto& target : targets) {
+            if (target.error) continue;
+            //else
+            futures.push_back(pool.submit([&target,&func,&_message]() {
+                try {
+                    func(target);
+                }
+                catch (const std::runtime_error& e) {
+                    target.error = e.what();
+                    target.mnt.reset();
+                    _message(target.name, std::string("Error: ") + e.what());
+                }
+            }));
+        }
+        for (auto& future : futures) future.get();
+    };
+
+    for_each_target([&](Target& target) {
+        auto message = [&](const std::string& msg) { _message(target.name, msg); };
+        auto progress = [&](double fraction) { _progress(target.name, fraction); };
+        auto size = target.disk.size;
+        auto log_sec = target.disk.log_sec;
+
+        target.bios_compatible = (size <= 2199023255552L/*2TiB*/ && log_sec == 512);
+        target.has_secondary_partition = size >= 9000000000L; // more than 9GB
+
+        std::vector<PartitionSpec> partition_specs;
+        if (target.has_secondary_partition) {
+            partition_specs.push_back({ .start = 1024 * 1024/*1MiB*/, .size = 8LL * 1024 * 1024 * 1024 - 1024 * 1024, .esp = true });
+            partition_specs.push_back({ .start = 8LL * 1024 * 1024 * 1024/*8GiB*/, .size = std::nullopt, .esp = false });
+        } else {
+            message("Warning: Data area won't be created due to too small disk");
+            partition_specs.push_back({ .start = 1024 * 1024/*1MiB*/, .size = std::nullopt, .esp = true });
+        }
 
-    progress(0.03);
+        message("Creating partitions...");
+        auto since = std::chrono::system_clock::now();
+        write_partition_table(target.name, target.bios_compatible, partition_specs);
+        std::vector<uint16_t> partnos = {1};
+        if (target.has_secondary_partition) partnos.push_back(2);
+        auto partitions = blockdev::wait_for_partitions(target.name, partnos, since);
+        message("Creating partitions done.");
 
-    auto _boot_partition = get_partition(disk, 1);
-    if (!_boot_partition) {
-        message("Error: Unable to determine boot partition");
-        throw std::runtime_error("No boot partition");
-    }
-    //else
-    auto boot_partition = _boot_partition.value();
+        progress(0.03);
 
-    message("Formatting boot partition with FAT32");
-    exec_command("mkfs.vfat",{"-F","32",boot_partition});
+        target.boot_partition = partitions[0];
+        if (target.has_secondary_partition) target.data_partition = partitions[1];
 
-    progress(0.05);
+        message("Formatting boot partition with FAT32");
+        exec_command("mkfs.vfat",{"-F","32",target.boot_partition});
 
-    message("Mouning boot partition...");
-    std::flush(std::cout);
-    bool done = with_tempmount<bool>(boot_partition, "vfat", MS_RELATIME, "fmask=177,dmask=077", 
-        [&disk,&system_img,&grub_vars,bios_compatible,&progress,&message](auto mnt) {
+        // data area is formatted while the system image is being copied
+        if (target.has_secondary_partition) {
+            auto boot_partition_uuid = blockdev::get_partition_uuid(target.boot_partition);
+            if (boot_partition_uuid) {
+                auto label = std::string("data-") + boot_partition_uuid.value();
+                auto partition_name = target.data_partition.value();
+                message("Formatting partition for data area with BTRFS in background...");
+                target.data_area = std::async(std::launch::async, [label,partition_name]() {
+                    exec_command("mkfs.btrfs", {"-q", "-L", label, "-f", partition_name.string()});
+                });
+            } else {
+                message("Warning: Unable to get UUID of boot partition. Data area won't be created");
+            }
+        }
+
+        progress(0.05);
+
+        message("Mouning boot partition...");
+        target.mnt = std::make_unique<TempMount>(target.boot_partition, "vfat", MS_RELATIME, "fmask=177,dmask=077");
+        const auto& mnt = target.mnt->path();
         message("Done");
 
         progress(0.07);
 
         message("Installing UEFI bootloader");
         grub_mkimage(mnt);
-        if (bios_compatible) {
+        if (target.bios_compatible) {
             message("Installing BIOS bootloader");
-            grub_install(mnt, disk);
+            grub_install(mnt, target.name);
         } else {
             message("This system will be UEFI-only as this disk cannot be treated by BIOS");
         }
@@ -299,74 +335,75 @@ bool install(const std::filesystem::path& disk, uint64_t least_size,
         }
 
         progress(0.10);
-
         message("Copying system file");
-        char buf[1024 * 1024]; // 1MB buffer
-        FILE* f1 = fopen(system_img.c_str(), "r");
-        if (!f1) throw std::runtime_error("Unable to open system file");
-        //else
-        struct stat statbuf;
-        if (fstat(fileno(f1), &statbuf) < 0 || statbuf.st_size == 0) {
-            fclose(f1);
-            throw std::runtime_error("Unable to stat system file");
+    });
+
+    // system image is read once and written to all targets
+    {
+        std::vector<Target*> copy_targets;
+        std::vector<std::filesystem::path> dsts;
+        for (auto& target : targets) {
+            if (target.error) continue;
+            //else
+            copy_targets.push_back(&target);
+            dsts.push_back(target.mnt->path() / "system.img");
         }
-        FILE* f2 = fopen((mnt / "system.img").c_str(), "w");
-        size_t r;
-        size_t cnt = 0;
-        uint8_t percentage = 0;
-        bool done = true;
-        do {
-            r = fread(buf, 1, sizeof(buf), f1);
-            fwrite(buf, 1, r, f2);
-            fflush(f2);
-            fdatasync(fileno(f2));
-            cnt += r;
-            std::flush(std::cout);
-            uint8_t new_percentage = cnt * 100 / statbuf.st_size;
-            if (new_percentage > percentage) {
-                percentage = new_percentage;
-                std::flush(std::cout);
+        if (!dsts.empty()) {
+            auto copy_progress = [&](uint64_t copied, uint64_t total) {
+                for (auto target : copy_targets) {
+                    if (!target->error) _progress(target->name, (double)copied / total * 0.8 + 0.1);
+                }
+            };
+            auto errors = image::is_image(system_img)?
+                image::extract(system_img, dsts, copy_progress) : copy_file_to_many(system_img, dsts, copy_progress);
+            for (size_t i = 0; i < copy_targets.size(); i++) {
+                if (!errors[i]) continue;
+                //else
+                copy_targets[i]->error = errors[i];
+                _message(copy_targets[i]->name, "Error: " + *errors[i]);
             }
-            progress((double)cnt / statbuf.st_size * 0.8 + 0.1);
-        } while (r == sizeof(buf));
-        std::cout << std::endl;
-        fclose(f1);
-        fclose(f2);
+        }
+    }
+
+    for_each_target([&](Target& target) {
+        auto message = [&](const std::string& msg) { _message(target.name, msg); };
         message("Unmounting boot partition...");
-        std::flush(std::cout);
-        return done;
-    });
-    message("Done");
-    if (!done) return false;
-    //else
+        target.mnt.reset();
+        message("Done");
 
-    progress(0.90);
+        _progress(target.name, 0.90);
 
-    if (has_secondary_partition) {
-        message("Constructing data area");
-        auto secondary_partition = get_partition(disk, 2);
-        if (secondary_partition) {
-            auto boot_partition_uuid = get_partition_uuid(boot_partition);
-            if (boot_partition_uuid) {
-                auto label = std::string("data-") + boot_partition_uuid.value();
-                auto partition_name = secondary_partition.value();
-                message("Formatting partition for data area with BTRFS...");
-                std::flush(std::cout);
-                exec_command("mkfs.btrfs", {"-q", "-L", label, "-f", partition_name.string()});
-                message("Done");
-            } else {
-                message("Warning: Unable to get UUID of boot partition. Data area won't be created");
-            }
-        } else {
-            message("Warning: Unable to determine partition for data area. Data area won't be created");
+        if (target.data_area.valid()) {
+            message("Constructing data area");
+            target.data_area.get();
+            message("Done");
         }
+        _progress(target.name, 1.00);
+    });
+
+    std::map<std::string,std::optional<std::string>> results;
+    for (const auto& target : targets) {
+        results[target.name] = target.error;
     }
-    progress(1.00);
+    return results;
+}
 
+bool install(const std::filesystem::path& disk, uint64_t least_size, 
+    const std::filesystem::path& system_img,
+    const std::map<std::string,std::string>& grub_vars,
+    std::function<void(double)> progress/* = [](auto){}*/, 
+    std::function<void(const std::string&)> message/* = [](auto){}*/)
+{
+    auto results = install(std::vector<std::filesystem::path>{disk}, least_size, system_img, grub_vars,
+        [&progress](auto, double fraction) { progress(fraction); },
+        [&message](auto, const std::string& msg) { message(msg); });
+    const auto& error = results.begin()->second;
+    if (error) throw std::runtime_error(*error);
+    //else
     return true;
 }
 
-int install(const std::filesystem::path& disk, const std::filesystem::path& system_image,
+int install(const std::vector<std::filesystem::path>& disks, const std::filesystem::path& system_image,
     bool text_mode, bool installer)
 {
     uint64_t least_size = 1024 * 1024 * 1024 * 8LL/*8GB*/;
@@ -379,9 +416,23 @@ int install(const std::filesystem::path& disk, const std::filesystem::path& syst
         throw std::runtime_error("Changing root filesystem propagation failed");
     }
 
-    return install(disk, least_size, system_image, grub_vars, [](auto){}, [](const std::string& message) {
-        std::cout << message << std::endl;
-    }) == 0;
+    if (disks.size() == 1) {
+        return install(disks[0], least_size, system_image, grub_vars, [](auto){}, [](const std::string& message) {
+            std::cout << message << std::endl;
+        }) == 0;
+    }
+    //else
+    auto results = install(disks, least_size, system_image, grub_vars, [](auto,auto){}, 
+        [](const std::string& disk, const std::string& message) {
+            std::cout << disk << ": " << message << std::endl;
+        }
+    );
+    bool all_success = true;
+    for (const auto& [disk, error] : results) {
+        std::cout << disk << ": " << (error? "FAILED(" + *error + ")" : std::string("OK")) << std::endl;
+        if (error) all_success = false;
+    }
+    return all_success? 0 : 1;
 }
 
 int show_usable_disks()
@@ -431,21 +482,19 @@ int create_install_media(const std::filesystem::path& disk, const std::filesyste
     if (disk_i->second.size > 2199023255552L/*2TiB*/) throw std::runtime_error("Disk is too large for FAT32.");
     if (!std::filesystem::exists(system_image)) throw std::runtime_error("System image file does not exist.");
 
-    std::vector<std::string> parted_args = {"parted", "--script", disk.string()};
     bool bios_compatible = (disk_i->second.log_sec == 512);
-    parted_args.push_back(bios_compatible? "mklabel msdos" : "mklabel gpt");
-    parted_args.push_back("mkpart primary fat32 1MiB -1");
-    parted_args.push_back("set 1 boot on");
-    if (bios_compatible) parted_args.push_back("set 1 esp on");
-    exec_command("parted", parted_args);
-    exec_command("udevadm", {"settle"});
-    auto boot_partition_path = get_partition(disk, 1);
-    if (!boot_partition_path) throw std::runtime_error("Unable to determine created boot partition");
+    auto since = std::chrono::system_clock::now();
+    write_partition_table(disk, bios_compatible, {{ .start = 1024 * 1024/*1MiB*/, .size = std::nullopt, .esp = true }});
+    std::optional<std::filesystem::path> boot_partition_path = blockdev::wait_for_partitions(disk, {1}, since)[0];
     exec_command("mkfs.vfat", {"-F", "32", "-n", "WBINSTALL", boot_partition_path.value()});
 
     return with_tempmount<int>(boot_partition_path.value(), "vfat", MS_RELATIME, "fmask=177,dmask=077", 
         [&disk,&system_image,&boot_partition_path,bios_compatible](const std::filesystem::path& mnt) {
-        std::filesystem::copy(system_image, mnt / "system.img");
+        if (image::is_image(system_image)) {
+            image::extract(system_image, mnt / "system.img");
+        } else {
+            copy_file_with_progress(system_image, mnt / "system.img");
+        }
         std::ofstream f(mnt / "system.cfg");
         if (!f) throw std::runtime_error("system.cfg cannot be opened");
         f << "set systemd_unit=\"installer.target\"" << std::endl;
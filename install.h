@@ -1,8 +1,12 @@
 #ifndef __INSTALL_H__
 #define __INSTALL_H__
 
-#include <filesystem>
+#include <map>
+#include <vector>
+#include <string>
 #include <optional>
+#include <functional>
+#include <filesystem>
 
 namespace install {
     struct Disk {
@@ -19,7 +23,17 @@ namespace install {
         const std::map<std::string,std::string>& grub_vars,
         std::function<void(double)> progress = [](auto){}, 
         std::function<void(const std::string&)> message = [](auto){});
-    int install(const std::filesystem::path& disk, const std::filesystem::path& system_image,
+    /**
+     * @brief Install to multiple disks at once
+     * @details Disks are partitioned and formatted concurrently and the system image is read only once for all of them.
+     * @return Error for each disk(std::nullopt if succeeded)
+     */
+    std::map<std::string,std::optional<std::string>> install(const std::vector<std::filesystem::path>& disks, uint64_t least_size,
+        const std::filesystem::path& system_img,
+        const std::map<std::string,std::string>& grub_vars,
+        std::function<void(const std::string&/*disk*/,double)> progress = [](auto,auto){},
+        std::function<void(const std::string&/*disk*/,const std::string&)> message = [](auto,auto){});
+    int install(const std::vector<std::filesystem::path>& disks, const std::filesystem::path& system_image,
         bool text_mode, bool installer);
     int show_usable_disks();
     int create_install_media(const std::filesystem::path& disk, const std::filesystem::path& system_image);
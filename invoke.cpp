@@ -4,198 +4,109 @@
  */
 #include <unistd.h>
 #include <sched.h>
-#include <sys/utsname.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
 #include <sys/mount.h>
-#include <arpa/inet.h>
-#include <net/if.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <signal.h>
 
 #include <iostream>
 #include <fstream>
 #include <thread>
+#include <chrono>
 #include <map>
+#include <mutex>
+#include <algorithm>
+#include <condition_variable>
+#include <semaphore>
 
 #include <nlohmann/json.hpp>
 #include <curl/curl.h>
 
 #include "install.h"
 #include "misc.h"
+#include "telemetry.h"
+#include "dl.h"
 
 static const uint64_t least_size = 1024 * 1024 * 1024 * 8LL/*8GB*/;
 
-static std::optional<std::string> get_interface_name_with_default_gateway()
-{
-    std::ifstream routes("/proc/net/route");
-    if (!routes) return std::nullopt;
-    std::string line;
-    if (!std::getline(routes, line)) return std::nullopt;// skip header
-    while (std::getline(routes, line)) {
-        std::string ifname;
-        auto i = line.begin();
-        while (i != line.end() && !isspace(*i)) ifname += *i++;
-        if (i == line.end()) continue; // no destination
-        while (i != line.end() && isspace(*i)) i++; // skip space(s)
-        std::string destination;
-        while (i != line.end() && !isspace(*i)) destination += *i++;
-
-        if (destination == "00000000") return ifname;
-    }
-    return std::nullopt; // not found
-}
-
-static std::optional<std::string> get_ipv4_address()
-{
-    auto ifname = get_interface_name_with_default_gateway();
-    if (!ifname || ifname.value().length() >= IFNAMSIZ) return std::nullopt;
-    //else
-    auto s = socket(AF_INET, SOCK_DGRAM, 0);
-    if (s < 0) return std::nullopt;
-    struct ifreq ifr;
-    memset(&ifr, 0, sizeof(ifr));
-    strcpy(ifr.ifr_name, ifname.value().c_str());
-    if (ioctl(s, SIOCGIFADDR, &ifr) < 0) return std::nullopt;
-    return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
-}
-
-static std::optional<std::string> get_cpu_model()
-{
-    std::ifstream f("/proc/cpuinfo");
-    if (!f) return std::nullopt;
-    std::string s;
-    while (std::getline(f, s)) {
-        if (s.starts_with("model name\t: ")) return s.substr(13);
-    }
-    return std::nullopt;
-}
-
-static std::optional<std::tuple<uint64_t,uint64_t,uint64_t>> get_cpu_clock() {
-    uint64_t cpuinfo_cur_freq;
-    uint64_t cpuinfo_min_freq = 0L, cpuinfo_max_freq = 0L;
-    try {
-        {
-            std::ifstream f("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_cur_freq");
-            if (!f) {
-                if(f.is_open()) f.close();
-                f.open("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq");
-                if (!f) return std::nullopt;
-            }
-            f >> cpuinfo_cur_freq;
-        }
-        {
-            std::ifstream f("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_min_freq");
-            if (f) {
-                f >> cpuinfo_min_freq;
-            }
-        }
-        {
-            std::ifstream f("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
-            if (f) {
-                f >> cpuinfo_max_freq;
-            }
-        }
-    }
-    catch (...) {
-        return std::nullopt;
-    }
-    return std::make_tuple(cpuinfo_cur_freq, cpuinfo_min_freq, cpuinfo_max_freq);
-}
-
-static std::optional<std::pair<uint64_t,uint64_t> > get_memory_capacity() {
-    std::ifstream meminfo("/proc/meminfo");
-    if (!meminfo) return std::nullopt;
-    std::string line;
-    uint64_t available = 0, total = 0;
-    while (std::getline(meminfo, line)) {
-        std::string column_name;
-        auto i = line.begin();
-        while (i != line.end() && *i != ':') column_name += *i++;
-        if (i == line.end()) continue; // unexpected EOL
-        i++; // skip ':'
-        while (i != line.end() && isspace(*i)) i++; // skip space(s)
-        std::string value, unit;
-        while (i != line.end() && !isspace(*i)) value += *i++;
-        while (i != line.end() && isspace(*i)) i++; // skip space(s)
-        if (i != line.end()) {
-            while (i != line.end()) unit += *i++;
-        }
-        if (column_name == "MemTotal" && unit == "kB") total = std::stoul(value) * 1024;
-        else if (column_name == "MemAvailable" && unit == "kB") available = std::stoul(value) * 1024;
-        if (total > 0 && available > 0) break;
-    }
-    if (total == 0 || available == 0) return std::nullopt;
-    //else
-    return std::make_pair(available, total);
-}
-
 namespace invoke {
 
-int sleep(const nlohmann::json& arguments)
+/**
+ * @brief Receives events(eg. progress of install) streamed while a command is running
+ * @details Event is an object like {"type":"progress","value":0.5} or {"type":"message","value":"...","disk":"/dev/sda"}
+ */
+using Emitter = std::function<void(const nlohmann::json&)>;
+
+nlohmann::json sleep(const nlohmann::json& arguments, const Emitter&)
 {
     auto seconds = arguments.get<uint8_t>();
     ::sleep(seconds);
-    std::cout << nlohmann::json({{"return", true}});
-    return 0;
+    return {{"return", true}};
 }
 
-int echo(const nlohmann::json& arguments)
+nlohmann::json echo(const nlohmann::json& arguments, const Emitter&)
 {
-    std::cout << arguments;
-    return 0;
+    return arguments;
 }
 
-int system_status(const nlohmann::json& arguments)
+nlohmann::json system_status(const nlohmann::json& arguments, const Emitter&)
 {
-    struct utsname u;
-    if (uname(&u) < 0) throw std::runtime_error("uname(2) failed");
-    std::string serial_number = u.nodename;
-    std::string kernel_version = u.release;
-    std::optional<std::string> ip_address = get_ipv4_address();
-    std::optional<std::string> cpu_model = get_cpu_model();
-    uint32_t cpus = std::thread::hardware_concurrency();
-    auto clock = get_cpu_clock();
-    auto memory = get_memory_capacity();
+    return {{"return", telemetry::Collector::get().collect()}};
+}
 
-    nlohmann::json result;
-    result["serial_number"] = serial_number;
-    result["kernel_version"] = kernel_version;
-    if (ip_address) result["ip_address"] = *ip_address;
-    if (cpu_model) result["cpu_model"] = *cpu_model;
-    result["cpus"] = cpus;
-    if (clock) {
-        result["clock"] = {
-            {"current", std::get<0>(*clock)},
-            {"min", std::get<1>(*clock)},
-            {"max", std::get<2>(*clock)}
-        };
+/**
+ * @brief Stream system status periodically
+ * @param arguments {"interval": seconds(default 1), "count": number of events(unlimited if omitted)}
+ * @details First event carries whole status, following ones carry only members changed since previous one.
+ */
+nlohmann::json watch_system_status(const nlohmann::json& arguments, const Emitter& emit)
+{
+    double interval = 1.0;
+    std::optional<uint64_t> count;
+    if (arguments.is_object()) {
+        if (arguments.contains("interval")) interval = arguments["interval"].get<double>();
+        if (arguments.contains("count")) count = arguments["count"].get<uint64_t>();
     }
-    if (memory) {
-        result["memory"] = {
-            {"unused", memory->first},
-            {"total", memory->second}
-        };
+    if (interval <= 0.0) throw std::runtime_error("interval must be positive");
+    //else
+    auto& collector = telemetry::Collector::get();
+    nlohmann::json prev;
+    auto next = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; !count || i < *count; i++) {
+        if (i > 0) std::this_thread::sleep_until(next);
+        auto cur = collector.collect();
+        emit({{"type", "status"}, {"value", i == 0? cur : telemetry::diff(prev, cur)}});
+        prev = std::move(cur);
+        next += std::chrono::microseconds((int64_t)(interval * 1000000));
     }
-    result["kvm"] = std::filesystem::exists("/dev/kvm");
-
-    std::cout << nlohmann::json({
-        {"return", result}
-    });
-
-    return 0;
+    return {{"return", true}};
 }
 
-int install(const nlohmann::json& arguments)
+/**
+ * @brief Install to a disk or disks
+ * @param arguments Disk name, or array of disk names to install to at once.  For the latter, events carry "disk"
+ */
+nlohmann::json install(const nlohmann::json& arguments, const Emitter& emit)
 {
-    auto disk = arguments.get<std::string>();
+    auto multi = arguments.is_array();
+    auto disks = multi? arguments.get<std::vector<std::string>>() : std::vector<std::string>{arguments.get<std::string>()};
+    auto event = [multi](const std::string& type, const std::string& disk, const nlohmann::json& value) {
+        nlohmann::json event = {{"type", type}, {"value", value}};
+        if (multi) event["disk"] = disk;
+        return event;
+    };
     if (getuid() > 0) {
         // mock install
-        if (disk == "/dev/error") throw std::runtime_error("Installation failed");
-        auto message = [](const std::string& msg) {
-            std::cout << "MESSAGE:" << msg << std::endl;
+        for (const auto& disk : disks) {
+            if (disk == "/dev/error") throw std::runtime_error("Installation failed");
+        }
+        auto message = [&](const std::string& msg) {
+            for (const auto& disk : disks) emit(event("message", disk, msg));
             usleep(200000);
         };
-        auto progress = [](const double fraction) {
-            std::cout << "PROGRESS:" << fraction << std::endl;
+        auto progress = [&](const double fraction) {
+            for (const auto& disk : disks) emit(event("progress", disk, fraction));
             usleep(200000);
         };
         message("Creating partitions...");
@@ -220,26 +131,41 @@ int install(const nlohmann::json& arguments)
         message("Formatting partition for data area with BTRFS...");
         message("Done");
         progress(1.00);
-        return 0;
+        return {{"return", true}};
     }
     //else
+    // mounts made during install are kept private to this thread(and threads it spawns)
     if (unshare(CLONE_NEWNS) < 0) throw std::runtime_error("unshare(CLONE_NEWNS) failed");
     if (mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
         throw std::runtime_error("Changing root filesystem propagation failed");
     }
-    auto rst = install::install(disk, least_size, "/run/initramfs/boot/system.img", 
+    auto results = install::install(std::vector<std::filesystem::path>(disks.begin(), disks.end()), least_size,
+            "/run/initramfs/boot/system.img", 
             {}, // grub vars
-            [](double fraction){
-                std::cout << "PROGRESS:" << fraction << std::endl;
+            [&](const std::string& disk, double fraction){
+                emit(event("progress", disk, fraction));
             },
-            [](const std::string& message){
-                std::cout << "MESSAGE:" << message << std::endl;
+            [&](const std::string& disk, const std::string& message){
+                emit(event("message", disk, message));
             }
         );
-    return rst? 0 : 1;
+    nlohmann::json disk_results;
+    bool all_success = true;
+    for (const auto& [disk, error] : results) {
+        disk_results[disk] = error? nlohmann::json(*error) : nlohmann::json(nullptr);
+        if (!error) continue;
+        //else
+        all_success = false;
+        if (!multi) throw std::runtime_error(*error);
+        //else
+        emit(event("error", disk, *error));
+    }
+    if (!all_success) return {{"error", "Installation failed"}, {"disks", disk_results}};
+    //else
+    return {{"return", multi? disk_results : nlohmann::json(true)}};
 }
 
-int get_usable_disks_for_install(const nlohmann::json&)
+nlohmann::json get_usable_disks_for_install(const nlohmann::json&, const Emitter&)
 {
     auto mock_disks = []() -> std::map<std::string,install::Disk> {
         std::map<std::string,install::Disk> disks;
@@ -283,59 +209,78 @@ int get_usable_disks_for_install(const nlohmann::json&)
         result["return"].push_back(obj);
     }
 
-    std::cout << result;
-    return 0;
+    return result;
 }
 
 /**
  * @brief Detect timezone using ip-api.com
- * @return 0 on success, 1 on failure
- * prints JSON to stdout
+ * @return Response object
  */
-int detect_timezone(const nlohmann::json&)
+nlohmann::json detect_timezone(const nlohmann::json&, const Emitter&)
 {
-    std::shared_ptr<CURL> curl(curl_easy_init(), curl_easy_cleanup);
-    curl_easy_setopt(curl.get(), CURLOPT_URL, "http://ip-api.com/json");
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, +[](char* ptr, size_t size, size_t nmemb, void* userdata) -> size_t {
+    std::shared_ptr<CURL> curl(WB_DLSYM(dl::libcurl, curl_easy_init)(), WB_DLSYM(dl::libcurl, curl_easy_cleanup));
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_URL, "http://ip-api.com/json");
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_WRITEFUNCTION, +[](char* ptr, size_t size, size_t nmemb, void* userdata) -> size_t {
         auto& buffer = *static_cast<std::string*>(userdata);
         buffer.append(ptr, size * nmemb);
         return size * nmemb;
     });
     std::string buffer;
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &buffer);
-    auto res = curl_easy_perform(curl.get());
-    if (res != CURLE_OK) throw std::runtime_error("curl_easy_perform() failed: " + std::string(curl_easy_strerror(res)));
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_WRITEDATA, &buffer);
+    auto res = WB_DLSYM(dl::libcurl, curl_easy_perform)(curl.get());
+    if (res != CURLE_OK) throw std::runtime_error("curl_easy_perform() failed: " + std::string(WB_DLSYM(dl::libcurl, curl_easy_strerror)(res)));
     auto json = nlohmann::json::parse(buffer);
     if (!json.contains("timezone")) throw std::runtime_error("timezone not found in response");
-    std::cout << nlohmann::json({
-        {"return", json["timezone"]}
-    });
-    return 0;
+    return {{"return", json["timezone"]}};
 }
 
 static std::map<std::string, 
-    std::pair<std::function<int(const nlohmann::json&)>,bool/*stream_response*/>> commands = {
+    std::pair<std::function<nlohmann::json(const nlohmann::json&, const Emitter&)>,bool/*stream_response*/>> commands = {
     {"echo", {echo, false}},
     {"sleep", {sleep, false}},
     {"system-status", {system_status, false}},
+    {"watch-system-status", {watch_system_status, true}},
     {"install", {install, true}},
     {"get-usable-disks-for-install", {get_usable_disks_for_install, false}},
     {"detect-timezone", {detect_timezone, false}}
 };
 
+/**
+ * @brief Execute a request
+ * @return Response object(or raw value for echo) and whether the command streams events
+ */
+static std::pair<nlohmann::json,bool> execute(const nlohmann::json& input, const Emitter& emit)
+{
+    if (!input.contains("execute")) throw std::runtime_error("command is not specified");
+    auto command = input["execute"].get<std::string>();
+    auto arguments = input.contains("arguments")? input["arguments"] : nlohmann::json(nullptr);
+    if (!commands.contains(command)) throw std::runtime_error("Unknown command: " + command);
+    //else
+    const auto& [func,stream_response] = commands[command];
+    return {func(arguments, emit), stream_response};
+}
+
 int invoke()
 {
     bool stream_response = false;
     try {
         auto input = nlohmann::json::parse(std::cin);
-        if (!input.contains("execute")) throw std::runtime_error("command is not specified");
-        auto command = input["execute"].get<std::string>();
-        auto arguments = input["arguments"];
-        if (!commands.contains(command)) throw std::runtime_error("Unknown command: " + command);
-        //else
-        auto& [func,_stream_response] = commands[command];
-        stream_response = _stream_response;
-        return func(arguments);
+        if (input.contains("execute") && commands.contains(input["execute"].get<std::string>())) {
+            stream_response = commands[input["execute"].get<std::string>()].second;
+        }
+        // events are printed as text lines for compatibility
+        auto [response, _stream_response] = execute(input, [](const nlohmann::json& event) {
+            std::string type = event["type"];
+            std::transform(type.begin(), type.end(), type.begin(), ::toupper);
+            std::cout << type << ':';
+            if (event.contains("disk")) std::cout << event["disk"].get<std::string>() << ':';
+            if (event["value"].is_string()) std::cout << event["value"].get<std::string>();
+            else if (event["value"].is_number()) std::cout << event["value"].get<double>();
+            else std::cout << event["value"];
+            std::cout << std::endl;
+        });
+        if (!stream_response) std::cout << response;
+        return response.is_object() && response.contains("error")? 1 : 0;
     }
     catch (const std::exception& err) {
         if (stream_response) {
@@ -347,12 +292,152 @@ int invoke()
     return 1;
 }
 
+/**
+ * @brief Newline-delimited JSON stream to a client
+ * @details Requests are read from in_fd.  Responses and events are written to out_fd, one object per line,
+ * each tagged with "id" of the request.
+ */
+class Connection {
+    int in_fd, out_fd;
+    std::mutex write_mutex;
+    std::mutex mutex;
+    std::condition_variable all_done, slot_available;
+    size_t in_flight = 0;
+    static const size_t max_in_flight = 16;
+public:
+    Connection(int _in_fd, int _out_fd) : in_fd(_in_fd), out_fd(_out_fd) {}
+
+    /**
+     * @return false if the client has gone
+     */
+    bool send(const nlohmann::json& message)
+    {
+        auto line = message.dump() + "\n";
+        std::lock_guard<std::mutex> lock(write_mutex);
+        for (size_t written = 0; written < line.size();) {
+            auto n = write(out_fd, line.data() + written, line.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            //else
+            written += n;
+        }
+        return true;
+    }
+
+    void handle(const std::string& line)
+    {
+        nlohmann::json id = nullptr;
+        try {
+            auto request = nlohmann::json::parse(line);
+            if (request.contains("id")) id = request["id"];
+            auto [response, stream_response] = execute(request, [this,&id](const nlohmann::json& event) {
+                // stops endless streams(eg. watch-system-status) once nobody listens
+                if (!send({{"id", id}, {"event", event}})) throw std::runtime_error("Client has gone");
+            });
+            if (!response.is_object()) response = {{"return", response}}; // echo
+            response["id"] = id;
+            send(response);
+        }
+        catch (const std::exception& err) {
+            send({{"id", id}, {"error", err.what()}});
+        }
+    }
+
+    /**
+     * @brief Read requests until EOF and handle each of them in its own thread
+     * @details At most max_in_flight requests run at once.  Reading stops until one of them finishes so that
+     * a client pipelining requests(or opening many streams) cannot make threads without bound.
+     */
+    void serve(std::shared_ptr<Connection> self)
+    {
+        std::string buf;
+        char chunk[4096];
+        while (true) {
+            auto n = read(in_fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            //else
+            buf.append(chunk, n);
+            size_t pos;
+            while ((pos = buf.find('\n')) != std::string::npos) {
+                auto line = buf.substr(0, pos);
+                buf.erase(0, pos + 1);
+                if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+                //else
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    slot_available.wait(lock, [this]() { return in_flight < max_in_flight; });
+                    in_flight++;
+                }
+                std::thread([self,line]() {
+                    self->handle(line);
+                    std::lock_guard<std::mutex> lock(self->mutex);
+                    self->in_flight--;
+                    self->slot_available.notify_one();
+                    if (self->in_flight == 0) self->all_done.notify_all();
+                }).detach();
+            }
+        }
+        // let requests in flight finish before the stream is closed
+        std::unique_lock<std::mutex> lock(mutex);
+        all_done.wait(lock, [this]() { return in_flight == 0; });
+    }
+};
+
+int serve(const std::optional<std::filesystem::path>& socket_path)
+{
+    signal(SIGPIPE, SIG_IGN);
+    if (!socket_path) {
+        auto conn = std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO);
+        conn->serve(conn);
+        return 0;
+    }
+    //else
+    auto sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) throw std::runtime_error("socket() failed");
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path->string().length() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path is too long");
+    strcpy(addr.sun_path, socket_path->c_str());
+    std::filesystem::remove(*socket_path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        throw std::runtime_error("bind() failed: " + std::string(strerror(errno)));
+    }
+    chmod(socket_path->c_str(), S_IRUSR | S_IWUSR);
+    if (listen(sock, 16) < 0) {
+        close(sock);
+        throw std::runtime_error("listen() failed");
+    }
+    // clients beyond this wait in the listen backlog until a connection closes
+    static std::counting_semaphore<> connection_slots(16);
+    while (true) {
+        connection_slots.acquire();
+        auto fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            connection_slots.release();
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            //else
+            close(sock);
+            throw std::runtime_error("accept4() failed: " + std::string(strerror(errno)));
+        }
+        std::thread([fd]() {
+            auto conn = std::make_shared<Connection>(fd, fd);
+            conn->serve(conn);
+            close(fd);
+            connection_slots.release();
+        }).detach();
+    }
+}
+
 } // namespace invoke
 
 #ifdef __VSCODE_ACTIVE_FILE__
 int main(int argc, char* argv[])
 {
     nlohmann::json arguments;
-    return system_status(arguments);
+    std::cout << invoke::system_status(arguments, [](auto){}) << std::endl;
+    return 0;
 }
 #endif
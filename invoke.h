@@ -1,8 +1,16 @@
 #ifndef __INVOKE_H__
 #define __INVOKE_H__
 
+#include <optional>
+#include <filesystem>
+
 namespace invoke {
     int invoke();
+    /**
+     * @brief Serve newline-delimited JSON requests({"id":..,"execute":..,"arguments":..}) until EOF
+     * @param socket_path UNIX domain socket to listen on.  stdin/stdout if std::nullopt
+     */
+    int serve(const std::optional<std::filesystem::path>& socket_path);
 }
 
 #endif // __INVOKE_H__
\ No newline at end of file
@@ -1,11 +1,26 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include <memory>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <vector>
+#include <future>
+#include <iterator>
 #include <wayland-client.h>
 
+#include "blockdev.h"
+#include "misc.h"
+#include "trace.h"
+#include "dl.h"
+
 std::string human_readable(uint64_t size, double k/* = 1024.0*/)
 {
     char buf[32];
@@ -33,10 +48,177 @@ std::string human_readable(uint64_t size, double k/* = 1024.0*/)
     return std::string(buf);
 }
 
+/**
+ * Copy a file without passing its data through user space whenever possible.
+ * copy_file_range(2) is tried first, then sendfile(2), then plain read/write as a last resort.
+ * progress is called after each chunk.  Data is synced to the device only once, at the end.
+ * @return number of bytes copied
+ */
+uint64_t copy_file_with_progress(const std::filesystem::path& src, const std::filesystem::path& dst,
+    std::function<void(uint64_t,uint64_t)> progress/* = [](auto,auto){}*/,
+    size_t chunk_size/* = 1024 * 1024*/)
+{
+    auto in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) throw std::runtime_error("Unable to open " + src.string());
+    std::shared_ptr<void> in_guard(nullptr, [in](auto){ close(in); });
+    struct stat statbuf;
+    if (fstat(in, &statbuf) < 0 || statbuf.st_size == 0) throw std::runtime_error("Unable to stat " + src.string());
+    //else
+    uint64_t total = statbuf.st_size;
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    auto out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (out < 0) throw std::runtime_error("Unable to open " + dst.string());
+    std::shared_ptr<void> out_guard(nullptr, [out](auto){ close(out); });
+    // reserve space upfront so that the destination doesn't get fragmented(failure is harmless)
+    fallocate(out, FALLOC_FL_KEEP_SIZE, 0, total);
+
+    enum { COPY_FILE_RANGE, SENDFILE, READ_WRITE } method = COPY_FILE_RANGE;
+    std::vector<char> buf;
+    uint64_t copied = 0;
+    while (copied < total) {
+        size_t len = std::min((uint64_t)chunk_size, total - copied);
+        ssize_t n;
+        if (method == COPY_FILE_RANGE) {
+            n = copy_file_range(in, NULL, out, NULL, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                method = SENDFILE; // e.g. across different filesystem types
+                continue;
+            }
+        } else if (method == SENDFILE) {
+            n = sendfile(out, in, NULL, len);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                method = READ_WRITE;
+                continue;
+            }
+        } else {
+            buf.resize(len);
+            n = read(in, buf.data(), len);
+            for (ssize_t written = 0; n > 0 && written < n;) {
+                auto w = write(out, buf.data() + written, n - written);
+                if (w < 0) {
+                    if (errno == EINTR) continue;
+                    throw std::runtime_error("Error writing to " + dst.string() + " (" + strerror(errno) + ")");
+                }
+                written += w;
+            }
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Error copying " + src.string() + " to " + dst.string() + " (" + strerror(errno) + ")");
+        }
+        if (n == 0) break; // source file shrunk while copying
+        //else
+        copied += n;
+        progress(copied, total);
+    }
+
+    if (fdatasync(out) < 0) throw std::runtime_error("fdatasync() failed on " + dst.string());
+    return copied;
+}
+
+std::vector<std::optional<std::string>> copy_file_to_many(const std::filesystem::path& src,
+    const std::vector<std::filesystem::path>& dsts,
+    std::function<void(uint64_t,uint64_t)> progress/* = [](auto,auto){}*/,
+    size_t chunk_size/* = 4 * 1024 * 1024*/)
+{
+    auto in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) throw std::runtime_error("Unable to open " + src.string());
+    std::shared_ptr<void> in_guard(nullptr, [in](auto){ close(in); });
+    struct stat statbuf;
+    if (fstat(in, &statbuf) < 0 || statbuf.st_size == 0) throw std::runtime_error("Unable to stat " + src.string());
+    //else
+    uint64_t total = statbuf.st_size;
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::vector<int> outs;
+    std::vector<std::optional<std::string>> errors(dsts.size());
+    std::shared_ptr<void> outs_guard(nullptr, [&outs](auto){ for (auto fd : outs) if (fd >= 0) close(fd); });
+    for (size_t i = 0; i < dsts.size(); i++) {
+        auto fd = open(dsts[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd < 0) errors[i] = "Unable to open " + dsts[i].string() + " (" + strerror(errno) + ")";
+        else fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, total); // failure is harmless
+        outs.push_back(fd);
+    }
+
+    std::vector<char> buf(chunk_size);
+    uint64_t copied = 0;
+    while (copied < total) {
+        auto n = read(in, buf.data(), std::min((uint64_t)chunk_size, total - copied));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error("Error reading " + src.string() + " (" + strerror(errno) + ")");
+        if (n == 0) break; // source file shrunk while copying
+        //else
+        size_t live = 0;
+        for (size_t i = 0; i < outs.size(); i++) {
+            if (outs[i] < 0) continue;
+            //else
+            for (ssize_t written = 0; written < n;) {
+                auto w = write(outs[i], buf.data() + written, n - written);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) {
+                    errors[i] = "Error writing to " + dsts[i].string() + " (" + strerror(errno) + ")";
+                    close(outs[i]);
+                    outs[i] = -1;
+                    break;
+                }
+                written += w;
+            }
+            if (outs[i] >= 0) live++;
+        }
+        if (live == 0) return errors;
+        //else
+        copied += n;
+        progress(copied, total);
+    }
+
+    // each destination is usually an independent disk.  flush them at once
+    std::vector<std::future<int>> syncs;
+    for (auto fd : outs) {
+        syncs.push_back(std::async(std::launch::async, [fd]() { return fd >= 0? fdatasync(fd) : 0; }));
+    }
+    for (size_t i = 0; i < syncs.size(); i++) {
+        if (syncs[i].get() < 0) errors[i] = "fdatasync() failed on " + dsts[i].string();
+    }
+    return errors;
+}
+
+void clone_file(const std::filesystem::path& src, const std::filesystem::path& dst)
+{
+    {
+        auto in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0) throw std::runtime_error("Unable to open " + src.string());
+        std::shared_ptr<void> in_guard(nullptr, [in](auto){ close(in); });
+        struct stat statbuf;
+        if (fstat(in, &statbuf) < 0) throw std::runtime_error("Unable to stat " + src.string());
+        //else
+        auto out = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, statbuf.st_mode & 07777);
+        if (out < 0) throw std::runtime_error("Unable to create " + dst.string() + " (" + strerror(errno) + ")");
+        std::shared_ptr<void> out_guard(nullptr, [out](auto){ close(out); });
+
+        // NOCOW can be set only while the file is empty.  also FICLONE fails unless both sides agree on it
+        int flags = 0;
+        if (ioctl(in, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_NOCOW_FL)) {
+            int f = 0;
+            if (ioctl(out, FS_IOC_GETFLAGS, &f) == 0) {
+                f |= FS_NOCOW_FL;
+                ioctl(out, FS_IOC_SETFLAGS, &f);
+            }
+        }
+        if (statbuf.st_size == 0 || ioctl(out, FICLONE, in) == 0) return;
+        //else
+        if (errno != EXDEV && errno != EOPNOTSUPP && errno != EINVAL && errno != ENOTTY) {
+            throw std::runtime_error("Cloning " + src.string() + " to " + dst.string() + " failed (" + strerror(errno) + ")");
+        }
+    }
+    // filesystem doesn't support reflink
+    copy_file_with_progress(src, dst);
+}
+
 bool wayland_ping(bool wait)
 {
-    std::shared_ptr<wl_display> display(wl_display_connect(NULL), 
-        [](auto ptr){if (ptr) wl_display_disconnect(ptr);});
+    std::shared_ptr<wl_display> display(WB_DLSYM(dl::libwayland_client, wl_display_connect)(NULL), 
+        [](auto ptr){if (ptr) WB_DLSYM(dl::libwayland_client, wl_display_disconnect)(ptr);});
 
     if (!display) {
         throw std::runtime_error("Can't connect to display");
@@ -45,16 +227,21 @@ bool wayland_ping(bool wait)
     //else
     bool output = false;
     while (true) {
-        struct wl_registry *registry = wl_display_get_registry(display.get());
+        // wl_display_get_registry() and wl_registry_add_listener() are inline in wayland-client-protocol.h and
+        // would bind libwayland-client at link time.  do the same through the core API
+        auto display_proxy = (struct wl_proxy*)display.get();
+        auto registry = (struct wl_proxy*)WB_DLSYM(dl::libwayland_client, wl_proxy_marshal_flags)(display_proxy,
+            WL_DISPLAY_GET_REGISTRY, dl::symbol<const struct wl_interface>(dl::libwayland_client, "wl_registry_interface"),
+            WB_DLSYM(dl::libwayland_client, wl_proxy_get_version)(display_proxy), 0, NULL);
         const struct wl_registry_listener registry_listener = {
             [](void *data, struct wl_registry *, uint32_t,const char *interface, uint32_t){
                 if (std::string(interface) == "wl_output") *((bool *)data) = true;
             }, NULL
         };
-        wl_registry_add_listener(registry, &registry_listener, &output);
+        WB_DLSYM(dl::libwayland_client, wl_proxy_add_listener)(registry, (void (**)(void))&registry_listener, &output);
 
-        wl_display_dispatch(display.get());
-        wl_display_roundtrip(display.get());
+        WB_DLSYM(dl::libwayland_client, wl_display_dispatch)(display.get());
+        WB_DLSYM(dl::libwayland_client, wl_display_roundtrip)(display.get());
 
         if (!wait || output) break;
         // else
@@ -69,6 +256,7 @@ int generate_rdp_cert()
     static const std::filesystem::path key("/etc/ssl/private/rdp.key");
     static const std::filesystem::path cert("/etc/ssl/certs/rdp.crt");
     if (std::filesystem::exists(key) && std::filesystem::exists(cert)) return 0;
+    trace::Scope scope("exec", "openssl req");
     auto pid = fork();
     if (pid < 0) throw std::runtime_error("fork() failed");
     if (pid == 0) {
@@ -89,18 +277,67 @@ int generate_rdp_cert()
  */
 void list_wwid()
 {
-    std::filesystem::path sys_block("/sys/block");
-    for (auto &p: std::filesystem::directory_iterator(sys_block)) {
-        auto disk_name = p.path().filename();
-        std::filesystem::path device(p.path() / "device");
-        if (!std::filesystem::is_directory(device)) continue;
-        std::filesystem::path wwid(device / "wwid");
-        if (!std::filesystem::exists(wwid)) continue;
-        std::ifstream ifs(wwid);
-        std::string line;
-        std::getline(ifs, line);
-        std::cout << disk_name.string() << ": " << line << std::endl;
+    for (const auto& device : blockdev::get_block_devices()) {
+        if (device.wwid) std::cout << device.name << ": " << *device.wwid << std::endl;
+    }
+}
+
+static std::filesystem::path state_cache_dir()
+{
+    if (getuid() == 0) return "/run/wb";
+    //else
+    const auto xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
+    return (xdg_runtime_dir? std::filesystem::path(xdg_runtime_dir) : std::filesystem::path("/run/user") / std::to_string(getuid())) / "wb";
+}
+
+std::string state_cache_key(const std::filesystem::path& vm_root)
+{
+    struct stat st;
+    std::string key = stat(vm_root.c_str(), &st) == 0?
+        std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec) : "none";
+    std::ifstream f("/proc/self/mountinfo");
+    std::string mountinfo((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016zx", std::hash<std::string>{}(mountinfo));
+    return key + '-' + hash;
+}
+
+std::optional<std::string> load_state_cache(const std::string& name, const std::string& key, std::chrono::seconds ttl)
+{
+    auto path = state_cache_dir() / (name + ".cache");
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) return std::nullopt;
+    //else
+    auto age = std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(st.st_mtim.tv_sec);
+    if (age > ttl || age < std::chrono::seconds(0)) return std::nullopt;
+    //else
+    std::ifstream f(path);
+    std::string cached_key;
+    if (!f || !std::getline(f, cached_key) || cached_key != key) return std::nullopt;
+    //else
+    return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+void save_state_cache(const std::string& name, const std::string& key, const std::string& content)
+{
+    auto dir = state_cache_dir();
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec) return; // cache is optional
+    //else
+    std::filesystem::permissions(dir, std::filesystem::perms::owner_all, ec);
+    auto path = dir / (name + ".cache");
+    auto tmp = dir / (name + ".cache." + std::to_string(getpid()));
+    {
+        std::ofstream f(tmp);
+        f << key << std::endl << content;
+        if (!f) {
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
     }
+    std::filesystem::rename(tmp, path, ec); // atomically replaces older one
+    if (ec) std::filesystem::remove(tmp, ec);
 }
 
 #ifdef __VSCODE_ACTIVE_FILE__
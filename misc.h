@@ -2,10 +2,38 @@
 #define __MISC_H__
 
 #include <string>
+#include <chrono>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <functional>
 
 std::string human_readable(uint64_t size, double k = 1024.0);
+uint64_t copy_file_with_progress(const std::filesystem::path& src, const std::filesystem::path& dst,
+    std::function<void(uint64_t/*copied*/,uint64_t/*total*/)> progress = [](auto,auto){},
+    size_t chunk_size = 1024 * 1024);
+/**
+ * @brief Copy a file to multiple destinations reading the source only once
+ * @return Error for each destination(std::nullopt if succeeded).  A failing destination doesn't stop others
+ */
+std::vector<std::optional<std::string>> copy_file_to_many(const std::filesystem::path& src,
+    const std::vector<std::filesystem::path>& dsts,
+    std::function<void(uint64_t/*copied*/,uint64_t/*total*/)> progress = [](auto,auto){},
+    size_t chunk_size = 4 * 1024 * 1024);
+void clone_file(const std::filesystem::path& src, const std::filesystem::path& dst); // reflink if possible
 bool wayland_ping(bool wait);
 int generate_rdp_cert();
 void list_wwid();
 
+/**
+ * @brief Key which changes whenever an entry is added to/removed from vm_root or anything is (un)mounted
+ */
+std::string state_cache_key(const std::filesystem::path& vm_root);
+/**
+ * @brief Load short-lived cache of collected state from runtime directory
+ * @return Cached content or std::nullopt if missing, older than ttl or saved with different key
+ */
+std::optional<std::string> load_state_cache(const std::string& name, const std::string& key, std::chrono::seconds ttl);
+void save_state_cache(const std::string& name, const std::string& key, const std::string& content);
+
 #endif // __MISC_H__
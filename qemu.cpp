@@ -0,0 +1,254 @@
+/**
+ * @file qemu.cpp
+ * @brief Communication with QEMU guest agent and QEMU machine protocol
+ */
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <map>
+#include <thread>
+
+#include "qemu.h"
+#include "trace.h"
+
+static int remaining_ms(std::chrono::steady_clock::time_point deadline)
+{
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    return remaining > 0? (int)remaining : 0;
+}
+
+namespace qemu {
+
+JsonSocket::~JsonSocket()
+{
+    if (sock >= 0) close(sock);
+}
+
+bool JsonSocket::connect_socket()
+{
+    struct sockaddr_un sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    if (socket_path.string().length() >= sizeof(sockaddr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socket_path.string());
+    }
+    sockaddr.sun_family = AF_UNIX;
+    strcpy(sockaddr.sun_path, socket_path.c_str());
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) throw std::runtime_error("socket() failed");
+    buf.clear();
+    if (::connect(sock, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
+        connect_error = errno;
+        close(sock);
+        sock = -1;
+        return false;
+    }
+    connect_error = 0;
+    return true;
+}
+
+void JsonSocket::disconnect()
+{
+    if (sock >= 0) close(sock);
+    sock = -1;
+    buf.clear();
+}
+
+bool QGA::connect(std::chrono::steady_clock::time_point deadline)
+{
+    if (sock >= 0) return true;
+    //else
+    auto lock_path = socket_path.string() + ".lock";
+    lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (lock_fd >= 0) { // go without lock if lock file cannot be created
+        while (flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+            if (errno != EWOULDBLOCK || remaining_ms(deadline) == 0) {
+                disconnect();
+                return false;
+            }
+            //else
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    if (!connect_socket() || !sync(deadline)) {
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void QGA::end_round_trip()
+{
+    // the agent serves one client at a time.  let other processes in between our commands
+    disconnect();
+}
+
+void QGA::disconnect()
+{
+    JsonSocket::disconnect();
+    if (lock_fd >= 0) close(lock_fd); // this releases flock
+    lock_fd = -1;
+}
+
+bool QGA::sync(std::chrono::steady_clock::time_point deadline)
+{
+    auto id = (((uint64_t)getpid() << 16) + ++sync_id) & 0x7fffffff;
+    // leading 0xff makes the agent discard any partial input left by previous client
+    send("\xff" + nlohmann::json({{"execute", "guest-sync-delimited"}, {"arguments", {{"id", id}}}}).dump() + '\n');
+
+    // the agent puts 0xff right before the response.  anything before that is a leftover
+    while (true) {
+        auto delimiter = buf.find('\xff');
+        if (delimiter != buf.npos) {
+            buf.erase(0, delimiter + 1);
+            break;
+        }
+        //else
+        buf.clear();
+        if (!fill(deadline)) return false;
+    }
+    while (true) {
+        auto line = read_line(deadline);
+        if (!line) return false;
+        auto reply = nlohmann::json::parse(*line, nullptr, false);
+        if (!reply.is_discarded() && reply.contains("return") && reply["return"] == id) return true;
+    }
+}
+
+void JsonSocket::send(const std::string& message)
+{
+    size_t sent = 0;
+    while (sent < message.length()) {
+        auto n = ::send(sock, message.c_str() + sent, message.length() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("Error sending message via socket");
+        }
+        sent += n;
+    }
+}
+
+/**
+ * @brief Receive more bytes into the buffer
+ * @return false if deadline has passed
+ */
+bool JsonSocket::fill(std::chrono::steady_clock::time_point deadline)
+{
+    struct pollfd pollfds[1];
+    pollfds[0].fd = sock;
+    pollfds[0].events = POLLIN;
+    while (true) {
+        auto rst = poll(pollfds, 1, remaining_ms(deadline));
+        if (rst < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("poll() failed");
+        }
+        if (rst == 0) return false;
+        //else
+        break;
+    }
+    char chunk[4096];
+    auto n = read(sock, chunk, sizeof(chunk));
+    if (n < 1) throw std::runtime_error("Error receiving message via socket");
+    //else
+    buf.append(chunk, n);
+    return true;
+}
+
+std::optional<std::string> JsonSocket::read_line(std::chrono::steady_clock::time_point deadline)
+{
+    while (true) {
+        auto newline = buf.find('\n');
+        if (newline != buf.npos) {
+            auto line = buf.substr(0, newline);
+            buf.erase(0, newline + 1);
+            return line;
+        }
+        //else
+        if (!fill(deadline)) return std::nullopt;
+    }
+}
+
+std::optional<nlohmann::json> JsonSocket::execute(const std::string& command,
+    const nlohmann::json& arguments/* = nullptr*/, int timeout_ms/* = 1000*/)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    trace::Scope scope("socket", command);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    if (sock < 0) trace::count("socket connects");
+    if (!connect(deadline)) return std::nullopt;
+    //else
+    std::shared_ptr<void> round_trip_guard(nullptr, [this](auto) { end_round_trip(); });
+    try {
+        nlohmann::json query = {{"execute", command}};
+        if (!arguments.is_null()) query["arguments"] = arguments;
+        send(query.dump() + '\n');
+        while (true) {
+            auto line = read_line(deadline);
+            if (!line) {
+                // late reply would confuse next command.  connection is resynchronized on next use
+                disconnect();
+                return std::nullopt;
+            }
+            auto reply = nlohmann::json::parse(*line, nullptr, false);
+            if (reply.is_discarded()) continue;
+            if (reply.contains("return") || reply.contains("error")) return reply;
+        }
+    }
+    catch (...) {
+        disconnect();
+        throw;
+    }
+}
+
+std::shared_ptr<QGA> QGA::get(const std::filesystem::path& socket_path)
+{
+    static std::mutex mutex;
+    // intentionally never freed so that connections outlive any worker thread still using them at exit
+    static auto& clients = *new std::map<std::filesystem::path,std::shared_ptr<QGA>>();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& client = clients[socket_path];
+    if (!client) client = std::make_shared<QGA>(socket_path);
+    return client;
+}
+
+bool QMP::connect(std::chrono::steady_clock::time_point deadline)
+{
+    if (sock >= 0) return true;
+    //else
+    if (!connect_socket()) return false;
+    try {
+        auto greeting = read_line(deadline);
+        if (!greeting || !nlohmann::json::parse(*greeting, nullptr, false).contains("QMP")) {
+            disconnect();
+            return false;
+        }
+        //else
+        send(nlohmann::json({{"execute", "qmp_capabilities"}}).dump() + '\n');
+        while (true) {
+            auto line = read_line(deadline);
+            if (!line) {
+                disconnect();
+                return false;
+            }
+            auto reply = nlohmann::json::parse(*line, nullptr, false);
+            if (reply.is_discarded()) continue;
+            if (reply.contains("return")) return true;
+            if (reply.contains("error")) {
+                disconnect();
+                return false;
+            }
+        }
+    }
+    catch (...) {
+        disconnect();
+        throw;
+    }
+}
+
+} // namespace qemu
@@ -0,0 +1,93 @@
+#ifndef __QEMU_H__
+#define __QEMU_H__
+
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <filesystem>
+
+#include <nlohmann/json.hpp>
+
+namespace qemu {
+    /**
+     * @brief Newline-delimited JSON connection over a UNIX domain socket
+     * @details Replies are read through a buffer and split into lines with one deadline for a whole round trip.
+     */
+    class JsonSocket {
+    protected:
+        std::filesystem::path socket_path;
+        int sock = -1;
+        std::string buf; // bytes received but not consumed yet
+        std::mutex mutex;
+        int connect_error = 0;
+
+        bool connect_socket();
+        virtual bool connect(std::chrono::steady_clock::time_point deadline) = 0;
+        virtual void disconnect();
+        /**
+         * @brief Called after each execute() round trip which has connected
+         */
+        virtual void end_round_trip() {}
+        void send(const std::string& message);
+        bool fill(std::chrono::steady_clock::time_point deadline);
+        std::optional<std::string> read_line(std::chrono::steady_clock::time_point deadline);
+    public:
+        JsonSocket(const std::filesystem::path& _socket_path) : socket_path(_socket_path) {}
+        virtual ~JsonSocket();
+        JsonSocket(const JsonSocket&) = delete;
+        JsonSocket& operator=(const JsonSocket&) = delete;
+
+        /**
+         * @brief Execute command
+         * @param command Command name(eg. "guest-ping")
+         * @param arguments Arguments of the command(null if none)
+         * @param timeout_ms Time limit for whole round trip including (re)connect
+         * @return Reply object(contains either "return" or "error") or std::nullopt if peer is unreachable or timed out
+         */
+        std::optional<nlohmann::json> execute(const std::string& command,
+            const nlohmann::json& arguments = nullptr, int timeout_ms = 1000);
+        /**
+         * @brief errno of the last connect(2) to the socket(0 if it succeeded)
+         * @details Tells a socket nobody listens on(ECONNREFUSED, ENOENT) from a peer which is just slow or busy
+         */
+        int last_connect_error() const { return connect_error; }
+    };
+
+    /**
+     * @brief Client of QEMU guest agent(QGA)
+     * @details The agent serves only one client at a time, so flock(2) on "<socket>.lock" and the connection are
+     * held for a single execute() round trip only.  Each round trip takes the lock, connects and resynchronizes the
+     * stream with guest-sync-delimited so that a stale reply left by an earlier client is never mistaken for ours.
+     * A mutex guards against other threads.  Use get() to share one client per socket within a process.
+     */
+    class QGA : public JsonSocket {
+        int lock_fd = -1;
+        uint64_t sync_id = 0;
+
+        bool connect(std::chrono::steady_clock::time_point deadline) override;
+        void disconnect() override;
+        void end_round_trip() override;
+        bool sync(std::chrono::steady_clock::time_point deadline);
+    public:
+        QGA(const std::filesystem::path& _socket_path) : JsonSocket(_socket_path) {}
+        ~QGA() { disconnect(); }
+
+        /**
+         * @brief Get client of the socket shared within this process
+         */
+        static std::shared_ptr<QGA> get(const std::filesystem::path& socket_path);
+    };
+
+    /**
+     * @brief Client of QEMU machine protocol(QMP)
+     * @details Capabilities negotiation is done on connect.  Asynchronous events are skipped.
+     */
+    class QMP : public JsonSocket {
+        bool connect(std::chrono::steady_clock::time_point deadline) override;
+    public:
+        QMP(const std::filesystem::path& _socket_path) : JsonSocket(_socket_path) {}
+    };
+}
+
+#endif // __QEMU_H__
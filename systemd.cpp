@@ -0,0 +1,158 @@
+/**
+ * @file systemd.cpp
+ * @brief Querying systemd service manager via D-Bus
+ */
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <set>
+#include <filesystem>
+
+#include <systemd/sd-bus.h>
+
+#include "systemd.h"
+#include "trace.h"
+
+static const char* DESTINATION = "org.freedesktop.systemd1";
+static const char* PATH = "/org/freedesktop/systemd1";
+static const char* INTERFACE = "org.freedesktop.systemd1.Manager";
+
+/**
+ * @brief Connect to system bus when running as root, user bus otherwise(like systemctl --system/--user)
+ * @return Bus connection or nullptr if bus is not available
+ */
+static std::shared_ptr<sd_bus> open_bus()
+{
+    sd_bus* bus = NULL;
+    auto rst = getuid() == 0? sd_bus_open_system(&bus) : sd_bus_open_user(&bus);
+    if (rst < 0) return nullptr;
+    //else
+    return std::shared_ptr<sd_bus>(bus, sd_bus_flush_close_unref);
+}
+
+/**
+ * @brief Call Manager method which takes (as states, as patterns)
+ * @return Reply message or nullptr if the call failed
+ */
+static std::shared_ptr<sd_bus_message> call_by_patterns(sd_bus* bus, const char* method, const std::string& pattern)
+{
+    sd_bus_message* m = NULL;
+    if (sd_bus_message_new_method_call(bus, &m, DESTINATION, PATH, INTERFACE, method) < 0) return nullptr;
+    std::shared_ptr<sd_bus_message> message(m, sd_bus_message_unref);
+    char* no_states[] = { NULL };
+    char* patterns[] = { const_cast<char*>(pattern.c_str()), NULL };
+    if (sd_bus_message_append_strv(m, no_states) < 0 || sd_bus_message_append_strv(m, patterns) < 0) return nullptr;
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = NULL;
+    auto rst = sd_bus_call(bus, m, 0, &error, &reply);
+    sd_bus_error_free(&error);
+    if (rst < 0) return nullptr;
+    //else
+    return std::shared_ptr<sd_bus_message>(reply, sd_bus_message_unref);
+}
+
+namespace systemd {
+
+bool UnitState::is_enabled() const
+{
+    static const std::set<std::string> enabled_states = {
+        "enabled", "enabled-runtime", "alias", "static", "indirect", "generated", "transient"
+    };
+    return enabled_states.contains(file_state);
+}
+
+bool UnitState::is_active() const
+{
+    return active_state == "active" || active_state == "reloading" || active_state == "refreshing";
+}
+
+/**
+ * @brief Get enablement and active state of units in a few round trips instead of forking systemctl per unit
+ * @param pattern Glob pattern of unit names(eg. "vm@*.service")
+ * @param units Units which must be in the result even if no unit file matches the pattern.
+ *  Enabled template instances(eg. vm@foo.service) don't have unit files of their own so that they are queried individually.
+ * @return Map of unit name to its state or std::nullopt if the service manager is unreachable
+ */
+std::optional<std::map<std::string,UnitState>> get_unit_states(const std::string& pattern, const std::vector<std::string>& units/* = {}*/)
+{
+    trace::Scope scope("dbus", "get_unit_states");
+    auto bus = open_bus();
+    if (!bus) return std::nullopt;
+    //else
+    std::map<std::string,UnitState> states;
+
+    auto unit_files = call_by_patterns(bus.get(), "ListUnitFilesByPatterns", pattern);
+    if (!unit_files) return std::nullopt;
+    if (sd_bus_message_enter_container(unit_files.get(), SD_BUS_TYPE_ARRAY, "(ss)") < 0) return std::nullopt;
+    const char* path;
+    const char* file_state;
+    while (sd_bus_message_read(unit_files.get(), "(ss)", &path, &file_state) > 0) {
+        states[std::filesystem::path(path).filename().string()].file_state = file_state;
+    }
+
+    auto loaded_units = call_by_patterns(bus.get(), "ListUnitsByPatterns", pattern);
+    if (!loaded_units) return std::nullopt;
+    if (sd_bus_message_enter_container(loaded_units.get(), SD_BUS_TYPE_ARRAY, "(ssssssouso)") < 0) return std::nullopt;
+    const char *name, *description, *load_state, *active_state, *sub_state, *followed, *unit_path, *job_type, *job_path;
+    uint32_t job_id;
+    while (sd_bus_message_read(loaded_units.get(), "(ssssssouso)", &name, &description, &load_state, &active_state,
+        &sub_state, &followed, &unit_path, &job_id, &job_type, &job_path) > 0) {
+        states[name].active_state = active_state;
+    }
+
+    for (const auto& unit : units) {
+        auto& state = states[unit];
+        if (!state.file_state.empty()) continue;
+        //else
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message* reply = NULL;
+        if (sd_bus_call_method(bus.get(), DESTINATION, PATH, INTERFACE, "GetUnitFileState", &error, &reply, "s", unit.c_str()) >= 0) {
+            const char* s;
+            if (sd_bus_message_read(reply, "s", &s) > 0) state.file_state = s;
+        }
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+    }
+
+    return states;
+}
+
+/**
+ * @brief Get cgroup of units
+ * @param units Unit names(eg. "vm@foo.service").  Units not loaded are omitted from the result
+ * @return Map of unit name to cgroup path relative to cgroup root(eg. "/system.slice/system-vm.slice/vm@foo.service")
+ *  or std::nullopt if the service manager is unreachable
+ */
+std::optional<std::map<std::string,std::string>> get_control_groups(const std::vector<std::string>& units)
+{
+    trace::Scope scope("dbus", "get_control_groups");
+    auto bus = open_bus();
+    if (!bus) return std::nullopt;
+    //else
+    std::map<std::string,std::string> control_groups;
+    for (const auto& unit : units) {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message* reply = NULL;
+        auto rst = sd_bus_call_method(bus.get(), DESTINATION, PATH, INTERFACE, "GetUnit", &error, &reply, "s", unit.c_str());
+        sd_bus_error_free(&error);
+        if (rst < 0) continue; // not loaded
+        //else
+        std::shared_ptr<sd_bus_message> reply_guard(reply, sd_bus_message_unref);
+        const char* unit_path;
+        if (sd_bus_message_read(reply, "o", &unit_path) <= 0) continue;
+        //else
+        char* control_group = NULL;
+        rst = sd_bus_get_property_string(bus.get(), DESTINATION, unit_path, "org.freedesktop.systemd1.Service",
+            "ControlGroup", &error, &control_group);
+        sd_bus_error_free(&error);
+        if (rst < 0) continue;
+        //else
+        if (control_group[0] != '\0') control_groups[unit] = control_group;
+        free(control_group);
+    }
+    return control_groups;
+}
+
+} // namespace systemd
@@ -0,0 +1,21 @@
+#ifndef __SYSTEMD_H__
+#define __SYSTEMD_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <optional>
+
+namespace systemd {
+    struct UnitState {
+        std::string file_state = ""; // "enabled", "disabled", "static" etc.  empty if no unit file found
+        std::string active_state = "inactive"; // "active", "activating", "failed" etc.
+        bool is_enabled() const; // same criteria as 'systemctl is-enabled'
+        bool is_active() const; // same criteria as 'systemctl is-active'
+    };
+
+    std::optional<std::map<std::string,UnitState>> get_unit_states(const std::string& pattern, const std::vector<std::string>& units = {});
+    std::optional<std::map<std::string,std::string>> get_control_groups(const std::vector<std::string>& units);
+}
+
+#endif // __SYSTEMD_H__
@@ -0,0 +1,260 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <filesystem>
+#include <algorithm>
+#include <charconv>
+
+#include "telemetry.h"
+
+namespace telemetry {
+
+static int open_ro(const std::filesystem::path& path)
+{
+    return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+static std::optional<uint64_t> read_number(const std::filesystem::path& path)
+{
+    std::ifstream f(path);
+    uint64_t value;
+    if (!f || !(f >> value)) return std::nullopt;
+    return value;
+}
+
+template <typename F> static void for_each_line(std::string_view s, F f)
+{
+    while (!s.empty()) {
+        auto eol = s.find('\n');
+        f(s.substr(0, eol));
+        if (eol == std::string_view::npos) break;
+        s.remove_prefix(eol + 1);
+    }
+}
+
+static std::optional<uint64_t> parse_number(std::string_view s)
+{
+    auto i = s.find_first_not_of(" \t");
+    if (i == std::string_view::npos) return std::nullopt;
+    uint64_t value;
+    auto [ptr, ec] = std::from_chars(s.data() + i, s.data() + s.size(), value);
+    if (ec != std::errc()) return std::nullopt;
+    return value;
+}
+
+Collector::Collector()
+{
+    struct utsname u;
+    if (uname(&u) < 0) throw std::runtime_error("uname(2) failed");
+    facts["serial_number"] = u.nodename;
+    facts["kernel_version"] = u.release;
+    {
+        std::ifstream f("/proc/cpuinfo");
+        std::string s;
+        while (f && std::getline(f, s)) {
+            if (!s.starts_with("model name\t: ")) continue;
+            //else
+            facts["cpu_model"] = s.substr(13);
+            break;
+        }
+    }
+    facts["cpus"] = std::thread::hardware_concurrency();
+    facts["kvm"] = std::filesystem::exists("/dev/kvm");
+
+    meminfo_fd = open_ro("/proc/meminfo");
+    route_fd = open_ro("/proc/net/route");
+    loadavg_fd = open_ro("/proc/loadavg");
+    pressure_fds[0] = open_ro("/proc/pressure/cpu");
+    pressure_fds[1] = open_ro("/proc/pressure/memory");
+    pressure_fds[2] = open_ro("/proc/pressure/io");
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+    std::vector<int> cpu_numbers;
+    std::error_code ec;
+    for (const auto& d : std::filesystem::directory_iterator("/sys/devices/system/cpu", ec)) {
+        auto name = d.path().filename().string();
+        if (!name.starts_with("cpu") || name.length() == 3) continue;
+        if (!std::all_of(name.begin() + 3, name.end(), ::isdigit)) continue;
+        //else
+        cpu_numbers.push_back(std::stoi(name.substr(3)));
+    }
+    std::sort(cpu_numbers.begin(), cpu_numbers.end());
+    for (auto n : cpu_numbers) {
+        std::filesystem::path cpufreq = "/sys/devices/system/cpu/cpu" + std::to_string(n) + "/cpufreq";
+        CPU cpu;
+        cpu.fd = open_ro(cpufreq / "cpuinfo_cur_freq");
+        if (cpu.fd < 0) cpu.fd = open_ro(cpufreq / "scaling_cur_freq");
+        if (cpu.fd < 0) continue;
+        //else
+        cpu.min_freq = read_number(cpufreq / "cpuinfo_min_freq").value_or(0);
+        cpu.max_freq = read_number(cpufreq / "cpuinfo_max_freq").value_or(0);
+        cpus.push_back(cpu);
+    }
+}
+
+Collector::~Collector()
+{
+    for (auto fd : {meminfo_fd, route_fd, loadavg_fd, sock, pressure_fds[0], pressure_fds[1], pressure_fds[2]}) {
+        if (fd >= 0) close(fd);
+    }
+    for (const auto& cpu : cpus) close(cpu.fd);
+}
+
+Collector& Collector::get()
+{
+    static Collector collector;
+    return collector;
+}
+
+/**
+ * @brief Read whole content of a preopened file into the buffer
+ * @return View into the buffer valid until next read, or std::nullopt on error
+ */
+std::optional<std::string_view> Collector::read(int fd)
+{
+    if (fd < 0) return std::nullopt;
+    //else
+    auto n = pread(fd, buf.data(), buf.size(), 0);
+    if (n < 0) return std::nullopt;
+    //else
+    return std::string_view(buf.data(), n);
+}
+
+std::optional<std::string> Collector::get_ipv4_address()
+{
+    auto routes = read(route_fd);
+    if (!routes || sock < 0) return std::nullopt;
+    //else
+    std::optional<std::string> ifname;
+    bool header = true;
+    for_each_line(*routes, [&](std::string_view line) {
+        if (header) { header = false; return; }
+        if (ifname) return;
+        //else
+        auto sep = line.find_first_of(" \t");
+        if (sep == std::string_view::npos) return; // no destination
+        auto destination = line.substr(sep);
+        destination.remove_prefix(std::min(destination.find_first_not_of(" \t"), destination.size()));
+        if (destination.starts_with("00000000")) ifname = std::string(line.substr(0, sep));
+    });
+    if (!ifname || ifname->length() >= IFNAMSIZ) return std::nullopt;
+    //else
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strcpy(ifr.ifr_name, ifname->c_str());
+    if (ioctl(sock, SIOCGIFADDR, &ifr) < 0) return std::nullopt;
+    return inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr);
+}
+
+nlohmann::json Collector::collect()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto result = facts;
+
+    auto ip_address = get_ipv4_address();
+    if (ip_address) result["ip_address"] = *ip_address;
+
+    auto freqs = nlohmann::json::array();
+    for (const auto& cpu : cpus) {
+        auto s = read(cpu.fd);
+        auto freq = s? parse_number(*s) : std::nullopt;
+        freqs.push_back(freq? nlohmann::json(*freq) : nlohmann::json(nullptr));
+    }
+    if (!cpus.empty() && freqs[0].is_number()) {
+        result["clock"] = {
+            {"current", freqs[0]},
+            {"min", cpus[0].min_freq},
+            {"max", cpus[0].max_freq}
+        };
+    }
+    if (!cpus.empty()) result["cpu_freqs"] = freqs;
+
+    if (auto meminfo = read(meminfo_fd)) {
+        uint64_t available = 0, total = 0;
+        for_each_line(*meminfo, [&](std::string_view line) {
+            // values are in kB
+            if (line.starts_with("MemTotal:")) total = parse_number(line.substr(9)).value_or(0) * 1024;
+            else if (line.starts_with("MemAvailable:")) available = parse_number(line.substr(13)).value_or(0) * 1024;
+        });
+        if (total > 0 && available > 0) {
+            result["memory"] = {
+                {"unused", available},
+                {"total", total}
+            };
+        }
+    }
+
+    if (auto loadavg = read(loadavg_fd)) {
+        double l1, l5, l15;
+        std::string s(*loadavg);
+        if (sscanf(s.c_str(), "%lf %lf %lf", &l1, &l5, &l15) == 3) result["loadavg"] = {l1, l5, l15};
+    }
+
+    static const char* resources[] = {"cpu", "memory", "io"};
+    for (size_t i = 0; i < pressure_fds.size(); i++) {
+        auto psi = read(pressure_fds[i]);
+        if (!psi) continue;
+        //else
+        nlohmann::json pressure;
+        for_each_line(*psi, [&](std::string_view line) {
+            char kind[8];
+            double avg10, avg60, avg300;
+            uint64_t total;
+            std::string s(line);
+            if (sscanf(s.c_str(), "%7s avg10=%lf avg60=%lf avg300=%lf total=%lu", kind, &avg10, &avg60, &avg300, &total) != 5) return;
+            //else
+            pressure[kind] = {{"avg10", avg10}, {"avg60", avg60}, {"avg300", avg300}, {"total", total}};
+        });
+        if (!pressure.is_null()) result["pressure"][resources[i]] = pressure;
+    }
+
+    return result;
+}
+
+nlohmann::json diff(const nlohmann::json& prev, const nlohmann::json& cur)
+{
+    nlohmann::json result = nlohmann::json::object();
+    if (!prev.is_object() || !cur.is_object()) return cur;
+    //else
+    for (const auto& [key, value] : cur.items()) {
+        if (!prev.contains(key)) {
+            result[key] = value;
+        } else if (prev[key].is_object() && value.is_object()) {
+            auto d = diff(prev[key], value);
+            if (!d.empty()) result[key] = d;
+        } else if (prev[key] != value) {
+            result[key] = value;
+        }
+    }
+    for (const auto& [key, value] : prev.items()) {
+        if (!cur.contains(key)) result[key] = nullptr;
+    }
+    return result;
+}
+
+} // namespace telemetry
+
+#ifdef __VSCODE_ACTIVE_FILE__
+int main()
+{
+    auto& collector = telemetry::Collector::get();
+    auto prev = collector.collect();
+    std::cout << prev << std::endl;
+    for (int i = 0; i < 3; i++) {
+        sleep(1);
+        auto cur = collector.collect();
+        std::cout << telemetry::diff(prev, cur) << std::endl;
+        prev = cur;
+    }
+    return 0;
+}
+#endif // __VSCODE_ACTIVE_FILE__
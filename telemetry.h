@@ -0,0 +1,59 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <array>
+#include <mutex>
+#include <vector>
+#include <optional>
+#include <string_view>
+
+#include <nlohmann/json.hpp>
+
+namespace telemetry {
+    /**
+     * @brief Host status collector meant to be polled frequently
+     * @details Static facts(CPU model, kernel, KVM presence...) are read once on construction.
+     * Dynamic files under /proc and /sys are kept open and re-read with pread(2) into a fixed buffer.
+     * Thread safe.
+     */
+    class Collector {
+        struct CPU {
+            int fd = -1; // cpuinfo_cur_freq or scaling_cur_freq
+            uint64_t min_freq = 0, max_freq = 0;
+        };
+        nlohmann::json facts;
+        int meminfo_fd = -1, route_fd = -1, loadavg_fd = -1, sock = -1;
+        std::array<int,3> pressure_fds = {-1, -1, -1}; // cpu, memory, io
+        std::vector<CPU> cpus;
+        std::array<char,16384> buf;
+        std::mutex mutex;
+
+        std::optional<std::string_view> read(int fd);
+        std::optional<std::string> get_ipv4_address();
+    public:
+        Collector();
+        ~Collector();
+        Collector(const Collector&) = delete;
+        Collector& operator=(const Collector&) = delete;
+
+        /**
+         * @brief Collect host status
+         * @return Object compatible with invoke system-status plus "cpu_freqs", "loadavg" and "pressure"
+         */
+        nlohmann::json collect();
+
+        /**
+         * @brief Process-wide collector
+         */
+        static Collector& get();
+    };
+
+    /**
+     * @brief Members of cur that differ from prev
+     * @details Objects are compared recursively, other values(including arrays) are replaced as a whole.
+     * Members removed in cur are given as null.
+     */
+    nlohmann::json diff(const nlohmann::json& prev, const nlohmann::json& cur);
+}
+
+#endif // __TELEMETRY_H__
@@ -0,0 +1,384 @@
+/**
+ * @file top.cpp
+ * @brief Live resource usage of running VMs
+ */
+#include <unistd.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <libsmartcols/libsmartcols.h>
+#include <nlohmann/json.hpp>
+
+#include "vm.h"
+#include "qemu.h"
+#include "systemd.h"
+#include "workerpool.h"
+#include "misc.h"
+#include "top.h"
+
+/**
+ * @brief Cumulative counters of a VM at a point of time
+ */
+struct Counters {
+    std::chrono::steady_clock::time_point time;
+    std::optional<uint64_t> cpu_usec = std::nullopt, memory = std::nullopt;
+    std::optional<uint64_t> io_rbytes = std::nullopt, io_wbytes = std::nullopt, io_ops = std::nullopt; // cgroup io.stat
+    std::optional<uint64_t> disk_rbytes = std::nullopt, disk_wbytes = std::nullopt, disk_ops = std::nullopt; // QMP
+    std::optional<uint64_t> net_rx = std::nullopt, net_tx = std::nullopt; // QGA
+};
+
+struct Usage {
+    std::optional<double> cpu = std::nullopt; // in percent of one CPU
+    std::optional<uint64_t> memory = std::nullopt;
+    std::optional<double> read = std::nullopt, write = std::nullopt, iops = std::nullopt; // per second
+    std::optional<double> rx = std::nullopt, tx = std::nullopt; // bytes per second
+};
+
+static void read_cgroup(const std::filesystem::path& cgroup, Counters& counters)
+{
+    {
+        std::ifstream f(cgroup / "cpu.stat");
+        std::string key;
+        uint64_t value;
+        while (f >> key >> value) {
+            if (key == "usage_usec") counters.cpu_usec = value;
+        }
+    }
+    {
+        std::ifstream f(cgroup / "memory.current");
+        uint64_t value;
+        if (f >> value) counters.memory = value;
+    }
+    std::ifstream f(cgroup / "io.stat");
+    if (!f) return;
+    //else
+    uint64_t rbytes = 0, wbytes = 0, ops = 0;
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream s(line);
+        std::string field;
+        s >> field; // MAJ:MIN
+        while (s >> field) {
+            auto eq = field.find('=');
+            if (eq == std::string::npos) continue;
+            //else
+            auto key = field.substr(0, eq);
+            auto value = std::stoull(field.substr(eq + 1));
+            if (key == "rbytes") rbytes += value;
+            else if (key == "wbytes") wbytes += value;
+            else if (key == "rios" || key == "wios") ops += value;
+        }
+    }
+    counters.io_rbytes = rbytes;
+    counters.io_wbytes = wbytes;
+    counters.io_ops = ops;
+}
+
+static void read_blockstats(qemu::QMP& qmp, Counters& counters)
+{
+    auto res = qmp.execute("query-blockstats", nullptr, 500);
+    if (!res || !res->contains("return")) return;
+    //else
+    uint64_t rbytes = 0, wbytes = 0, ops = 0;
+    for (const auto& device : (*res)["return"]) {
+        if (!device.contains("stats")) continue;
+        //else
+        const auto& stats = device["stats"];
+        rbytes += stats.value("rd_bytes", (uint64_t)0);
+        wbytes += stats.value("wr_bytes", (uint64_t)0);
+        ops += stats.value("rd_operations", (uint64_t)0) + stats.value("wr_operations", (uint64_t)0);
+    }
+    counters.disk_rbytes = rbytes;
+    counters.disk_wbytes = wbytes;
+    counters.disk_ops = ops;
+}
+
+static void read_network_statistics(qemu::QGA& qga, Counters& counters)
+{
+    auto res = qga.execute("guest-network-get-interfaces", nullptr, 500);
+    if (!res || !res->contains("return")) return;
+    //else
+    uint64_t rx = 0, tx = 0;
+    for (const auto& interface : (*res)["return"]) {
+        if (interface["name"] == "lo" || !interface.contains("statistics")) continue;
+        //else
+        rx += interface["statistics"].value("rx-bytes", (uint64_t)0);
+        tx += interface["statistics"].value("tx-bytes", (uint64_t)0);
+    }
+    counters.net_rx = rx;
+    counters.net_tx = tx;
+}
+
+static std::optional<double> rate(const std::optional<uint64_t>& prev, const std::optional<uint64_t>& cur, double seconds)
+{
+    if (!prev || !cur || *cur < *prev || seconds <= 0.0) return std::nullopt;
+    //else
+    return (*cur - *prev) / seconds;
+}
+
+static Usage compute_usage(const Counters& prev, const Counters& cur)
+{
+    auto seconds = std::chrono::duration<double>(cur.time - prev.time).count();
+    Usage usage;
+    auto cpu = rate(prev.cpu_usec, cur.cpu_usec, seconds);
+    if (cpu) usage.cpu = *cpu / 10000.0; // usec per second -> percent
+    usage.memory = cur.memory;
+    // guest view of disks is preferred as host-side io.stat misses I/O served by page cache
+    bool qmp = prev.disk_rbytes && cur.disk_rbytes;
+    usage.read = qmp? rate(prev.disk_rbytes, cur.disk_rbytes, seconds) : rate(prev.io_rbytes, cur.io_rbytes, seconds);
+    usage.write = qmp? rate(prev.disk_wbytes, cur.disk_wbytes, seconds) : rate(prev.io_wbytes, cur.io_wbytes, seconds);
+    usage.iops = qmp? rate(prev.disk_ops, cur.disk_ops, seconds) : rate(prev.io_ops, cur.io_ops, seconds);
+    usage.rx = rate(prev.net_rx, cur.net_rx, seconds);
+    usage.tx = rate(prev.net_tx, cur.net_tx, seconds);
+    return usage;
+}
+
+/**
+ * @brief Collects counters of running VMs keeping cgroup and socket paths across samples
+ * @details QMP and QGA serve one client at a time, so they are connected only for the duration of a sample.
+ * Holding them would keep other processes(eg. wb list) out for the whole session.
+ */
+class Sampler {
+    struct VM {
+        std::optional<std::filesystem::path> cgroup = std::nullopt;
+        std::optional<std::filesystem::path> qmp = std::nullopt;
+        std::optional<std::filesystem::path> qga = std::nullopt;
+    };
+    std::map<std::string,VM> vms;
+    WorkerPool pool;
+    std::chrono::steady_clock::time_point next_probe; // of VMs whose runtime state is unknown
+    static constexpr auto probe_backoff = std::chrono::seconds(5);
+
+    void refresh(const std::vector<std::string>& running)
+    {
+        std::vector<std::string> units;
+        for (const auto& name : running) units.push_back("vm@" + name + ".service");
+        auto control_groups = systemd::get_control_groups(units);
+        std::map<std::string,vm::RuntimeState> runtime_states;
+        try {
+            runtime_states = vm::get_runtime_states();
+        }
+        catch (const std::runtime_error&) {
+            // QMP/QGA figures are just omitted
+        }
+        std::map<std::string,VM> new_vms;
+        for (const auto& name : running) {
+            auto& vm = new_vms[name];
+            auto unit = "vm@" + name + ".service";
+            if (control_groups && control_groups->contains(unit)) {
+                vm.cgroup = std::filesystem::path("/sys/fs/cgroup") / std::filesystem::path((*control_groups)[unit]).relative_path();
+            }
+            if (runtime_states.contains(name)) {
+                const auto& state = runtime_states[name];
+                vm.qmp = state.qmp;
+                vm.qga = state.qga;
+            }
+        }
+        vms = std::move(new_vms);
+        next_probe = std::chrono::steady_clock::now() + probe_backoff;
+    }
+
+    /**
+     * @brief Probe again only VMs whose runtime state was unknown(eg. still booting) at most once per probe_backoff
+     */
+    void probe_incomplete()
+    {
+        std::vector<std::string> incomplete;
+        for (const auto& [name, vm] : vms) {
+            if (!vm.qmp) incomplete.push_back(name);
+        }
+        if (incomplete.empty() || std::chrono::steady_clock::now() < next_probe) return;
+        //else
+        next_probe = std::chrono::steady_clock::now() + probe_backoff;
+        std::map<std::string,vm::RuntimeState> runtime_states;
+        try {
+            runtime_states = vm::get_runtime_states(incomplete);
+        }
+        catch (const std::runtime_error&) {
+            return;
+        }
+        for (const auto& [name, state] : runtime_states) {
+            if (!vms.contains(name)) continue;
+            //else
+            vms[name].qmp = state.qmp;
+            vms[name].qga = state.qga;
+        }
+    }
+public:
+    Sampler(size_t concurrency) : pool(concurrency) {}
+
+    std::map<std::string,Counters> sample()
+    {
+        std::vector<std::string> running;
+        auto unit_states = systemd::get_unit_states("vm@*.service");
+        if (!unit_states) throw std::runtime_error("Service manager is not reachable");
+        //else
+        for (const auto& [unit, state] : *unit_states) {
+            if (!state.is_active() || !unit.starts_with("vm@") || !unit.ends_with(".service")) continue;
+            //else
+            running.push_back(unit.substr(3, unit.length() - 3 - 8));
+        }
+        bool changed = running.size() != vms.size()
+            || !std::all_of(running.begin(), running.end(), [this](const auto& name) { return vms.contains(name); });
+        if (changed) refresh(running);
+        else probe_incomplete();
+
+        std::map<std::string,std::future<Counters>> futures;
+        for (const auto& [name, vm] : vms) {
+            futures[name] = pool.submit([vm]() {
+                // a VM may shut down during the sample.  its affected columns are just left unknown
+                Counters counters;
+                try {
+                    if (vm.cgroup) read_cgroup(*vm.cgroup, counters);
+                }
+                catch (const std::exception&) {
+                    // shown as '-'
+                }
+                try {
+                    if (vm.qmp) {
+                        qemu::QMP qmp(*vm.qmp); // disconnected when this sample is done
+                        read_blockstats(qmp, counters);
+                    }
+                }
+                catch (const std::exception&) {
+                    // shown as '-'
+                }
+                try {
+                    if (vm.qga) read_network_statistics(*qemu::QGA::get(*vm.qga), counters);
+                }
+                catch (const std::exception&) {
+                    // shown as '-'
+                }
+                counters.time = std::chrono::steady_clock::now();
+                return counters;
+            });
+        }
+        std::map<std::string,Counters> counters;
+        for (auto& [name, future] : futures) {
+            counters[name] = future.get();
+        }
+        return counters;
+    }
+};
+
+static std::optional<double> sort_key(const Usage& usage, const std::string& sort)
+{
+    if (sort == "cpu") return usage.cpu;
+    if (sort == "memory") return usage.memory? std::make_optional((double)*usage.memory) : std::nullopt;
+    if (sort == "read") return usage.read;
+    if (sort == "write") return usage.write;
+    if (sort == "iops") return usage.iops;
+    if (sort == "rx") return usage.rx;
+    if (sort == "tx") return usage.tx;
+    //else
+    return std::nullopt;
+}
+
+static void print_table(const std::vector<std::pair<std::string,Usage>>& usages, double interval)
+{
+    std::shared_ptr<libscols_table> table(scols_new_table(), scols_unref_table);
+    if (!table) throw std::runtime_error("scols_new_table() failed");
+    scols_table_new_column(table.get(), "NAME", 0.1, 0);
+    scols_table_new_column(table.get(), "CPU%", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "MEMORY", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "READ/s", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "WRITE/s", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "IOPS", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "RX/s", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "TX/s", 0.1, SCOLS_FL_RIGHT);
+    auto number = [](const std::optional<double>& value) {
+        if (!value) return std::string("-");
+        //else
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.1f", *value);
+        return std::string(buf);
+    };
+    auto bytes = [](const std::optional<double>& value) {
+        return value? human_readable((uint64_t)*value) : std::string("-");
+    };
+    for (const auto& [name, usage] : usages) {
+        auto line = scols_table_new_line(table.get(), NULL);
+        if (!line) throw std::runtime_error("scols_table_new_line() failed");
+        scols_line_set_data(line, 0, name.c_str());
+        scols_line_set_data(line, 1, number(usage.cpu).c_str());
+        scols_line_set_data(line, 2, usage.memory? human_readable(*usage.memory).c_str() : "-");
+        scols_line_set_data(line, 3, bytes(usage.read).c_str());
+        scols_line_set_data(line, 4, bytes(usage.write).c_str());
+        scols_line_set_data(line, 5, number(usage.iops).c_str());
+        scols_line_set_data(line, 6, bytes(usage.rx).c_str());
+        scols_line_set_data(line, 7, bytes(usage.tx).c_str());
+    }
+    if (isatty(STDOUT_FILENO)) std::cout << "\033[H\033[2J"; // clear screen
+    std::cout << usages.size() << " VMs running, refreshed every " << interval << "s" << std::endl;
+    scols_print_table(table.get());
+    std::cout << std::flush;
+}
+
+static void print_json(const std::vector<std::pair<std::string,Usage>>& usages)
+{
+    nlohmann::json vms = nlohmann::json::array();
+    for (const auto& [name, usage] : usages) {
+        nlohmann::json vm = {{"name", name}};
+        if (usage.cpu) vm["cpu"] = *usage.cpu;
+        if (usage.memory) vm["memory"] = *usage.memory;
+        if (usage.read) vm["read"] = *usage.read;
+        if (usage.write) vm["write"] = *usage.write;
+        if (usage.iops) vm["iops"] = *usage.iops;
+        if (usage.rx) vm["rx"] = *usage.rx;
+        if (usage.tx) vm["tx"] = *usage.tx;
+        vms.push_back(vm);
+    }
+    auto timestamp = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::cout << nlohmann::json({{"timestamp", timestamp}, {"vms", vms}}) << std::endl;
+}
+
+namespace top {
+
+int top(const Options& options/* = {}*/)
+{
+    static const std::vector<std::string> sort_keys = {"name", "cpu", "memory", "read", "write", "iops", "rx", "tx"};
+    if (std::find(sort_keys.begin(), sort_keys.end(), options.sort) == sort_keys.end()) {
+        throw std::runtime_error("Unknown sort key: " + options.sort);
+    }
+    if (options.interval <= 0.0) throw std::runtime_error("Interval must be positive");
+    //else
+    Sampler sampler(8);
+    auto interval = std::chrono::microseconds((int64_t)(options.interval * 1000000));
+    auto next = std::chrono::steady_clock::now() + interval;
+    auto prev = sampler.sample();
+    for (uint64_t i = 0; !options.count || i < *options.count; i++) {
+        std::this_thread::sleep_until(next);
+        next += interval;
+        auto cur = sampler.sample();
+        std::vector<std::pair<std::string,Usage>> usages;
+        for (const auto& [name, counters] : cur) {
+            usages.push_back({name, prev.contains(name)? compute_usage(prev[name], counters) : Usage{.memory = counters.memory}});
+        }
+        if (options.sort != "name") {
+            std::stable_sort(usages.begin(), usages.end(), [&options](const auto& a, const auto& b) {
+                auto ka = sort_key(a.second, options.sort), kb = sort_key(b.second, options.sort);
+                if (!kb) return (bool)ka; // unknown values go last
+                if (!ka) return false;
+                return *ka > *kb;
+            });
+        }
+        if (options.json) print_json(usages);
+        else print_table(usages, options.interval);
+        prev = std::move(cur);
+    }
+    return 0;
+}
+
+} // namespace top
+
+#ifdef __VSCODE_ACTIVE_FILE__
+int main()
+{
+    return top::top({.interval = 1.0, .count = 3});
+}
+#endif // __VSCODE_ACTIVE_FILE__
@@ -0,0 +1,22 @@
+#ifndef __TOP_H__
+#define __TOP_H__
+
+#include <string>
+#include <optional>
+
+namespace top {
+    struct Options {
+        double interval = 2.0; // in seconds
+        std::string sort = "cpu"; // "name", "cpu", "memory", "read", "write", "iops", "rx" or "tx"
+        std::optional<uint64_t> count = std::nullopt; // number of refreshes.  unlimited if omitted
+        bool json = false; // print one JSON object per line instead of table
+    };
+    /**
+     * @brief Show resource usage of running VMs periodically
+     * @details CPU, memory and host-side I/O come from cgroup of vm@*.service.  Guest disk I/O comes from
+     * QMP query-blockstats and network traffic from guest agent if available.
+     */
+    int top(const Options& options = {});
+}
+
+#endif // __TOP_H__
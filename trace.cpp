@@ -0,0 +1,170 @@
+/**
+ * @file trace.cpp
+ * @brief Scoped timers and counters
+ */
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include <nlohmann/json.hpp>
+
+#include "trace.h"
+
+struct Span {
+    const char* category;
+    std::string name;
+    uint64_t start_us, duration_us;
+    uint32_t tid;
+};
+
+static std::atomic<bool> recording = false;
+static std::optional<std::filesystem::path> chrome_json_path;
+static std::mutex mutex;
+static std::vector<Span> spans;
+static std::map<std::string,uint64_t> counters;
+static const auto epoch = std::chrono::steady_clock::now();
+
+static uint32_t thread_id()
+{
+    static std::atomic<uint32_t> next_tid = 1;
+    thread_local uint32_t tid = next_tid++;
+    return tid;
+}
+
+static uint64_t micros(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+}
+
+namespace trace {
+
+void enable(const std::optional<std::filesystem::path>& chrome_json/* = std::nullopt*/)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (chrome_json) chrome_json_path = chrome_json;
+    recording.store(true, std::memory_order_relaxed);
+}
+
+void enable_from_env()
+{
+    auto env = getenv("WB_TRACE");
+    if (!env || env[0] == '\0' || std::string(env) == "0") return;
+    //else
+    if (std::string(env) == "1") enable();
+    else enable(std::filesystem::path(env));
+}
+
+bool enabled()
+{
+    return recording.load(std::memory_order_relaxed);
+}
+
+Scope::Scope(const char* _category, const char* _name, const char* detail/* = nullptr*/) : category(_category), active(enabled())
+{
+    if (!active) return;
+    //else
+    name = _name;
+    if (detail) name = name + ' ' + detail;
+    start = std::chrono::steady_clock::now();
+}
+
+Scope::~Scope()
+{
+    if (!active) return;
+    //else
+    auto end = std::chrono::steady_clock::now();
+    Span span = {category, std::move(name), micros(start), micros(end) - micros(start), thread_id()};
+    std::lock_guard<std::mutex> lock(mutex);
+    spans.push_back(std::move(span));
+}
+
+void count(const char* counter, uint64_t n/* = 1*/)
+{
+    if (!enabled()) return;
+    //else
+    std::lock_guard<std::mutex> lock(mutex);
+    counters[counter] += n;
+}
+
+void flush()
+{
+    if (!enabled()) return;
+    //else
+    std::lock_guard<std::mutex> lock(mutex);
+    recording.store(false, std::memory_order_relaxed);
+
+    if (chrome_json_path) {
+        auto events = nlohmann::json::array();
+        auto pid = getpid();
+        for (const auto& span : spans) {
+            events.push_back({
+                {"name", span.name}, {"cat", span.category}, {"ph", "X"},
+                {"ts", span.start_us}, {"dur", span.duration_us}, {"pid", pid}, {"tid", span.tid}
+            });
+        }
+        if (!counters.empty()) {
+            events.push_back({{"name", "counters"}, {"ph", "C"}, {"ts", micros(std::chrono::steady_clock::now())},
+                {"pid", pid}, {"tid", 0}, {"args", counters}});
+        }
+        std::ofstream f(*chrome_json_path);
+        f << nlohmann::json({{"traceEvents", events}, {"displayTimeUnit", "ms"}});
+        if (!f) std::cerr << "Writing trace to " << chrome_json_path->string() << " failed" << std::endl;
+        return;
+    }
+
+    //else
+    struct Stat {
+        uint64_t count = 0, total_us = 0, max_us = 0;
+    };
+    std::map<std::string,std::map<std::string,Stat>> stats;
+    std::map<std::string,Stat> totals;
+    for (const auto& span : spans) {
+        for (auto stat : {&stats[span.category][span.name], &totals[span.category]}) {
+            stat->count++;
+            stat->total_us += span.duration_us;
+            stat->max_us = std::max(stat->max_us, span.duration_us);
+        }
+    }
+    char buf[256];
+    std::cerr << "--- trace summary ---" << std::endl;
+    snprintf(buf, sizeof(buf), "%-40s %8s %12s %12s %12s", "PHASE", "COUNT", "TOTAL(ms)", "AVG(ms)", "MAX(ms)");
+    std::cerr << buf << std::endl;
+    for (const auto& [category, names] : stats) {
+        const auto& total = totals[category];
+        snprintf(buf, sizeof(buf), "%-40s %8lu %12.3f %12.3f %12.3f", category.c_str(), total.count,
+            total.total_us / 1000.0, total.total_us / 1000.0 / total.count, total.max_us / 1000.0);
+        std::cerr << buf << std::endl;
+        for (const auto& [name, stat] : names) {
+            snprintf(buf, sizeof(buf), "  %-38s %8lu %12.3f %12.3f %12.3f", name.substr(0, 38).c_str(), stat.count,
+                stat.total_us / 1000.0, stat.total_us / 1000.0 / stat.count, stat.max_us / 1000.0);
+            std::cerr << buf << std::endl;
+        }
+    }
+    for (const auto& [counter, n] : counters) {
+        snprintf(buf, sizeof(buf), "%-40s %8lu", counter.c_str(), n);
+        std::cerr << buf << std::endl;
+    }
+}
+
+} // namespace trace
+
+#ifdef __VSCODE_ACTIVE_FILE__
+int main()
+{
+    trace::enable();
+    {
+        trace::Scope scope("exec", "sleep");
+        usleep(10000);
+    }
+    trace::count("fork");
+    trace::flush();
+    return 0;
+}
+#endif // __VSCODE_ACTIVE_FILE__
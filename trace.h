@@ -0,0 +1,57 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <string>
+#include <chrono>
+#include <optional>
+#include <filesystem>
+
+/**
+ * Lightweight instrumentation of hot paths(fork/exec, socket round trips, D-Bus calls, mount table parses)
+ *
+ * Disabled by default.  Scopes and counters cost a single relaxed load when disabled as long as their names are
+ * literals or existing strings(nothing is formatted or allocated until recording).
+ */
+namespace trace {
+    /**
+     * @brief Start recording
+     * @param chrome_json Write Chrome trace JSON(chrome://tracing, Perfetto) to this file on flush() instead of summary
+     */
+    void enable(const std::optional<std::filesystem::path>& chrome_json = std::nullopt);
+    /**
+     * @brief Enable according to WB_TRACE environment variable
+     * @details "1" prints summary to stderr.  Any other non-empty value except "0" is taken as path of Chrome trace JSON
+     */
+    void enable_from_env();
+    bool enabled();
+
+    /**
+     * @brief Record duration of a scope as a span
+     * @details Name is copied only when recording, so pass literals or existing strings rather than building
+     * one at the call site.
+     * @param category Phase the span belongs to(eg. "exec", "socket", "dbus", "mount")
+     * @param name Operation without variable parts so that spans can be aggregated(eg. "systemctl")
+     * @param detail Appended to name after a space(eg. "is-active")
+     */
+    class Scope {
+        const char* category;
+        std::string name;
+        std::chrono::steady_clock::time_point start;
+        bool active;
+    public:
+        Scope(const char* _category, const char* _name, const char* detail = nullptr);
+        Scope(const char* _category, const std::string& _name) : Scope(_category, _name.c_str()) {}
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    void count(const char* counter, uint64_t n = 1);
+
+    /**
+     * @brief Emit per-phase latency summary to stderr or Chrome trace JSON to file
+     */
+    void flush();
+}
+
+#endif // __TRACE_H__
@@ -1,36 +1,67 @@
 #include <unistd.h>
-#include <poll.h>
 #include <fcntl.h>
+#include <string.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <uuid/uuid.h>
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <vector>
+#include <set>
+#include <mutex>
+#include <thread>
 #include <future>
+#include <iterator>
+#include <functional>
+#include <algorithm>
 #include <ext/stdio_filebuf.h> // for __gnu_cxx::stdio_filebuf
 
 #include <libsmartcols/libsmartcols.h>
 #include <nlohmann/json.hpp>
 #include <iniparser4/iniparser.h>
 #include <ext2fs/ext2_fs.h>
+#include <btrfsutil.h>
+#include "misc.h"
 
 #include "volume.h"
+#include "qemu.h"
+#include "systemd.h"
+#include "workerpool.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "vm.h"
 
-static int systemctl(const std::string& action, const std::string& service, bool quiet = false)
+/**
+ * @param options Options given before action(eg. "--runtime")
+ * @param args Arguments given after service(eg. properties of set-property)
+ */
+static int systemctl(const std::string& action, const std::string& service, bool quiet = false,
+    const std::vector<std::string>& options = {}, const std::vector<std::string>& args = {})
 {
+    std::vector<std::string> argv = {"systemctl"};
+    if (quiet) argv.push_back("-q");
+    argv.push_back(getuid() == 0? "--system" : "--user");
+    argv.insert(argv.end(), options.begin(), options.end());
+    argv.push_back(action);
+    argv.push_back(service);
+    argv.insert(argv.end(), args.begin(), args.end());
+    std::vector<const char*> c_argv;
+    for (const auto& arg : argv) c_argv.push_back(arg.c_str());
+    c_argv.push_back(NULL);
+
+    trace::Scope scope("exec", "systemctl", action.c_str());
     auto pid = fork();
     if (pid < 0) throw std::runtime_error("fork() failed");
     if (pid == 0) {
-        if (quiet) {
-            _exit(execlp("systemctl", "systemctl", "-q", getuid() == 0? "--system" : "--user", action.c_str(), service.c_str(), NULL));
-        } else {
-            _exit(execlp("systemctl", "systemctl", getuid() == 0? "--system" : "--user", action.c_str(), service.c_str(), NULL));
-        }
+        _exit(execvp("systemctl", const_cast<char* const*>(c_argv.data())));
     }
     int wstatus;
     waitpid(pid, &wstatus, 0);
@@ -38,13 +69,26 @@ static int systemctl(const std::string& action, const std::string& service, bool
     return WEXITSTATUS(wstatus);
 }
 
+static std::optional<systemd::UnitState> get_unit_state(const std::string& vmname)
+{
+    auto unit = "vm@" + vmname + ".service";
+    auto states = systemd::get_unit_states(unit, {unit});
+    return states? std::make_optional((*states)[unit]) : std::nullopt;
+}
+
 static bool is_autostart(const std::string& vmname)
 {
+    auto state = get_unit_state(vmname);
+    if (state) return state->is_enabled();
+    //else
     return systemctl("is-enabled", "vm@" + vmname + ".service", true) == 0;
 }
 
 static bool is_running(const std::string& vmname)
 {
+    auto state = get_unit_state(vmname);
+    if (state) return state->is_active();
+    //else
     return systemctl("is-active", "vm@" + vmname + ".service", true) == 0;
 }
 
@@ -67,34 +111,186 @@ static std::optional<std::string> get_volume_name_from_vm_name(const std::filesy
     return (volume_dir_should_be == volume_dir)? std::make_optional(volume_name) : std::nullopt;
 }
 
-static std::optional<nlohmann::json> qga_execute_query(int fd, const nlohmann::json& query)
+/**
+ * @brief Get result of a task if it completes by deadline
+ * @return std::nullopt if the task is not done in time or failed
+ */
+template <typename T> static std::optional<T> get_before(std::future<T>& future, std::chrono::steady_clock::time_point deadline)
 {
-    auto message_str = query.dump() + '\n';
-    if (write(fd, message_str.c_str(), message_str.length()) < 0) {
-        throw std::runtime_error("Error sending message via socket");
+    if (!future.valid() || future.wait_until(deadline) != std::future_status::ready) return std::nullopt;
+    //else
+    try {
+        return future.get();
     }
-    std::string message;
-    while (true) {
-        struct pollfd pollfds[1];
-        pollfds[0].fd = fd;
-        pollfds[0].events = POLLIN;
-        if (poll(pollfds, 1, 200) < 0) throw std::runtime_error("poll() failed");
-        if (pollfds[0].revents & POLLIN) {
-            char c;
-            auto n = read(fd, &c, sizeof(c));
-            if (n < 1) throw std::runtime_error("Error receiving message via socket");
-            if (c == '\n') break;
+    catch (const std::exception&) {
+        return std::nullopt;
+    }
+}
+
+static std::optional<std::string> get_ipv4_address_via_qga(const std::filesystem::path& qga, std::chrono::steady_clock::time_point deadline)
+{
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (timeout <= 0) return std::nullopt;
+    //else
+    auto res = qemu::QGA::get(qga)->execute("guest-network-get-interfaces", nullptr, timeout);
+    if (!res.has_value() || !res.value().contains("return")) return std::nullopt;
+    for (auto& interface : res.value()["return"]) {
+        if (interface["name"] == "lo") continue;
+        //else
+        for (auto& ipaddress : interface["ip-addresses"]) {
+            if (ipaddress["ip-address-type"] != "ipv4") continue;
             //else
-            message += c;
+            return std::string(ipaddress["ip-address"]);
+        }
+    }
+    return std::nullopt;
+}
+
+static std::filesystem::path vm_run_dir()
+{
+    if (getuid() == 0) return "/run/vm";
+    //else
+    const auto xdg_runtime_dir = getenv("XDG_RUNTIME_DIR");
+    return (xdg_runtime_dir? std::filesystem::path(xdg_runtime_dir) : std::filesystem::path("/run/user") / std::to_string(getuid())) / "vm";
+}
+
+/**
+ * @brief Ask a VM's QMP socket for its CPUs and memory
+ * @return std::nullopt if nobody listens on the socket(stale directory left by VM which is not running).
+ * VM whose monitor is busy or doesn't reply in time is returned with unknown cpus/memory
+ */
+static std::optional<vm::RuntimeState> probe_runtime_state(const std::filesystem::path& dir, std::chrono::steady_clock::time_point deadline)
+{
+    auto remaining_ms = [deadline]() {
+        return (int)std::max(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count(), (int64_t)0);
+    };
+    vm::RuntimeState state;
+    state.qmp = dir / "qmp.sock";
+    auto qga_sock = dir / "qga.sock";
+    if (std::filesystem::exists(qga_sock)) state.qga = qga_sock;
+
+    qemu::QMP qmp(*state.qmp);
+    auto cpus = qmp.execute("query-cpus-fast", nullptr, remaining_ms());
+    if (!cpus) {
+        auto err = qmp.last_connect_error();
+        return (err == ECONNREFUSED || err == ENOENT)? std::nullopt : std::make_optional(state);
+    }
+    //else
+    if (cpus->contains("return")) state.cpus = (*cpus)["return"].size();
+    auto memory = qmp.execute("query-memory-size-summary", nullptr, remaining_ms());
+    if (memory && memory->contains("return")) {
+        const auto& summary = (*memory)["return"];
+        state.memory = summary.value("base-memory", (uint64_t)0) + summary.value("plugged-memory", (uint64_t)0);
+    }
+    return state;
+}
+
+/**
+ * @brief Get runtime state of VMs by asking each VM's QMP socket directly
+ * @details VMs are probed in parallel with one deadline.  VM whose probe doesn't finish in time is kept with
+ * unknown cpus/memory rather than being taken as not running.
+ * @return std::nullopt if runtime directory is missing or its layout is unknown
+ */
+static std::optional<std::map<std::string,vm::RuntimeState>> get_runtime_states_from_run_dir(const std::filesystem::path& run_dir,
+    const std::optional<std::vector<std::string>>& names)
+{
+    if (!std::filesystem::is_directory(run_dir)) return std::nullopt;
+    //else
+    std::vector<std::filesystem::path> dirs;
+    for (const auto& d : std::filesystem::directory_iterator(run_dir)) {
+        if (!d.is_directory()) continue;
+        if (!std::filesystem::exists(d.path() / "qmp.sock")) return std::nullopt;
+        //else
+        if (names && std::find(names->begin(), names->end(), d.path().filename().string()) == names->end()) continue;
+        //else
+        dirs.push_back(d.path());
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000);
+    WorkerPool pool(std::min(dirs.size(), (size_t)16));
+    std::vector<std::future<std::optional<vm::RuntimeState>>> probes;
+    for (const auto& dir : dirs) {
+        probes.push_back(pool.submit([dir,deadline]() { return probe_runtime_state(dir, deadline); }));
+    }
+    std::map<std::string,vm::RuntimeState> states;
+    for (size_t i = 0; i < dirs.size(); i++) {
+        // probes observe the deadline by themselves.  grace is for scheduling
+        auto probe = get_before(probes[i], deadline + std::chrono::milliseconds(100));
+        if (probe && !*probe) continue; // stale directory
+        //else
+        if (probe) {
+            states[dirs[i].filename().string()] = **probe;
         } else {
-            return std::nullopt;
+            auto& state = states[dirs[i].filename().string()];
+            state.qmp = dirs[i] / "qmp.sock";
+            if (std::filesystem::exists(dirs[i] / "qga.sock")) state.qga = dirs[i] / "qga.sock";
         }
     }
-    return nlohmann::json::parse(message);
+    return states;
+}
+
+/**
+ * @brief Get runtime state of VMs by parsing output of 'vm show'
+ */
+static std::map<std::string,vm::RuntimeState> get_runtime_states_from_vm_show()
+{
+    auto fd = memfd_create("show", 0);
+    if (fd < 0) throw std::runtime_error("memfd_create() failed");
+
+    __gnu_cxx::stdio_filebuf<char> filebuf(fd, std::ios::in); // this cleans up fd in dtor
+
+    trace::Scope scope("exec", "vm show");
+    auto pid = fork();
+    if (pid < 0) throw std::runtime_error("fork() failed");
+    if (pid == 0) {
+        dup2(fd, STDOUT_FILENO);
+        _exit(execlp("vm", "vm", "show", NULL));
+    }
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        throw std::runtime_error("subprocess exited with error");
+    }
+    lseek(fd, 0, SEEK_SET);
+    std::istream f(&filebuf);
+    auto json = nlohmann::json::parse(f);
+    std::map<std::string,vm::RuntimeState> states;
+    for (const auto& entry: json) {
+        states[entry["name"].get<std::string>()] = {
+            .cpus = entry["cpus"].get<uint16_t>(),
+            .memory = entry["memory"].get<uint64_t>(),
+            .qga = entry.contains("qga")? std::make_optional(std::filesystem::path(entry["qga"].get<std::string>())) : std::nullopt,
+            .qmp = entry.contains("qmp")? std::make_optional(std::filesystem::path(entry["qmp"].get<std::string>())) : std::nullopt
+        };
+    }
+    return states;
+}
+
+/**
+ * @brief Count extents of a file with FIEMAP
+ */
+static std::optional<uint32_t> count_extents(int fd)
+{
+    struct fiemap fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = FIEMAP_FLAG_SYNC;
+    fm.fm_extent_count = 0; // just count
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) < 0) return std::nullopt;
+    //else
+    return fm.fm_mapped_extents;
 }
 
-static void create_allocated_nocow_file(const std::filesystem::path& path, size_t size)
+/**
+ * @brief Create NOCOW data file
+ * @param preallocation "sparse"(thin, allocated on write), "fallocate"(reserved but unwritten extents) or
+ * "zeroed"(reserved and written with zeros so that guest writes never allocate.  extent count is checked afterwards)
+ */
+static void create_allocated_nocow_file(const std::filesystem::path& path, size_t size, const std::string& preallocation)
 {
+    if (preallocation != "sparse" && preallocation != "fallocate" && preallocation != "zeroed") {
+        throw std::runtime_error("Unknown preallocation mode: " + preallocation);
+    }
+    //else
     auto fd = open(path.c_str(), O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
     if (fd < 0) throw std::runtime_error("Creating file with open() failed. Error createing data file.");
     int f = 0;
@@ -105,11 +301,347 @@ static void create_allocated_nocow_file(const std::filesystem::path& path, size_
     close(fd);
     fd = open(path.c_str(), O_RDWR);
     if (fd < 0) throw std::runtime_error("open() failed. Error createing data file.");
+    std::shared_ptr<void> fd_guard(nullptr, [fd](auto){ close(fd); });
+    if (preallocation == "sparse") {
+        if (ftruncate(fd, size) < 0) throw std::runtime_error("ftruncate() failed. Error createing data file. (err=" + std::string(strerror(errno)) + ")");
+        return;
+    }
+    //else
     if (fallocate(fd, 0, 0, size) < 0) {
-        close(fd);
         throw std::runtime_error("fallocate() failed. Error createing data file. (err=" + std::string(strerror(errno)) + ")");
     }
-    close(fd);
+    if (preallocation == "fallocate") return;
+    //else
+    const size_t chunk_size = 4 * 1024 * 1024;
+    std::vector<char> zero(chunk_size, 0);
+    for (size_t offset = 0; offset < size;) {
+        auto n = pwrite(fd, zero.data(), std::min(chunk_size, size - offset), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("pwrite() failed. Error createing data file. (err=" + std::string(strerror(errno)) + ")");
+        }
+        offset += n;
+    }
+    if (fdatasync(fd) < 0) throw std::runtime_error("fdatasync() failed. Error createing data file.");
+    auto extents = count_extents(fd);
+    if (!extents) return; // filesystem doesn't support FIEMAP
+    //else
+    const size_t max_extent_size = 128 * 1024 * 1024; // btrfs doesn't make extents larger than this
+    auto ideal = (size + max_extent_size - 1) / max_extent_size;
+    if (*extents > ideal * 2) {
+        std::cerr << "Warning: " << path.string() << " consists of " << *extents << " extents(" << ideal
+            << " expected). Free space of the volume may be fragmented." << std::endl;
+    }
+}
+
+/**
+ * @brief Create VM directory
+ * @details The directory is kept a plain directory(not a nested btrfs subvolume) so that volume snapshots and backups
+ * include it.  Sharing extents is done per file by clone_file().
+ */
+static void create_vm_dir(const std::filesystem::path& dir)
+{
+    std::filesystem::create_directories(dir.parent_path());
+    if (!std::filesystem::create_directory(dir)) throw std::runtime_error(dir.string() + " already exists");
+}
+
+static void remove_vm_dir(const std::filesystem::path& dir)
+{
+    // VM dirs made by earlier versions may be subvolumes
+    if (btrfs_util_is_subvolume(dir.c_str()) == BTRFS_UTIL_OK) {
+        btrfs_util_delete_subvolume(dir.c_str(), BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE);
+        return;
+    }
+    //else
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+}
+
+static void validate_vmname(const std::string& vmname)
+{
+    // check if vmname is RFC952/RFC1123 compliant
+    if (vmname.length() > 63) throw std::runtime_error("VM name must be 63 characters or less");
+    if (vmname[0] == '-' || vmname[vmname.length() - 1] == '-') throw std::runtime_error("VM name must not start or end with '-'");
+    if (vmname.find("--") != std::string::npos) throw std::runtime_error("VM name must not contain consecutive '-'");
+    if (vmname.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != std::string::npos)
+        throw std::runtime_error("VM name must contain only alphanumeric characters and '-'");
+    if (vmname.find_first_not_of("0123456789") == std::string::npos) throw std::runtime_error("VM name must not be all digits");
+}
+
+static const uint32_t default_memory = 1024; // MB, what vm command assumes when vm.ini doesn't specify
+static const uint16_t default_cpu = 1;
+
+static std::set<int> parse_cpulist(const std::string& cpulist)
+{
+    std::set<int> cpus;
+    std::istringstream s(cpulist);
+    std::string range;
+    while (std::getline(s, range, ',')) {
+        if (range.empty() || range.find_first_not_of("0123456789-\n") != std::string::npos) continue;
+        //else
+        auto hyphen = range.find('-');
+        auto first = std::stoi(range.substr(0, hyphen));
+        auto last = hyphen == std::string::npos? first : std::stoi(range.substr(hyphen + 1));
+        for (auto i = first; i <= last; i++) cpus.insert(i);
+    }
+    return cpus;
+}
+
+static std::string format_cpulist(const std::set<int>& cpus)
+{
+    std::string cpulist;
+    for (auto i = cpus.begin(); i != cpus.end();) {
+        auto first = *i, last = *i;
+        while (++i != cpus.end() && *i == last + 1) last = *i;
+        if (!cpulist.empty()) cpulist += ',';
+        cpulist += first == last? std::to_string(first) : std::to_string(first) + '-' + std::to_string(last);
+    }
+    return cpulist;
+}
+
+struct Resources {
+    uint32_t memory = default_memory; // in MB
+    uint16_t cpu = default_cpu;
+    std::set<int> cpuset = {}; // empty if not pinned
+    std::optional<int> numa_node = std::nullopt;
+    int priority = 0; // VMs of higher priority start earlier and stop later
+};
+
+static Resources read_resources(const std::filesystem::path& vm_dir)
+{
+    Resources resources;
+    auto ini_path = vm_dir / "vm.ini";
+    if (!std::filesystem::exists(ini_path)) return resources;
+    //else
+    auto ini = std::shared_ptr<dictionary>(iniparser_load(ini_path.c_str()), iniparser_freedict);
+    if (!ini) return resources;
+    //else
+    auto memory = iniparser_getint(ini.get(), ":memory", 0);
+    if (memory > 0) resources.memory = memory;
+    auto cpu = iniparser_getint(ini.get(), ":cpu", 0);
+    if (cpu > 0) resources.cpu = cpu;
+    resources.cpuset = parse_cpulist(iniparser_getstring(ini.get(), ":cpuset", ""));
+    auto numa_node = iniparser_getint(ini.get(), ":numa_node", -1);
+    if (numa_node >= 0) resources.numa_node = numa_node;
+    resources.priority = iniparser_getint(ini.get(), ":priority", 0);
+    return resources;
+}
+
+/**
+ * @brief Replace(or append) top-level key=value line of vm.ini
+ */
+static void set_ini_value(const std::filesystem::path& ini_path, const std::string& key, const std::string& value)
+{
+    std::vector<std::string> lines;
+    bool replaced = false, in_section = false;
+    {
+        std::ifstream f(ini_path);
+        std::string line;
+        while (f && std::getline(f, line)) {
+            if (line.starts_with("[")) in_section = true;
+            auto eq = line.find('=');
+            if (!in_section && !replaced && eq != std::string::npos && line.substr(0, line.find_last_not_of(" \t", eq - 1) + 1) == key) {
+                line = key + '=' + value;
+                replaced = true;
+            }
+            lines.push_back(line);
+        }
+    }
+    // top-level keys must precede sections
+    if (!replaced) lines.insert(std::find_if(lines.begin(), lines.end(), [](const auto& l) { return l.starts_with("["); }), key + '=' + value);
+    std::ofstream f(ini_path);
+    for (const auto& line : lines) f << line << std::endl;
+    if (!f) throw std::runtime_error("Writing " + ini_path.string() + " failed");
+}
+
+static std::vector<std::string> list_vm_names(const std::filesystem::path& vm_root)
+{
+    std::vector<std::string> vmnames;
+    if (!std::filesystem::is_directory(vm_root)) return vmnames;
+    //else
+    for (const auto& d : std::filesystem::directory_iterator(vm_root)) {
+        auto name = d.path().filename().string();
+        if (!d.is_directory() || name[0] == '@' || name[0] == '.') continue; // directory starts with '@' is not VM but it's volume
+        //else
+        vmnames.push_back(name);
+    }
+    std::sort(vmnames.begin(), vmnames.end());
+    return vmnames;
+}
+
+/**
+ * @brief Resources claimed by other VMs which are running or start automatically on boot
+ */
+static std::map<std::string,Resources> get_committed_resources(const std::filesystem::path& vm_root, const std::set<std::string>& except)
+{
+    std::vector<std::string> vmnames, units;
+    for (const auto& name : list_vm_names(vm_root)) {
+        if (except.contains(name)) continue;
+        //else
+        vmnames.push_back(name);
+        units.push_back("vm@" + name + ".service");
+    }
+    auto unit_states = systemd::get_unit_states("vm@*.service", units);
+    std::map<std::string,vm::RuntimeState> runtime_states;
+    try {
+        runtime_states = vm::get_runtime_states();
+    }
+    catch (const std::runtime_error&) {
+        // unit states are enough to tell which VMs are running
+    }
+
+    std::map<std::string,Resources> committed;
+    for (const auto& name : vmnames) {
+        auto unit = "vm@" + name + ".service";
+        auto running = runtime_states.contains(name) || (unit_states? (*unit_states)[unit].is_active() : is_running(name));
+        auto autostart = unit_states? (*unit_states)[unit].is_enabled() : is_autostart(name);
+        if (!running && !autostart) continue;
+        //else
+        auto resources = read_resources(vm_root / name);
+        if (runtime_states.contains(name)) {
+            const auto& state = runtime_states[name];
+            if (state.cpus) resources.cpu = *state.cpus;
+            if (state.memory) resources.memory = *state.memory / 1024 / 1024;
+        }
+        committed[name] = resources;
+    }
+    return committed;
+}
+
+/**
+ * @brief Check if host has enough resources for a VM
+ * @param resources Resources of the VM(or sum of VMs)
+ * @param starting true if the VM is about to start(memory must be available right now)
+ * @param disk_needs Bytes to be allocated on the filesystem of each dir.  Shortage is fatal if disk_required is true
+ * @details Problems are fatal unless force is true, in which case they are printed as warnings.
+ */
+static void check_admission(const std::map<std::string,Resources>& committed, const Resources& resources,
+    bool starting, const std::vector<std::pair<std::filesystem::path,uint64_t>>& disk_needs, bool disk_required, bool force)
+{
+    std::vector<std::string> problems, warnings;
+    uint64_t committed_memory = resources.memory;
+    uint32_t committed_cpu = resources.cpu;
+    for (const auto& [name, r] : committed) {
+        committed_memory += r.memory;
+        committed_cpu += r.cpu;
+    }
+    auto status = telemetry::Collector::get().collect();
+    if (status.contains("memory")) {
+        uint64_t total = status["memory"]["total"].get<uint64_t>() / 1024 / 1024;
+        uint64_t available = status["memory"]["unused"].get<uint64_t>() / 1024 / 1024;
+        auto overcommit = "Memory of running and autostart VMs amounts to " + std::to_string(committed_memory)
+            + "MB while host has " + std::to_string(total) + "MB";
+        if (committed_memory > total) (starting? problems : warnings).push_back(overcommit);
+        if (starting && resources.memory > available) {
+            problems.push_back("VM needs " + std::to_string(resources.memory) + "MB of memory but only "
+                + std::to_string(available) + "MB is available");
+        }
+    }
+    auto cpus = std::thread::hardware_concurrency();
+    if (cpus > 0 && committed_cpu > cpus) {
+        warnings.push_back("Running and autostart VMs have " + std::to_string(committed_cpu) + " vCPUs in total while host has "
+            + std::to_string(cpus) + " CPUs");
+    }
+    // dirs on the same filesystem share its free space
+    std::map<dev_t,std::pair<std::filesystem::path,uint64_t>> needs_by_fs;
+    for (const auto& [dir, bytes] : disk_needs) {
+        struct stat st;
+        if (bytes == 0 || stat(dir.c_str(), &st) < 0) continue;
+        //else
+        auto& need = needs_by_fs[st.st_dev];
+        if (need.first.empty()) need.first = dir;
+        need.second += bytes;
+    }
+    for (const auto& [dev, need] : needs_by_fs) {
+        struct statvfs s;
+        if (statvfs(need.first.c_str(), &s) < 0) continue;
+        //else
+        uint64_t free = (uint64_t)s.f_bavail * s.f_frsize;
+        if (need.second > free) {
+            (disk_required? problems : warnings).push_back(std::to_string(need.second / 1024 / 1024) + "MB of disk space may be needed but "
+                + std::to_string(free / 1024 / 1024) + "MB is free on " + need.first.string());
+        }
+    }
+
+    if (!force && !problems.empty()) {
+        std::string message;
+        for (const auto& problem : problems) message += (message.empty()? "" : ". ") + problem;
+        throw std::runtime_error(message + " (use --force to proceed anyway)");
+    }
+    //else
+    for (const auto& problem : problems) std::cerr << "Warning: " << problem << std::endl;
+    for (const auto& warning : warnings) std::cerr << "Warning: " << warning << std::endl;
+}
+
+/**
+ * @brief Bytes which thin-provisioned(sparse) files of VM may allocate in the future
+ */
+static uint64_t get_unallocated_size(const std::filesystem::path& vm_dir)
+{
+    uint64_t unallocated = 0;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(vm_dir, ec)) {
+        struct stat st;
+        if (!entry.is_regular_file() || stat(entry.path().c_str(), &st) < 0) continue;
+        //else
+        uint64_t allocated = (uint64_t)st.st_blocks * 512;
+        if ((uint64_t)st.st_size > allocated) unallocated += st.st_size - allocated;
+    }
+    return unallocated;
+}
+
+/**
+ * @brief Choose CPUs not pinned by other VMs, all from one NUMA node
+ * @details The node with most free CPUs is chosen so that VMs spread over nodes.
+ */
+static std::pair<std::set<int>,std::optional<int>> assign_cpuset(const std::map<std::string,Resources>& committed, uint16_t cpu)
+{
+    std::map<int,std::set<int>> nodes;
+    std::error_code ec;
+    for (const auto& d : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        auto name = d.path().filename().string();
+        if (!name.starts_with("node") || name.find_first_not_of("0123456789", 4) != std::string::npos) continue;
+        //else
+        std::ifstream f(d.path() / "cpulist");
+        std::string cpulist;
+        if (f && std::getline(f, cpulist)) nodes[std::stoi(name.substr(4))] = parse_cpulist(cpulist);
+    }
+    bool numa = !nodes.empty();
+    if (!numa) {
+        for (int i = 0; i < (int)std::thread::hardware_concurrency(); i++) nodes[0].insert(i);
+    }
+
+    std::set<int> used;
+    for (const auto& [name, r] : committed) used.insert(r.cpuset.begin(), r.cpuset.end());
+
+    std::optional<int> best_node;
+    std::set<int> best_free;
+    for (const auto& [node, cpus] : nodes) {
+        std::set<int> free;
+        std::set_difference(cpus.begin(), cpus.end(), used.begin(), used.end(), std::inserter(free, free.begin()));
+        if (free.size() >= cpu && (!best_node || free.size() > best_free.size())) {
+            best_node = node;
+            best_free = free;
+        }
+    }
+    if (!best_node) throw std::runtime_error("No " + std::string(numa? "NUMA node" : "host") + " has " + std::to_string(cpu) + " CPUs not pinned by other VMs");
+    //else
+    std::set<int> cpuset(best_free.begin(), std::next(best_free.begin(), cpu));
+    return {cpuset, numa? best_node : std::nullopt};
+}
+
+/**
+ * @brief Pin VM to its CPUs/NUMA node(if any) for the next start via transient unit properties
+ */
+static void apply_cpuset(const std::string& vmname, const Resources& resources)
+{
+    if (resources.cpuset.empty()) return;
+    //else
+    std::vector<std::string> properties = {"AllowedCPUs=" + format_cpulist(resources.cpuset)};
+    if (resources.numa_node) properties.push_back("AllowedMemoryNodes=" + std::to_string(*resources.numa_node));
+    if (systemctl("set-property", "vm@" + vmname + ".service", false, {"--runtime"}, properties) != 0) {
+        throw std::runtime_error("Pinning CPUs of " + vmname + " failed");
+    }
 }
 
 /*
@@ -257,18 +789,190 @@ static int journal(const std::vector<std::string>& args)
 
 namespace vm {
 
-int start(const std::string& vmname, bool console)
+int start(const std::filesystem::path& vm_root, const std::string& vmname, const StartOptions& options/* = {}*/)
 {
     if (is_running(vmname)) throw std::runtime_error(vmname + " is already running.");
     //else
+    auto vm_dir = vm_root / vmname;
+    if (!std::filesystem::is_directory(vm_dir)) throw std::runtime_error(vmname + " does not exist");
+    //else
+    auto resources = read_resources(vm_dir);
+    auto committed = get_committed_resources(vm_root, {vmname});
+    check_admission(committed, resources, true, {{vm_dir, get_unallocated_size(vm_dir)}}, false, options.force);
+    if (options.pin && resources.cpuset.empty()) {
+        std::tie(resources.cpuset, resources.numa_node) = assign_cpuset(committed, resources.cpu);
+        set_ini_value(vm_dir / "vm.ini", "cpuset", format_cpulist(resources.cpuset));
+        if (resources.numa_node) set_ini_value(vm_dir / "vm.ini", "numa_node", std::to_string(*resources.numa_node));
+    }
+    for (const auto& [name, r] : committed) {
+        std::set<int> overlap;
+        std::set_intersection(r.cpuset.begin(), r.cpuset.end(), resources.cpuset.begin(), resources.cpuset.end(),
+            std::inserter(overlap, overlap.begin()));
+        if (!overlap.empty()) std::cerr << "Warning: CPU " << format_cpulist(overlap) << " is also pinned by " << name << std::endl;
+    }
+    apply_cpuset(vmname, resources);
+
     int rst = systemctl("start", "vm@" + vmname + ".service");
-    if (rst == 0 && console) {
+    if (rst == 0 && options.console) {
         return vm::console(vmname);
     }
     //else
     return rst;
 }
 
+/**
+ * @brief Run action on VMs group by group in order of priority
+ * @details VMs of the same priority are processed concurrently.  Next group is not started until whole group is done.
+ * @return Error for each VM(std::nullopt if succeeded)
+ */
+static std::map<std::string,std::optional<std::string>> run_by_priority(const std::map<std::string,Resources>& vms,
+    bool higher_first, size_t concurrency, std::function<void(const std::string&)> action)
+{
+    std::map<int,std::vector<std::string>> groups;
+    for (const auto& [name, r] : vms) groups[r.priority].push_back(name);
+    std::vector<int> priorities;
+    for (const auto& [priority, names] : groups) priorities.push_back(priority);
+    if (higher_first) std::reverse(priorities.begin(), priorities.end());
+
+    std::map<std::string,std::optional<std::string>> results;
+    for (auto priority : priorities) {
+        WorkerPool pool(concurrency);
+        std::map<std::string,std::future<void>> futures;
+        for (const auto& name : groups[priority]) {
+            futures[name] = pool.submit([&action,name]() { action(name); });
+        }
+        for (auto& [name, future] : futures) {
+            try {
+                future.get();
+                results[name] = std::nullopt;
+            }
+            catch (const std::exception& err) {
+                results[name] = err.what();
+            }
+        }
+    }
+    return results;
+}
+
+/**
+ * @brief Print aggregated result of bulk operation
+ * @return 0 if no VM failed
+ */
+static int print_bulk_results(const std::vector<std::string>& vmnames, const std::map<std::string,Resources>& vms,
+    const std::map<std::string,std::optional<std::string>>& results, const std::map<std::string,std::string>& skipped)
+{
+    std::shared_ptr<libscols_table> table(scols_new_table(), scols_unref_table);
+    if (!table) throw std::runtime_error("scols_new_table() failed");
+    scols_table_new_column(table.get(), "NAME", 0.1, 0);
+    scols_table_new_column(table.get(), "PRIORITY", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "RESULT", 0.1, 0);
+    size_t failed = 0;
+    for (const auto& name : vmnames) {
+        auto line = scols_table_new_line(table.get(), NULL);
+        if (!line) throw std::runtime_error("scols_table_new_line() failed");
+        scols_line_set_data(line, 0, name.c_str());
+        scols_line_set_data(line, 1, vms.contains(name)? std::to_string(vms.at(name).priority).c_str() : "-");
+        if (skipped.contains(name)) {
+            scols_line_set_data(line, 2, ("skipped(" + skipped.at(name) + ")").c_str());
+        } else if (results.contains(name) && !results.at(name)) {
+            scols_line_set_data(line, 2, "OK");
+        } else {
+            scols_line_set_data(line, 2, results.contains(name)? results.at(name)->c_str() : "not processed");
+            failed++;
+        }
+    }
+    scols_print_table(table.get());
+    if (failed > 0) std::cerr << failed << " of " << vmnames.size() << " VMs failed" << std::endl;
+    return failed > 0? 1 : 0;
+}
+
+/**
+ * @brief Tell which of VMs are running by asking systemd at once
+ */
+static std::map<std::string,bool> get_running(const std::vector<std::string>& vmnames)
+{
+    std::vector<std::string> units;
+    for (const auto& name : vmnames) units.push_back("vm@" + name + ".service");
+    auto unit_states = systemd::get_unit_states("vm@*.service", units);
+    std::map<std::string,bool> running;
+    for (const auto& name : vmnames) {
+        running[name] = unit_states? (*unit_states)["vm@" + name + ".service"].is_active() : is_running(name);
+    }
+    return running;
+}
+
+/**
+ * @brief Drop repeated names keeping order of first appearance
+ */
+static std::vector<std::string> unique_names(const std::vector<std::string>& names)
+{
+    std::vector<std::string> unique;
+    std::set<std::string> seen;
+    for (const auto& name : names) {
+        if (seen.insert(name).second) unique.push_back(name);
+    }
+    return unique;
+}
+
+int start(const std::filesystem::path& vm_root, const std::vector<std::string>& vmnames, const BulkOptions& options/* = {}*/)
+{
+    auto names = vmnames.empty()? list_vm_names(vm_root) : unique_names(vmnames);
+    auto running = get_running(names);
+    std::map<std::string,Resources> vms;
+    std::map<std::string,std::optional<std::string>> results;
+    std::map<std::string,std::string> skipped;
+    for (const auto& name : names) {
+        if (!std::filesystem::is_directory(vm_root / name)) results[name] = "does not exist";
+        else if (running[name]) skipped[name] = "already running";
+        else vms[name] = read_resources(vm_root / name);
+    }
+
+    // whole batch is admitted at once as VMs started by this batch are not running yet when others are checked
+    std::set<std::string> batch;
+    for (const auto& [name, r] : vms) batch.insert(name);
+    auto committed = get_committed_resources(vm_root, batch);
+    Resources total = {.memory = 0, .cpu = 0};
+    std::vector<std::pair<std::filesystem::path,uint64_t>> disk_needs;
+    for (const auto& [name, r] : vms) {
+        total.memory += r.memory;
+        total.cpu += r.cpu;
+        disk_needs.push_back({vm_root / name, get_unallocated_size(vm_root / name)});
+    }
+    if (!vms.empty()) check_admission(committed, total, true, disk_needs, false, options.force);
+
+    if (options.pin) {
+        for (const auto& [name, r] : vms) {
+            if (!r.cpuset.empty()) committed[name] = r;
+        }
+        for (auto& [name, r] : vms) {
+            if (!r.cpuset.empty()) continue;
+            //else
+            std::tie(r.cpuset, r.numa_node) = assign_cpuset(committed, r.cpu);
+            set_ini_value(vm_root / name / "vm.ini", "cpuset", format_cpulist(r.cpuset));
+            if (r.numa_node) set_ini_value(vm_root / name / "vm.ini", "numa_node", std::to_string(*r.numa_node));
+            committed[name] = r;
+        }
+    }
+
+    std::mutex mutex;
+    auto next_start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::microseconds(options.rate && *options.rate > 0.0? (int64_t)(1000000 / *options.rate) : 0);
+    results.merge(run_by_priority(vms, true, options.concurrency, [&](const std::string& name) {
+        // spread starts over time to avoid boot storm
+        std::chrono::steady_clock::time_point at;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            at = std::max(next_start, std::chrono::steady_clock::now());
+            next_start = at + interval;
+        }
+        std::this_thread::sleep_until(at);
+        apply_cpuset(name, vms.at(name));
+        if (systemctl("start", "vm@" + name + ".service", true) != 0) throw std::runtime_error("systemctl start failed");
+    }));
+
+    return print_bulk_results(names, vms, results, skipped);
+}
+
 int stop(const std::string& vmname, bool force, bool console)
 {
     if (!is_running(vmname)) throw std::runtime_error(vmname + " is not running.");
@@ -280,6 +984,50 @@ int stop(const std::string& vmname, bool force, bool console)
     return execvp("vm", const_cast<char* const*>(argv.data()));
 }
 
+int stop(const std::filesystem::path& vm_root, const std::vector<std::string>& vmnames, bool force, const BulkOptions& options/* = {}*/)
+{
+    auto names = vmnames.empty()? list_vm_names(vm_root) : unique_names(vmnames);
+    auto running = get_running(names);
+    std::map<std::string,Resources> vms;
+    std::map<std::string,std::optional<std::string>> results;
+    std::map<std::string,std::string> skipped;
+    for (const auto& name : names) {
+        if (!std::filesystem::is_directory(vm_root / name)) results[name] = "does not exist";
+        else if (!running[name]) skipped[name] = "not running";
+        else vms[name] = read_resources(vm_root / name);
+    }
+
+    auto timeout = std::chrono::seconds(options.stop_timeout);
+    results.merge(run_by_priority(vms, false, options.concurrency, [force,timeout](const std::string& name) {
+        trace::Scope scope("exec", "vm stop");
+        auto pid = fork();
+        if (pid < 0) throw std::runtime_error("fork() failed");
+        if (pid == 0) {
+            if (force) _exit(execlp("vm", "vm", "stop", "-f", name.c_str(), NULL));
+            else _exit(execlp("vm", "vm", "stop", name.c_str(), NULL));
+        }
+        //else
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        int wstatus;
+        while (true) {
+            auto rst = waitpid(pid, &wstatus, WNOHANG);
+            if (rst == pid) break;
+            if (rst < 0 && errno != EINTR) throw std::runtime_error("waitpid() failed");
+            //else
+            if (timeout.count() > 0 && std::chrono::steady_clock::now() >= deadline) {
+                kill(pid, SIGTERM);
+                waitpid(pid, &wstatus, 0);
+                throw std::runtime_error("timed out after " + std::to_string(timeout.count()) + "s");
+            }
+            //else
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) throw std::runtime_error("vm stop failed");
+    }));
+
+    return print_bulk_results(names, vms, results, skipped);
+}
+
 int restart(const std::string& vmname, bool force)
 {
     if (force) {
@@ -318,10 +1066,14 @@ int autostart(const std::string& vmname, std::optional<bool> on_off)
     return set_autostart(vmname, on_off.value());
 }
 
-int list(const std::filesystem::path& vm_root)
+/**
+ * @brief Collect states of VMs
+ * @return Array of objects.  Members not collected by the deadline are null
+ */
+static nlohmann::json collect_list(const std::filesystem::path& vm_root, const ListOptions& options)
 {
     struct VM {
-        bool running = false;
+        std::optional<bool> running = std::nullopt;
         std::optional<uint16_t> cpu = std::nullopt;
         std::optional<uint32_t> memory = std::nullopt;
         std::optional<std::string> volume = std::nullopt;
@@ -329,84 +1081,124 @@ int list(const std::filesystem::path& vm_root)
         std::optional<std::string> ip_address = std::nullopt;
     };
 
-    std::map<std::string,VM> vms;
+    std::vector<std::filesystem::path> vm_dirs;
     if (std::filesystem::exists(vm_root) && std::filesystem::is_directory(vm_root)) {
         for (const auto& d : std::filesystem::directory_iterator(vm_root)) {
             if (!d.is_directory()) continue;
             auto name = d.path().filename().string();
             if (name[0] == '@' || name[0] == '.') continue; // directory starts with '@' is not VM but it's volume
             //else
-            auto ini_path = d.path() / "vm.ini";
-            auto ini = std::shared_ptr<dictionary>(std::filesystem::exists(ini_path)? iniparser_load(ini_path.c_str()) : dictionary_new(0), iniparser_freedict);
-            uint16_t cpu = iniparser_getint(ini.get(), ":cpu", 0);
-            uint32_t memory = iniparser_getint(ini.get(), ":memory", 0);
-            vms[name] = {
-                .cpu = cpu > 0? std::make_optional(cpu) : std::nullopt,
-                .memory = memory > 0? std::make_optional(memory) : std::nullopt,
-                .volume = get_volume_name_from_vm_name(vm_root, name),
-                .autostart = is_autostart(name)
-            };
+            vm_dirs.push_back(d.path());
         }
     }
 
-    auto fd = memfd_create("show", 0);
-    if (fd < 0) throw std::runtime_error("memfd_create() failed");
+    // everything below is collected in parallel.  whatever is not ready by the deadline is shown as '-'
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeout_ms);
+    WorkerPool pool(options.concurrency);
 
-    __gnu_cxx::stdio_filebuf<char> filebuf(fd, std::ios::in); // this cleans up fd in dtor
+    // ask systemd about all VMs at once
+    std::vector<std::string> units;
+    for (const auto& vm_dir : vm_dirs) {
+        units.push_back("vm@" + vm_dir.filename().string() + ".service");
+    }
+    auto unit_states = pool.submit([units]() { return systemd::get_unit_states("vm@*.service", units); });
+    auto runtime_states = pool.submit([]() { return get_runtime_states(); });
 
-    auto pid = fork();
-    if (pid < 0) throw std::runtime_error("fork() failed");
-    if (pid == 0) {
-        dup2(fd, STDOUT_FILENO);
-        _exit(execlp("vm", "vm", "show", NULL));
+    std::map<std::string,std::future<std::pair<uint16_t,uint32_t>>> inis;
+    std::map<std::string,std::future<std::optional<std::string>>> volumes;
+    for (const auto& vm_dir : vm_dirs) {
+        auto name = vm_dir.filename().string();
+        inis[name] = pool.submit([vm_dir]() {
+            auto ini_path = vm_dir / "vm.ini";
+            auto ini = std::shared_ptr<dictionary>(std::filesystem::exists(ini_path)? iniparser_load(ini_path.c_str()) : dictionary_new(0), iniparser_freedict);
+            return std::make_pair((uint16_t)iniparser_getint(ini.get(), ":cpu", 0), (uint32_t)iniparser_getint(ini.get(), ":memory", 0));
+        });
+        volumes[name] = pool.submit([vm_root,name]() { return get_volume_name_from_vm_name(vm_root, name); });
     }
-    int wstatus;
-    if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
-        throw std::runtime_error("subprocess exited with error");
+
+    std::map<std::string,VM> vms;
+    std::map<std::string,std::future<bool>> autostarts;
+    auto _unit_states = get_before(unit_states, deadline);
+    for (const auto& vm_dir : vm_dirs) {
+        auto name = vm_dir.filename().string();
+        auto& vm = vms[name];
+        auto ini = get_before(inis[name], deadline);
+        if (ini) {
+            if (ini->first > 0) vm.cpu = ini->first;
+            if (ini->second > 0) vm.memory = ini->second;
+        }
+        auto volume = get_before(volumes[name], deadline);
+        if (volume) vm.volume = *volume;
+        if (_unit_states && *_unit_states) {
+            vm.autostart = (**_unit_states)["vm@" + name + ".service"].is_enabled();
+        } else if (_unit_states) { // systemd is not reachable via D-Bus
+            autostarts[name] = pool.submit([name]() { return is_autostart(name); });
+        }
     }
-    lseek(fd, 0, SEEK_SET);
-    std::istream f(&filebuf);
-    auto json = nlohmann::json::parse(f);
-    std::map<std::string,std::future<std::optional<std::string>>> threads;
-    for (const auto& entry: json) {
-        auto vmname = entry["name"];
-        vms[vmname].running = true;
-        vms[vmname].cpu = entry["cpus"].get<uint16_t>();
-        vms[vmname].memory = entry["memory"].get<uint64_t>() / 1024 / 1024;
-        auto qga = entry.contains("qga")? std::make_optional(std::filesystem::path(entry["qga"].get<std::string>())) : std::nullopt;
-        // communicate via qga to get ipv4 address
-        if (qga.has_value()) { 
-            threads[vmname] = std::async([](const std::filesystem::path& qga) -> std::optional<std::string> {
-                struct sockaddr_un sockaddr;
-                memset(&sockaddr, 0, sizeof(sockaddr));
-                auto sock = socket(AF_UNIX, SOCK_STREAM, 0);
-                if (sock < 0) throw std::runtime_error("socket() failed");
-                sockaddr.sun_family = AF_UNIX;
-                strcpy(sockaddr.sun_path, qga.c_str());
-                // TODO: qga socket should be locked
-                if (connect(sock, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
-                    close(sock);
-                    return std::nullopt;
-                }
-                auto res = qga_execute_query(sock, nlohmann::json({ {"execute", "guest-network-get-interfaces"} }));
-                if (!res.has_value() || !res.value().contains("return")) return std::nullopt;
-                for (auto& interface : res.value()["return"]) {
-                    if (interface["name"] == "lo") continue;
-                    //else
-                    for (auto& ipaddress : interface["ip-addresses"]) {
-                        if (ipaddress["ip-address-type"] != "ipv4") continue;
-                        //else
-                        return std::string(ipaddress["ip-address"]);
-                    }
-                }
-                return std::nullopt;
-            }, qga.value());
+
+    std::map<std::string,std::future<std::optional<std::string>>> ip_addresses;
+    auto _runtime_states = get_before(runtime_states, deadline);
+    if (_runtime_states) {
+        for (auto& vm : vms) {
+            vm.second.running = false;
+        }
+        for (const auto& [vmname, state] : *_runtime_states) {
+            auto& vm = vms[vmname];
+            vm.running = true;
+            if (state.cpus) vm.cpu = state.cpus;
+            if (state.memory) vm.memory = *state.memory / 1024 / 1024;
+            // communicate via qga to get ipv4 address
+            if (state.qga.has_value()) {
+                ip_addresses[vmname] = pool.submit([qga = state.qga.value(), deadline]() {
+                    return get_ipv4_address_via_qga(qga, deadline);
+                });
+            }
         }
     }
 
-    for (auto& [vmname, thread] : threads) {
-        vms[vmname].ip_address = thread.get();
+    for (auto& [vmname, autostart] : autostarts) {
+        vms[vmname].autostart = get_before(autostart, deadline);
+    }
+    for (auto& [vmname, ip_address] : ip_addresses) {
+        auto _ip_address = get_before(ip_address, deadline);
+        if (_ip_address) vms[vmname].ip_address = *_ip_address;
     }
+    pool.cancel();
+
+    auto optional = [](const auto& value) { return value? nlohmann::json(*value) : nlohmann::json(nullptr); };
+    nlohmann::json list = nlohmann::json::array();
+    for (const auto& [name, vm] : vms) {
+        list.push_back({
+            {"name", name},
+            {"running", optional(vm.running)},
+            {"volume", optional(vm.volume)},
+            {"autostart", optional(vm.autostart)},
+            {"cpu", optional(vm.cpu)},
+            {"memory", optional(vm.memory)}, // in MB
+            {"ip_address", optional(vm.ip_address)}
+        });
+    }
+    return list;
+}
+
+int list(const std::filesystem::path& vm_root, const ListOptions& options/* = {}*/)
+{
+    nlohmann::json vms;
+    std::optional<std::string> cache_key;
+    if (options.cache_ttl) {
+        cache_key = state_cache_key(vm_root);
+        auto cached = load_state_cache("vm-list", *cache_key, std::chrono::seconds(*options.cache_ttl));
+        if (cached) vms = nlohmann::json::parse(*cached, nullptr, false);
+    }
+    if (!vms.is_array()) {
+        vms = collect_list(vm_root, options);
+        if (cache_key) save_state_cache("vm-list", *cache_key, vms.dump());
+    }
+    if (options.json) {
+        std::cout << vms << std::endl;
+        return 0;
+    }
+    //else
 
     std::shared_ptr<libscols_table> table(scols_new_table(), scols_unref_table);
     if (!table) throw std::runtime_error("scols_new_table() failed");
@@ -426,34 +1218,50 @@ int list(const std::filesystem::path& vm_root)
     scols_line_set_data(sep, 5, "-------");
     scols_line_set_data(sep, 6, "---------------");
 
-    for (const auto& i:vms) {
+    for (const auto& vm : vms) {
         auto line = scols_table_new_line(table.get(), NULL);
         if (!line) throw std::runtime_error("scols_table_new_line() failed");
-        scols_line_set_data(line, 0, i.second.running? "*" : "");
-        scols_line_set_data(line, 1, i.first.c_str());
-        scols_line_set_data(line, 2, i.second.volume.value_or("-").c_str());
-        scols_line_set_data(line, 3, i.second.autostart.has_value()? (i.second.autostart.value()? "yes":"no") : "-");
-        const auto& cpu = i.second.cpu;
-        scols_line_set_data(line, 4, cpu.has_value()? std::to_string(cpu.value()).c_str() : "-");
-        const auto& memory = i.second.memory;
-        scols_line_set_data(line, 5, memory.has_value()? std::to_string(memory.value()).c_str() : "-");
-        const auto& ip_address = i.second.ip_address;
-        scols_line_set_data(line, 6, ip_address.value_or("-").c_str());
+        const auto& running = vm["running"];
+        scols_line_set_data(line, 0, running.is_boolean()? (running.get<bool>()? "*" : "") : "-");
+        scols_line_set_data(line, 1, vm["name"].get<std::string>().c_str());
+        scols_line_set_data(line, 2, vm["volume"].is_string()? vm["volume"].get<std::string>().c_str() : "-");
+        const auto& autostart = vm["autostart"];
+        scols_line_set_data(line, 3, autostart.is_boolean()? (autostart.get<bool>()? "yes":"no") : "-");
+        const auto& cpu = vm["cpu"];
+        scols_line_set_data(line, 4, cpu.is_number()? std::to_string(cpu.get<uint16_t>()).c_str() : "-");
+        const auto& memory = vm["memory"];
+        scols_line_set_data(line, 5, memory.is_number()? std::to_string(memory.get<uint32_t>()).c_str() : "-");
+        const auto& ip_address = vm["ip_address"];
+        scols_line_set_data(line, 6, ip_address.is_string()? ip_address.get<std::string>().c_str() : "-");
     }
     scols_print_table(table.get());
 
     return 0;
 }
 
+/**
+ * @brief Get runtime state of running VMs without spawning a process if possible
+ * @details Falls back to 'vm show' when VM runtime directory is not available.
+ * @param names VMs to probe.  all running VMs if omitted
+ */
+std::map<std::string,RuntimeState> get_runtime_states(const std::optional<std::vector<std::string>>& names/* = std::nullopt*/)
+{
+    auto states = get_runtime_states_from_run_dir(vm_run_dir(), names);
+    if (states) return *states;
+    //else
+    auto all = get_runtime_states_from_vm_show();
+    if (!names) return all;
+    //else
+    std::map<std::string,RuntimeState> selected;
+    for (const auto& name : *names) {
+        if (all.contains(name)) selected[name] = all[name];
+    }
+    return selected;
+}
+
 int create(const std::filesystem::path& vm_root, const std::string& vmname, const CreateOptions& options/* = {}*/)
 {
-    // check if vmname is RFC952/RFC1123 compliant
-    if (vmname.length() > 63) throw std::runtime_error("VM name must be 63 characters or less");
-    if (vmname[0] == '-' || vmname[vmname.length() - 1] == '-') throw std::runtime_error("VM name must not start or end with '-'");
-    if (vmname.find("--") != std::string::npos) throw std::runtime_error("VM name must not contain consecutive '-'");
-    if (vmname.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != std::string::npos)
-        throw std::runtime_error("VM name must contain only alphanumeric characters and '-'");
-    if (vmname.find_first_not_of("0123456789") == std::string::npos) throw std::runtime_error("VM name must not be all digits");
+    validate_vmname(vmname);
 
     auto vm_dir = vm_root / vmname;
     if (std::filesystem::exists(vm_dir)) {
@@ -470,12 +1278,26 @@ int create(const std::filesystem::path& vm_root, const std::string& vmname, cons
         return std::make_pair(real_vm_dir, std::make_optional(std::filesystem::path("@" + volume) / vmname));
     }(options.volume.value()) : std::make_pair(vm_dir, std::nullopt);
 
+    Resources resources;
+    if (options.memory) resources.memory = *options.memory;
+    if (options.cpu) resources.cpu = *options.cpu;
+    auto committed = get_committed_resources(vm_root, {vmname});
+    auto disk_dir = real_vm_dir.parent_path();
+    while (!std::filesystem::exists(disk_dir) && disk_dir.has_parent_path() && disk_dir != disk_dir.parent_path()) {
+        disk_dir = disk_dir.parent_path();
+    }
+    // VM is not started here.  memory overcommit is just warned
+    check_admission(committed, resources, false,
+        {{disk_dir, options.data_partition? *options.data_partition * 1024LL * 1024 * 1024/*GiB*/ : 0}},
+        options.data_preallocation != "sparse", options.force);
+    if (options.pin) std::tie(resources.cpuset, resources.numa_node) = assign_cpuset(committed, resources.cpu);
+
+    create_vm_dir(real_vm_dir);
     try {
-        auto fs_dir = real_vm_dir / "fs";
-        std::filesystem::create_directories(fs_dir);
+        std::filesystem::create_directory(real_vm_dir / "fs");
 
         if (options.system_file.has_value()) {
-            std::filesystem::copy_file(options.system_file.value(), real_vm_dir / "system");
+            clone_file(options.system_file.value(), real_vm_dir / "system");
         }
 
         auto vm_ini = real_vm_dir / "vm.ini";
@@ -483,10 +1305,13 @@ int create(const std::filesystem::path& vm_root, const std::string& vmname, cons
             std::ofstream f(vm_ini);
             if (options.memory) f << "memory=" << std::to_string(*options.memory) << std::endl;
             if (options.cpu) f << "cpu=" << std::to_string(*options.cpu) << std::endl;
+            if (!resources.cpuset.empty()) f << "cpuset=" << format_cpulist(resources.cpuset) << std::endl;
+            if (resources.numa_node) f << "numa_node=" << std::to_string(*resources.numa_node) << std::endl;
         }
 
         if (options.data_partition) {
-            create_allocated_nocow_file(real_vm_dir / "data", *options.data_partition * 1024LL * 1024 * 1024/*GiB*/);
+            create_allocated_nocow_file(real_vm_dir / "data", *options.data_partition * 1024LL * 1024 * 1024/*GiB*/,
+                options.data_preallocation);
         }
 
         if (symlink) {
@@ -494,14 +1319,51 @@ int create(const std::filesystem::path& vm_root, const std::string& vmname, cons
         }
     }
     catch (...) {
-        std::filesystem::remove_all(real_vm_dir);
+        remove_vm_dir(real_vm_dir);
+        throw;
+    }
+
+    return 0;
+}
+
+int clone(const std::filesystem::path& vm_root, const std::string& src, const std::string& dst)
+{
+    validate_vmname(dst);
+    auto volume = get_volume_name_from_vm_name(vm_root, src); // throws if src doesn't exist
+    auto dst_vm_dir = vm_root / dst;
+    if (std::filesystem::exists(std::filesystem::symlink_status(dst_vm_dir))) throw std::runtime_error(dst + " already exists");
+    //else
+    if (is_running(src)) throw std::runtime_error(src + " is running");
+
+    // clone is made next to the source so that it can share extents
+    auto real_src_vm_dir = volume? (volume::get_volume_dir(vm_root, *volume).value() / src) : vm_root / src;
+    auto real_dst_vm_dir = real_src_vm_dir.parent_path() / dst;
+    if (std::filesystem::exists(std::filesystem::symlink_status(real_dst_vm_dir))) {
+        throw std::runtime_error(real_dst_vm_dir.string() + " already exists");
+    }
+
+    create_vm_dir(real_dst_vm_dir);
+    try {
+        // reflink each file
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(real_src_vm_dir)) {
+            auto target = real_dst_vm_dir / std::filesystem::relative(entry.path(), real_src_vm_dir);
+            if (entry.is_symlink()) std::filesystem::copy_symlink(entry.path(), target);
+            else if (entry.is_directory()) std::filesystem::create_directory(target, entry.path());
+            else if (entry.is_regular_file()) clone_file(entry.path(), target);
+        }
+        if (volume) {
+            std::filesystem::create_directory_symlink(std::filesystem::path("@" + *volume) / dst, dst_vm_dir);
+        }
+    }
+    catch (...) {
+        remove_vm_dir(real_dst_vm_dir);
         throw;
     }
 
     return 0;
 }
 
-int _delete(const std::filesystem::path& vm_root, const std::string& vmname)
+int _delete(const std::filesystem::path& vm_root, const std::string& vmname, bool purge/* = false*/)
 {
     auto vm_dir = vm_root / vmname;
     if (!std::filesystem::exists(vm_dir) || !std::filesystem::is_directory(vm_dir)) {
@@ -541,6 +1403,8 @@ int _delete(const std::filesystem::path& vm_root, const std::string& vmname)
     std::filesystem::create_directories(trash_dir);
     std::filesystem::rename(real_vm_dir, trash_dir / (vmname + '.' + uuid_str));
 
+    if (purge) return volume::reclaim(trash_dir, { .background = true });
+    //else
     return 0;
 }
 
@@ -549,7 +1413,7 @@ int _delete(const std::filesystem::path& vm_root, const std::string& vmname)
 #ifdef __VSCODE_ACTIVE_FILE__
 int main(int argc, char* argv[])
 {
-    create_allocated_nocow_file("nocow.bin", 1024*1024);
+    create_allocated_nocow_file("nocow.bin", 1024*1024, "zeroed");
     //std::cout << nlohmann::json({"execute", "guest-network-get-interfaces"}) << std::endl;
     //return _main(argc, argv);
 }
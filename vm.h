@@ -1,26 +1,79 @@
 #ifndef __VM_H__
 #define __VM_H__
+#include <map>
 #include <optional>
 #include <string>
+#include <vector>
 #include <filesystem>
 
 namespace vm {
-    int start(const std::string& vmname, bool console);
+    struct StartOptions {
+        bool console = false;
+        bool force = false; // start even if host seems to lack memory or disk space for the VM
+        bool pin = false; // assign CPUs(of one NUMA node) not pinned by other VMs and save them to vm.ini
+    };
+    /**
+     * @brief Start VM after checking that host can afford it
+     * @details Memory/CPU configured in vm.ini of running and autostart VMs are summed up and compared with host's.
+     * cpuset/numa_node in vm.ini are applied as AllowedCPUs/AllowedMemoryNodes of the unit.
+     */
+    int start(const std::filesystem::path& vm_root, const std::string& vmname, const StartOptions& options = {});
     int stop(const std::string& vmname, bool force, bool console);
+
+    struct BulkOptions {
+        size_t concurrency = 4;
+        std::optional<double> rate = std::nullopt; // max VMs started per second
+        bool force = false;
+        bool pin = false;
+        uint32_t stop_timeout = 300; // seconds to wait for each VM to stop(0 for no limit)
+    };
+    /**
+     * @brief Start VMs at once
+     * @param vmnames VMs to start.  All VMs if empty
+     * @details VMs are started in descending order of 'priority' in vm.ini(0 if not specified).
+     * Admission check is done for the whole batch.  Result of each VM is printed as a table
+     * @return 0 if all VMs started or were already running
+     */
+    int start(const std::filesystem::path& vm_root, const std::vector<std::string>& vmnames, const BulkOptions& options = {});
+    /**
+     * @brief Stop VMs at once in ascending order of priority
+     * @param vmnames VMs to stop.  All VMs if empty
+     * @details VM which doesn't stop within stop_timeout is reported as failed without holding up others
+     */
+    int stop(const std::filesystem::path& vm_root, const std::vector<std::string>& vmnames, bool force, const BulkOptions& options = {});
     int restart(const std::string& vmname, bool force);
     int console(const std::string& vmname);
     int autostart(const std::string& vmname, std::optional<bool> on_off);
-    int list(const std::filesystem::path& vm_root);
+
+    struct ListOptions {
+        size_t concurrency = 8;
+        uint32_t timeout_ms = 3000; // columns not collected by this deadline are shown as '-'
+        bool json = false;
+        std::optional<uint32_t> cache_ttl = std::nullopt; // seconds to reuse result of previous call.  no cache if omitted
+    };
+    int list(const std::filesystem::path& vm_root, const ListOptions& options = {});
+
+    struct RuntimeState {
+        std::optional<uint16_t> cpus = std::nullopt;
+        std::optional<uint64_t> memory = std::nullopt; // in bytes
+        std::optional<std::filesystem::path> qga = std::nullopt; // guest agent socket
+        std::optional<std::filesystem::path> qmp = std::nullopt; // QEMU monitor socket
+    };
+    std::map<std::string,RuntimeState> get_runtime_states(const std::optional<std::vector<std::string>>& names = std::nullopt);
 
     struct CreateOptions {
         const std::optional<std::string>& volume = std::nullopt;
         std::optional<uint32_t> memory = std::nullopt;
         std::optional<uint16_t> cpu = std::nullopt;
-        std::optional<uint32_t> data_partition = std::nullopt;
+        std::optional<uint32_t> data_partition = std::nullopt; // in GiB
+        std::string data_preallocation = "fallocate"; // "sparse", "fallocate" or "zeroed"
         const std::optional<std::filesystem::path>& system_file = std::nullopt;
+        bool force = false; // create even if volume lacks space for data partition
+        bool pin = false; // assign CPUs not pinned by other VMs
     };
     int create(const std::filesystem::path& vm_root, const std::string& vmname, const CreateOptions& options = {});
-    int _delete(const std::filesystem::path& vm_root, const std::string& vmname);
+    int clone(const std::filesystem::path& vm_root, const std::string& src, const std::string& dst);
+    int _delete(const std::filesystem::path& vm_root, const std::string& vmname, bool purge = false);
 }
 
 #endif // __VM_H__
\ No newline at end of file
@@ -6,41 +6,104 @@
  * @details This file is part of the Walbrix Virtual Machine Manager.
  */
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <string.h>
 #include <sys/statvfs.h>
+#include <sys/statfs.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <linux/magic.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/btrfs.h>
 
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <functional>
 
 #include <libsmartcols/libsmartcols.h>
 #include <libmount/libmount.h>
-#include <blkid/blkid.h>
 #include <btrfsutil.h>
+#include <nlohmann/json.hpp>
 
 #include "misc.h"
+#include "blockdev.h"
+#include "workerpool.h"
+#include "trace.h"
 #include "volume.h"
 
 /**
- * @brief Get UUID of the partition
- * @param partition Path to the partition
- * @return UUID of the partition or std::nullopt if failed
+ * @brief Process-wide snapshot of /proc/self/mountinfo indexed by mount target
+ * @details The table is parsed once and parsed again only after poll(2) on mountinfo reports
+ * that mount table has changed(including mounts done by this process).
  */
-static std::optional<std::string> get_partition_uuid(const std::filesystem::path& partition)
-{
-  blkid_cache cache;
-  if (blkid_get_cache(&cache, "/dev/null") != 0) throw std::runtime_error("blkid_get_cache() failed");
-  // else
-  std::optional<std::string> rst = std::nullopt;
-  if (blkid_probe_all(cache) == 0) {
-    auto tag_value = blkid_get_tag_value(cache, "UUID", partition.c_str());
-    if (tag_value) rst = tag_value;
-  }
-  blkid_put_cache(cache);
-  return rst;
-}
+class MountTable {
+    std::mutex mutex;
+    int fd = -1;
+    std::map<std::string,std::pair<std::filesystem::path,std::string/*fstype*/>> targets;
+
+    bool changed()
+    {
+        if (fd < 0) {
+            fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+            return true;
+        }
+        //else
+        struct pollfd pollfds[1];
+        pollfds[0].fd = fd;
+        pollfds[0].events = POLLPRI;
+        return poll(pollfds, 1, 0) > 0 && (pollfds[0].revents & (POLLERR | POLLPRI));
+    }
+
+    void load()
+    {
+        trace::Scope scope("mount", "parse mountinfo");
+        std::shared_ptr<libmnt_table> tb(mnt_new_table_from_file("/proc/self/mountinfo"),mnt_unref_table);
+        if (!tb) throw std::runtime_error("Cannot open /proc/self/mountinfo");
+        std::shared_ptr<libmnt_cache> cache(mnt_new_cache(), mnt_unref_cache);
+        mnt_table_set_cache(tb.get(), cache.get());
+        std::shared_ptr<libmnt_iter> itr(mnt_new_iter(MNT_ITER_FORWARD), mnt_free_iter);
+        targets.clear();
+        libmnt_fs* fs;
+        while (mnt_table_next_fs(tb.get(), itr.get(), &fs) == 0) {
+            auto target = mnt_fs_get_target(fs);
+            if (!target) continue;
+            auto srcpath = mnt_fs_get_srcpath(fs);
+            auto fstype = mnt_fs_get_fstype(fs);
+            // later entry wins as it's mounted over earlier ones
+            targets[target] = std::make_pair(srcpath? srcpath : "", fstype? fstype : "");
+        }
+    }
+public:
+    std::optional<std::pair<std::filesystem::path,std::string/*fstype*/>> find_target(const std::filesystem::path& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (changed()) load();
+        //else
+        auto i = targets.find(path.string());
+        if (i == targets.end()) i = targets.find(std::filesystem::weakly_canonical(path).string());
+        return i != targets.end()? std::make_optional(i->second) : std::nullopt;
+    }
+
+    static MountTable& get()
+    {
+        // intentionally never freed so that it stays valid for detached worker threads at exit
+        static auto& mount_table = *new MountTable();
+        return mount_table;
+    }
+};
 
 /**
  * @brief Mount filesystem
@@ -175,81 +238,567 @@ static std::filesystem::path snapshot(const std::filesystem::path& path)
         throw std::runtime_error("Creating readonly snapshot " + head.string() + " failed(" + btrfs_util_strerror(rst) + ")");
     }
     sync();
+
+    // snapshots are not recursive.  nested subvolumes show up as empty directories in head
+    for (const auto& d : std::filesystem::directory_iterator(path)) {
+        if (d.path().filename() == ".snapshots" || !d.is_directory() || d.is_symlink()) continue;
+        if (btrfs_util_is_subvolume(d.path().c_str()) == BTRFS_UTIL_OK) {
+            std::cerr << "Warning: " << d.path() << " is a subvolume and not included in snapshot" << std::endl;
+        }
+    }
     return head;
 }
 
+static bool is_btrfs(const std::filesystem::path& path)
+{
+    struct statfs fs;
+    return statfs(path.c_str(), &fs) == 0 && fs.f_type == BTRFS_SUPER_MAGIC;
+}
+
 /**
- * @brief Backup specified btrfs mountpoint
- * @param path Path to the mountpoint
+ * @brief Wait for child process and make sure it exited successfully
  */
-static void backup(const std::filesystem::path& path)
+static void wait_for(pid_t pid, const std::string& name)
 {
-    std::filesystem::path head = snapshot(path);
-    std::cout << "Snapshot " << head << " created" << std::endl;
+    trace::Scope scope("exec", name);
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) < 0) throw std::runtime_error("waitpid() failed");
+    if (!WIFEXITED(wstatus)) throw std::runtime_error(name + " terminated");
+    if (WEXITSTATUS(wstatus) != 0) throw std::runtime_error(name + " failed");
+}
 
-    auto backup_link = path / ".backup";
-    if (!std::filesystem::is_symlink(backup_link)) return;
+/**
+ * @brief I/O throttling of backup processes
+ * @details Backup processes get the lowest best-effort I/O priority so that running VMs win.  When bandwidth is limited,
+ * they are also put into a dedicated cgroup whose io.max limits reading from the source disks.
+ */
+class IOThrottle {
+    std::optional<std::filesystem::path> cgroup;
+    std::string procs; // prepared in advance as child process must not allocate memory between fork() and exec()
+public:
+    IOThrottle(const std::string& name, const std::map<std::string,std::string/*MAJ:MIN*/>& disks, std::optional<uint64_t> bandwidth)
+    {
+        if (!bandwidth || disks.empty()) return;
+        //else
+        std::filesystem::path cgroup_root("/sys/fs/cgroup");
+        {
+            // io controller is usually enabled by systemd.  try anyway
+            std::ofstream f(cgroup_root / "cgroup.subtree_control");
+            if (f) f << "+io" << std::endl;
+        }
+        auto path = cgroup_root / ("wb-backup-" + std::to_string(getpid()) + "-" + name);
+        std::error_code ec;
+        if (!std::filesystem::create_directory(path, ec) || ec) {
+            std::cerr << "Warning: Unable to create cgroup " << path << ". Bandwidth is not limited." << std::endl;
+            return;
+        }
+        {
+            std::ofstream f(path / "io.max");
+            for (const auto& [disk, devno] : disks) {
+                f << devno << " rbps=" << *bandwidth << std::endl;
+            }
+            if (!f) {
+                std::cerr << "Warning: Unable to set io.max of " << path << ". Bandwidth is not limited." << std::endl;
+                std::filesystem::remove(path, ec);
+                return;
+            }
+        }
+        cgroup = path;
+        procs = (path / "cgroup.procs").string();
+    }
 
-    auto backup_dir = std::filesystem::weakly_canonical(backup_link);
-    if (!std::filesystem::is_directory(backup_dir)) {
-        throw std::runtime_error("Backup link " + backup_link.string() + " broken");
+    ~IOThrottle()
+    {
+        std::error_code ec;
+        if (cgroup) std::filesystem::remove(*cgroup, ec); // all processes in it have exited
     }
-    //else
 
+    /**
+     * @brief Called in child process between fork() and exec()
+     */
+    void setup_child() const
+    {
+        syscall(SYS_ioprio_set, 1/*IOPRIO_WHO_PROCESS*/, 0, (2/*IOPRIO_CLASS_BE*/ << 13) | 7);
+        if (cgroup) {
+            auto fd = open(procs.c_str(), O_WRONLY);
+            if (fd >= 0) {
+                if (write(fd, "0", 1) < 0) {} // best effort
+                close(fd);
+            }
+        }
+        signal(SIGPIPE, SIG_DFL); // parent ignores it for relaying
+    }
+};
+
+/**
+ * @brief Relay data from a pipe to another pipe
+ * @return Number of bytes relayed
+ */
+static uint64_t relay(int in, int out)
+{
+    uint64_t total = 0;
+    while (true) {
+        auto n = splice(in, NULL, out, NULL, 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // EOF or the receiver is gone(its exit status tells the failure)
+        //else
+        total += n;
+    }
+    return total;
+}
+
+static void backup_using_rdiff_backup(const std::filesystem::path& head, const std::filesystem::path& backup_dir, const IOThrottle& throttle)
+{
     std::cout << "Backing up snapshot " << head << " to " << backup_dir << " using rdiff-backup..." << std::endl;
     auto pid = fork();
     if (pid < 0) throw std::runtime_error("fork() failed");
     if (pid == 0) {
+        throttle.setup_child();
         if (execlp("rdiff-backup", "rdiff-backup", "--preserve-numerical-ids", "--print",
             "--exclude", (head / ".trash").c_str(),
             "--exclude", (head / ".snapshots").c_str(),
             head.c_str(), backup_dir.c_str(), NULL) < 0) exit(-1);
     }
-    int wstatus;
-    if (waitpid(pid, &wstatus, 0) < 0) throw std::runtime_error("waitpid() failed");
-    if (!WIFEXITED(wstatus)) throw std::runtime_error("rdiff-backup terminated");
-    if (WEXITSTATUS(wstatus) != 0) throw std::runtime_error("rdiff-backup failed");
+    wait_for(pid, "rdiff-backup");
 
     pid = fork();
     if (pid < 0) throw std::runtime_error("fork() failed");
     if (pid == 0) {
+        throttle.setup_child();
         if (execlp("rdiff-backup", "rdiff-backup",
             "--remove-older-than", "1W", "--force", backup_dir.c_str(), NULL) < 0) exit(-1);
     }
-    if (waitpid(pid, &wstatus, 0) < 0) throw std::runtime_error("waitpid() failed");
-    if (!WIFEXITED(wstatus)) throw std::runtime_error("rdiff-backup --remove-older-than terminated");
-    if (WEXITSTATUS(wstatus) != 0) throw std::runtime_error("rdiff-backup --remove-older-than failed");
+    wait_for(pid, "rdiff-backup --remove-older-than");
 }
 
 /**
- * @brief Clean trash of specified volume
- * @param vm_root Root directory of VMs
- * @param volume_name Name of the volume
- * @return true if trash is cleaned, false if no trash exists
+ * @brief Get read-only snapshots received in backup directory, keyed by UUID of their origin
+ */
+static std::map<std::string,std::pair<std::filesystem::path,struct btrfs_util_subvolume_info>> get_received_snapshots(const std::filesystem::path& backup_dir)
+{
+    static const uint8_t NULL_UUID[16] = {};
+    std::map<std::string,std::pair<std::filesystem::path,struct btrfs_util_subvolume_info>> received;
+    for (const auto& d : std::filesystem::directory_iterator(backup_dir)) {
+        if (!d.is_directory() || btrfs_util_is_subvolume(d.path().c_str()) != BTRFS_UTIL_OK) continue;
+        //else
+        struct btrfs_util_subvolume_info subvol;
+        if (btrfs_util_subvolume_info(d.path().c_str(), 0, &subvol) != BTRFS_UTIL_OK) continue;
+        if (memcmp(subvol.received_uuid, NULL_UUID, sizeof(NULL_UUID)) == 0) continue; // not a received one
+        //else
+        received[std::string((const char*)subvol.received_uuid, sizeof(subvol.received_uuid))] = std::make_pair(d.path(), subvol);
+    }
+    return received;
+}
+
+/**
+ * @brief Backup snapshot by streaming it to btrfs receive
+ * @details Only the difference from the newest snapshot which the backup directory already has is sent.
+ * Received snapshot is named after creation time of the source snapshot and ones older than a week are removed
+ * except the newest(it's needed as the parent of next incremental send).
+ * @return Size of the stream sent
+ */
+static uint64_t backup_using_btrfs_send(const std::filesystem::path& path, const std::filesystem::path& head, const std::filesystem::path& backup_dir,
+    const IOThrottle& throttle)
+{
+    auto received = get_received_snapshots(backup_dir);
+
+    std::optional<std::pair<std::filesystem::path,struct btrfs_util_subvolume_info>> parent;
+    for (const auto& d : std::filesystem::directory_iterator(path / ".snapshots")) {
+        if (d.path() == head || btrfs_util_is_subvolume(d.path().c_str()) != BTRFS_UTIL_OK) continue;
+        //else
+        struct btrfs_util_subvolume_info subvol;
+        if (btrfs_util_subvolume_info(d.path().c_str(), 0, &subvol) != BTRFS_UTIL_OK) continue;
+        if (!received.contains(std::string((const char*)subvol.uuid, sizeof(subvol.uuid)))) continue;
+        if (parent && parent->second.otime.tv_sec >= subvol.otime.tv_sec) continue;
+        //else
+        parent = std::make_pair(d.path(), subvol);
+    }
+
+    struct btrfs_util_subvolume_info head_subvol;
+    auto rst = btrfs_util_subvolume_info(head.c_str(), 0, &head_subvol);
+    if (rst != BTRFS_UTIL_OK) {
+        throw std::runtime_error("Inspecting subvolume " + head.string() + " failed(" + btrfs_util_strerror(rst) + ")");
+    }
+    char name[32];
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", localtime(&head_subvol.otime.tv_sec));
+    auto received_head = backup_dir / head.filename();
+    auto received_snapshot = backup_dir / name;
+    if (std::filesystem::exists(received_snapshot)) throw std::runtime_error(received_snapshot.string() + " already exists");
+    if (btrfs_util_is_subvolume(received_head.c_str()) == BTRFS_UTIL_OK) {
+        // leftover of interrupted receive
+        btrfs_util_delete_subvolume(received_head.c_str(), BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE);
+    }
+
+    if (parent) {
+        std::cout << "Sending difference between " << parent->first << " and " << head << " to " << backup_dir << "..." << std::endl;
+    } else {
+        std::cout << "Sending whole snapshot " << head << " to " << backup_dir << "..." << std::endl;
+    }
+    // the stream is relayed through this process to measure it
+    int send_fd[2], receive_fd[2];
+    if (pipe2(send_fd, O_CLOEXEC) < 0) throw std::runtime_error("pipe2() failed");
+    if (pipe2(receive_fd, O_CLOEXEC) < 0) {
+        close(send_fd[0]);
+        close(send_fd[1]);
+        throw std::runtime_error("pipe2() failed");
+    }
+    auto send_pid = fork();
+    if (send_pid < 0) {
+        for (auto fd : {send_fd[0], send_fd[1], receive_fd[0], receive_fd[1]}) close(fd);
+        throw std::runtime_error("fork() failed");
+    }
+    if (send_pid == 0) {
+        throttle.setup_child();
+        dup2(send_fd[1], STDOUT_FILENO);
+        if (parent) {
+            _exit(execlp("btrfs", "btrfs", "send", "-p", parent->first.c_str(), head.c_str(), NULL));
+        }
+        //else
+        _exit(execlp("btrfs", "btrfs", "send", head.c_str(), NULL));
+    }
+    close(send_fd[1]);
+    auto receive_pid = fork();
+    if (receive_pid < 0) {
+        for (auto fd : {send_fd[0], receive_fd[0], receive_fd[1]}) close(fd);
+        waitpid(send_pid, NULL, 0); // exits by SIGPIPE as the read end is closed
+        throw std::runtime_error("fork() failed");
+    }
+    if (receive_pid == 0) {
+        throttle.setup_child();
+        dup2(receive_fd[0], STDIN_FILENO);
+        _exit(execlp("btrfs", "btrfs", "receive", backup_dir.c_str(), NULL));
+    }
+    close(receive_fd[0]);
+    auto bytes = relay(send_fd[0], receive_fd[1]);
+    close(send_fd[0]);
+    close(receive_fd[1]);
+    // both children are reaped even if one of them failed.  the first failure is reported
+    std::optional<std::runtime_error> error;
+    for (const auto& [pid, name] : {std::make_pair(send_pid, "btrfs send"), std::make_pair(receive_pid, "btrfs receive")}) {
+        try {
+            wait_for(pid, name);
+        }
+        catch (const std::runtime_error& e) {
+            if (!error) error = e;
+        }
+    }
+    if (error) throw *error;
+
+    std::filesystem::rename(received_head, received_snapshot);
+    std::cout << "Snapshot " << head << " received as " << received_snapshot << std::endl;
+
+    // remove old ones
+    auto expire = time(NULL) - 7 * 24 * 60 * 60;
+    for (const auto& [uuid, snapshot] : get_received_snapshots(backup_dir)) {
+        if (snapshot.first == received_snapshot || snapshot.second.otime.tv_sec >= expire) continue;
+        //else
+        if (btrfs_util_delete_subvolume(snapshot.first.c_str(), 0) == BTRFS_UTIL_OK) {
+            std::cout << "Old backup " << snapshot.first << " deleted" << std::endl;
+        }
+    }
+    return bytes;
+}
+
+/**
+ * @brief Backup specified btrfs mountpoint
+ * @param path Path to the mountpoint
+ * @param method "send" to use btrfs send/receive, "rdiff-backup" or "auto" to choose by filesystem of backup directory
+ * @return Method actually used("snapshot" if the volume has no backup target) and size of data sent if known
+ */
+static std::pair<std::string,std::optional<uint64_t>> backup(const std::filesystem::path& path, const std::string& method, const IOThrottle& throttle)
+{
+    std::filesystem::path head = snapshot(path);
+    std::cout << "Snapshot " << head << " created" << std::endl;
+
+    auto backup_link = path / ".backup";
+    if (!std::filesystem::is_symlink(backup_link)) return {"snapshot", std::nullopt};
+
+    auto backup_dir = std::filesystem::weakly_canonical(backup_link);
+    if (!std::filesystem::is_directory(backup_dir)) {
+        throw std::runtime_error("Backup link " + backup_link.string() + " broken");
+    }
+    //else
+
+    if (method == "send" || (method == "auto" && is_btrfs(backup_dir))) {
+        if (!is_btrfs(backup_dir)) throw std::runtime_error(backup_dir.string() + " is not on btrfs");
+        return {"send", backup_using_btrfs_send(path, head, backup_dir, throttle)};
+    }
+    //else
+    backup_using_rdiff_backup(head, backup_dir, throttle);
+    return {"rdiff-backup", std::nullopt};
+}
+
+/**
+ * @brief Limits the amount of work per second by sleeping
+ */
+class RateLimiter {
+    std::optional<uint64_t> rate;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t total = 0;
+public:
+    RateLimiter(std::optional<uint64_t> _rate) : rate(_rate) {}
+    void consume(uint64_t amount)
+    {
+        total += amount;
+        if (rate && *rate > 0) std::this_thread::sleep_until(start + std::chrono::microseconds(total * 1000000 / *rate));
+    }
+};
+
+/**
+ * @brief Free a file progressively by truncating it from the end
+ * @details Freeing all extents of a large image in one transaction stalls btrfs commit for long.
+ */
+static void reclaim_file(const std::filesystem::path& path, RateLimiter& limiter)
+{
+    const uint64_t step = 256 * 1024 * 1024;
+    auto fd = open(path.c_str(), O_WRONLY | O_NOFOLLOW);
+    if (fd >= 0) {
+        struct stat st;
+        // truncating a file hard-linked from elsewhere would zero the other link too.  such ones are just unlinked
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1) {
+            uint64_t size = st.st_size;
+            while (size > step) {
+                size -= step;
+                if (ftruncate(fd, size) < 0) break;
+                limiter.consume(step);
+            }
+            limiter.consume(size);
+        }
+        close(fd);
+    }
+    if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+        throw std::runtime_error("Unable to delete " + path.string() + ": " + strerror(errno));
+    }
+}
+
+/**
+ * @brief Delete a trash entry
+ * @details Subvolumes are deleted as such(btrfs frees their extents in the background cleaner).
+ * Other directories are walked and their files are freed by reclaim_file().
+ */
+static void reclaim(const std::filesystem::path& path, RateLimiter& limiter)
+{
+    if (btrfs_util_is_subvolume(path.c_str()) == BTRFS_UTIL_OK) {
+        auto err = btrfs_util_delete_subvolume(path.c_str(), BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE);
+        if (err != BTRFS_UTIL_OK) throw std::runtime_error("Unable to delete subvolume " + path.string() + ": " + btrfs_util_strerror(err));
+        //else
+        limiter.consume(0);
+        return;
+    }
+    //else
+    auto status = std::filesystem::symlink_status(path);
+    if (std::filesystem::is_directory(status)) {
+        for (const auto& d : std::filesystem::directory_iterator(path)) {
+            reclaim(d.path(), limiter);
+        }
+        std::filesystem::remove(path);
+    } else if (std::filesystem::is_regular_file(status)) {
+        reclaim_file(path, limiter);
+    } else {
+        std::filesystem::remove(path);
+    }
+}
+
+/**
+ * @brief Delete all entries in a trash directory
+ * @return false if the trash is being cleaned by another process
  */
-static bool clean(const std::filesystem::path& vm_root, const std::string& volume_name)
+static bool reclaim_trash(const std::filesystem::path& trash_dir, std::optional<uint64_t> bandwidth)
 {
-    auto volume_dir = volume::get_volume_dir(vm_root, volume_name);
-    if (!volume_dir) throw std::runtime_error("No such volume: " + volume_name);
+    auto fd = open(trash_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return true; // no trash
     //else
-    return std::filesystem::remove_all(*volume_dir / ".trash") > 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        close(fd);
+        return false;
+    }
+    RateLimiter limiter(bandwidth);
+    try {
+        for (const auto& d : std::filesystem::directory_iterator(trash_dir)) {
+            reclaim(d.path(), limiter);
+            std::cout << d.path().filename().string() << " deleted" << std::endl;
+        }
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd); // this releases flock
+    return true;
+}
+
+/**
+ * @brief Reclaim trash directories
+ * @param background Detach from the terminal and reclaim in a child process
+ */
+static int reclaim_trashes(const std::vector<std::filesystem::path>& trash_dirs, const volume::CleanOptions& options)
+{
+    if (options.background) {
+        auto pid = fork();
+        if (pid < 0) throw std::runtime_error("fork() failed");
+        if (pid > 0) {
+            std::cout << "Cleaning trash in background(pid=" << pid << ")" << std::endl;
+            return 0;
+        }
+        //else
+        setsid();
+        auto null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+    }
+    syscall(SYS_ioprio_set, 1/*IOPRIO_WHO_PROCESS*/, 0, 3/*IOPRIO_CLASS_IDLE*/ << 13);
+
+    bool all_success = true;
+    for (const auto& trash_dir : trash_dirs) {
+        try {
+            if (!reclaim_trash(trash_dir, options.bandwidth)) {
+                std::cerr << trash_dir << " is being cleaned by another process" << std::endl;
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            all_success = false;
+        }
+    }
+    if (options.background) _exit(all_success? 0 : 1);
+    //else
+    return all_success? 0 : 1;
 }
 
-static void optimize(const std::filesystem::path& path)
+/**
+ * @brief Fragmentation of a file measured with FIEMAP
+ */
+struct Fragmentation {
+    uint64_t size = 0;
+    uint64_t extents = 0;
+    uint64_t shared = 0; // bytes shared with snapshots or reflinked copies
+
+    double extents_per_gib() const { return size > 0? extents * (1024.0 * 1024 * 1024) / size : 0.0; }
+};
+
+static Fragmentation measure_fragmentation(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) throw std::runtime_error("fstat() failed");
+    Fragmentation frag = { .size = (uint64_t)st.st_size };
+
+    const size_t count = 512;
+    std::vector<uint8_t> buf(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * count);
+    auto fm = (struct fiemap*)buf.data();
+    uint64_t start = 0;
+    while (start < frag.size) {
+        memset(buf.data(), 0, buf.size());
+        fm->fm_start = start;
+        fm->fm_length = frag.size - start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = count;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0) throw std::runtime_error("FS_IOC_FIEMAP failed: " + std::string(strerror(errno)));
+        if (fm->fm_mapped_extents == 0) break;
+        //else
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const auto& extent = fm->fm_extents[i];
+            frag.extents++;
+            if (extent.fe_flags & FIEMAP_EXTENT_SHARED) frag.shared += extent.fe_length;
+            start = extent.fe_logical + extent.fe_length;
+            if (extent.fe_flags & FIEMAP_EXTENT_LAST) return frag;
+        }
+    }
+    return frag;
+}
+
+/**
+ * @brief Defragment a file range by range
+ * @param bandwidth Bytes per second to rewrite at most
+ */
+static void defragment(int fd, uint64_t size, std::optional<uint64_t> bandwidth, std::function<void(uint64_t)> progress)
+{
+    const uint64_t chunk_size = 64 * 1024 * 1024;
+    for (uint64_t start = 0; start < size; start += chunk_size) {
+        auto chunk_start = std::chrono::steady_clock::now();
+        struct btrfs_ioctl_defrag_range_args args;
+        memset(&args, 0, sizeof(args));
+        args.start = start;
+        args.len = std::min(chunk_size, size - start);
+        args.flags = BTRFS_DEFRAG_RANGE_START_IO; // flush each range so that throttling reflects actual writes
+        args.extent_thresh = 32 * 1024 * 1024;
+        if (ioctl(fd, BTRFS_IOC_DEFRAG_RANGE, &args) < 0) {
+            throw std::runtime_error("BTRFS_IOC_DEFRAG_RANGE failed: " + std::string(strerror(errno)));
+        }
+        progress(start + args.len);
+        if (bandwidth) {
+            std::this_thread::sleep_until(chunk_start + std::chrono::microseconds(args.len * 1000000 / *bandwidth));
+        }
+    }
+}
+
+/**
+ * @brief Defragment fragmented VM images on specified btrfs mountpoint
+ * @details Only system/data images of VMs are examined(.snapshots and .trash are skipped).  A file is defragmented
+ * only when its extents per GiB exceed the threshold and it shares no extent with snapshots unless allowed, since
+ * defragmentation unshares extents and consumes as much space as the file.
+ */
+static void optimize(const std::filesystem::path& path, const volume::OptimizeOptions& options)
 {
     if (btrfs_util_is_subvolume(path.c_str()) != BTRFS_UTIL_OK) {
         throw std::runtime_error(path.string() + " is offline or not a btrfs volume");
     }
     //else
-    auto pid = fork();
-    if (pid < 0) throw std::runtime_error("fork() failed");
-    if (pid == 0) {
-        if (execlp("btrfs", "btrfs", "filesystem", "defrag", "-r", path.c_str(), NULL) < 0) exit(-1);
+    // defragmentation is a background job.  let every other I/O go first
+    syscall(SYS_ioprio_set, 1/*IOPRIO_WHO_PROCESS*/, 0, 3/*IOPRIO_CLASS_IDLE*/ << 13);
+
+    std::vector<std::filesystem::path> files;
+    for (const auto& d : std::filesystem::directory_iterator(path)) {
+        if (d.path().filename().string()[0] == '.' || !d.is_directory() || d.is_symlink()) continue;
+        //else
+        for (const auto& name : {"system", "data"}) {
+            auto file = d.path() / name;
+            if (std::filesystem::is_regular_file(std::filesystem::symlink_status(file))) files.push_back(file);
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    bool tty = isatty(STDOUT_FILENO);
+    for (const auto& file : files) {
+        auto relpath = std::filesystem::relative(file, path).string();
+        auto fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << relpath << ": " << strerror(errno) << std::endl;
+            continue;
+        }
+        try {
+            auto frag = measure_fragmentation(fd);
+            char ratio[32];
+            sprintf(ratio, "%.1f", frag.extents_per_gib());
+            std::cout << relpath << ": " << human_readable(frag.size) << ", " << frag.extents << " extents(" << ratio << "/GiB)";
+            if (frag.extents_per_gib() <= options.threshold) {
+                std::cout << ", skipped" << std::endl;
+            } else if (frag.shared > 0 && !options.unshare) {
+                std::cout << ", skipped as " << human_readable(frag.shared) << " is shared with snapshots" << std::endl;
+            } else if (options.dry_run) {
+                std::cout << ", would be defragmented" << std::endl;
+            } else {
+                std::cout << std::endl;
+                auto start = std::chrono::steady_clock::now();
+                defragment(fd, frag.size, options.bandwidth, [&](uint64_t done) {
+                    if (!tty) return;
+                    std::cout << "\r  " << (done * 100 / frag.size) << "% (" << human_readable(done) << "/" << human_readable(frag.size) << ")" << std::flush;
+                });
+                if (tty) std::cout << std::endl;
+                auto after = measure_fragmentation(fd);
+                auto duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                char seconds[32];
+                sprintf(seconds, "%.1f", duration);
+                std::cout << "  " << frag.extents << " -> " << after.extents << " extents in " << seconds << "s" << std::endl;
+            }
+        }
+        catch (const std::runtime_error& e) {
+            std::cerr << relpath << ": " << e.what() << std::endl;
+        }
+        close(fd);
     }
-    int wstatus;
-    if (waitpid(pid, &wstatus, 0) < 0) throw std::runtime_error("waitpid() failed");
-    if (!WIFEXITED(wstatus)) throw std::runtime_error("btrfs filesystem defragment terminated");
-    if (WEXITSTATUS(wstatus) != 0) throw std::runtime_error("btrfs filesystem defragment failed");
 }
 
 namespace volume {
@@ -258,13 +807,7 @@ std::optional<std::pair<std::filesystem::path,std::string/*fstype*/>> get_source
 {
     if (!std::filesystem::exists(path) || !std::filesystem::is_directory(path)) return std::nullopt;
     // else
-    std::shared_ptr<libmnt_table> tb(mnt_new_table_from_file("/proc/self/mountinfo"),mnt_unref_table);
-    if (!tb) throw std::runtime_error("Cannot open /proc/self/mountinfo");
-    std::shared_ptr<libmnt_cache> cache(mnt_new_cache(), mnt_unref_cache);
-    mnt_table_set_cache(tb.get(), cache.get());
-
-    libmnt_fs* fs = mnt_table_find_target(tb.get(), path.c_str(), MNT_ITER_BACKWARD);
-    return fs? std::optional(std::make_pair(mnt_fs_get_srcpath(fs), mnt_fs_get_fstype(fs))) : std::nullopt;
+    return MountTable::get().find_target(path);
 }
 
 std::optional<std::filesystem::path> get_volume_dir(const std::filesystem::path& vm_root, const std::string& volume_name)
@@ -282,7 +825,7 @@ int add(const std::filesystem::path& vm_root, const std::string& name, const std
     if (!std::filesystem::exists(device) || !std::filesystem::is_block_file(device)) {
         throw std::runtime_error(device.string() + " does not exist(or is not a block device)");
     }
-    auto uuid = get_partition_uuid(device).value_or("");
+    auto uuid = blockdev::get_partition_uuid(device).value_or("");
     if (uuid == "") throw std::runtime_error(device.string() + " has no UUID(not formatted?)");
 
     auto volume_path = vm_root / ("@" + name);
@@ -341,8 +884,14 @@ int remove(const std::filesystem::path& vm_root, const std::string& name)
     return 0;
 }
 
-int scan(const std::filesystem::path& vm_root)
+int scan(const std::filesystem::path& vm_root, const ScanOptions& options/* = {}*/)
 {
+    struct Target {
+        std::string name;
+        std::filesystem::path path;
+        std::string uuid;
+    };
+    std::vector<Target> targets;
     for (const auto& dir : std::filesystem::directory_iterator(vm_root)) {
         if (!dir.is_directory()) continue;
         const auto& path = dir.path();
@@ -362,19 +911,102 @@ int scan(const std::filesystem::path& vm_root)
             if (!f) continue;
             f >> uuid;
         }
+        targets.push_back({name, path, uuid});
+    }
 
-        if (mount(std::string("UUID=") + uuid, path) == 0) {
-            std::cout << "Volume " + name + "(UUID=" + uuid + ") mounted on " + path.string() << std::endl;
-        } else {
-            std::cerr << "Volume " + name + "(UUID=" + uuid + ") couldn't be mounted." << std::endl;
-        }
+    // resolve devices in one pass so that libmount doesn't have to do it for each mount
+    std::set<std::string> uuids;
+    for (const auto& target : targets) {
+        uuids.insert(target.uuid);
+    }
+    auto devices = blockdev::resolve_uuids(uuids);
+
+    // mount volumes in parallel.  spin-up and fsck of each disk doesn't wait for others
+    std::mutex output_mutex;
+    WorkerPool pool(options.concurrency);
+    for (const auto& target : targets) {
+        pool.post([&output_mutex,&devices,target]() {
+            auto volume = "Volume " + target.name + "(UUID=" + target.uuid + ")";
+            auto device = devices.find(target.uuid);
+            if (device == devices.end()) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << volume << " couldn't be mounted. Device not found." << std::endl;
+                return;
+            }
+            //else
+            auto start = std::chrono::steady_clock::now();
+            int rst = -1;
+            try {
+                rst = mount(device->second.string(), target.path);
+            }
+            catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << e.what() << std::endl;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            char elapsed_str[32];
+            sprintf(elapsed_str, "%.2fs", elapsed.count());
+            std::lock_guard<std::mutex> lock(output_mutex);
+            if (rst == 0) {
+                std::cout << volume << " mounted on " << target.path.string() << " (" << elapsed_str << ")" << std::endl;
+            } else {
+                std::cerr << volume << " couldn't be mounted. (" << elapsed_str << ")" << std::endl;
+            }
+        });
     }
+    pool.wait();
     return 0;
 }
 
 int list(const std::filesystem::path& vm_root, const ListOptions& options/* = {}*/)
 {
-    auto volumes = get_volume_list(vm_root);
+    std::map<std::string,Volume> volumes;
+    std::optional<std::string> cache_key;
+    std::optional<std::string> cached;
+    if (options.cache_ttl) {
+        cache_key = state_cache_key(vm_root);
+        cached = load_state_cache("volume-list", *cache_key, std::chrono::seconds(*options.cache_ttl));
+    }
+    auto json = cached? nlohmann::json::parse(*cached, nullptr, false) : nlohmann::json();
+    if (json.is_array()) {
+        for (const auto& v : json) {
+            volumes[v["name"]] = {
+                .name = v["name"],
+                .online = v["online"],
+                .path = v["path"].get<std::string>(),
+                .device_or_uuid = v["device_or_uuid"],
+                .fstype = v["fstype"].is_string()? std::make_optional(v["fstype"].get<std::string>()) : std::nullopt,
+                .size = v["size"].is_number()? std::make_optional(v["size"].get<uint64_t>()) : std::nullopt,
+                .free = v["free"].is_number()? std::make_optional(v["free"].get<uint64_t>()) : std::nullopt
+            };
+        }
+    } else {
+        volumes = get_volume_list(vm_root);
+        auto optional = [](const auto& value) { return value? nlohmann::json(*value) : nlohmann::json(nullptr); };
+        json = nlohmann::json::array();
+        for (const auto& [name, volume] : volumes) {
+            json.push_back({
+                {"name", volume.name},
+                {"online", volume.online},
+                {"path", volume.path.string()},
+                {"device_or_uuid", volume.device_or_uuid},
+                {"fstype", optional(volume.fstype)},
+                {"size", optional(volume.size)},
+                {"free", optional(volume.free)}
+            });
+        }
+        if (cache_key) save_state_cache("volume-list", *cache_key, json.dump());
+    }
+
+    if (options.json) {
+        nlohmann::json filtered = nlohmann::json::array();
+        for (const auto& v : json) {
+            if (!options.online_only || v["online"].get<bool>()) filtered.push_back(v);
+        }
+        std::cout << filtered << std::endl;
+        return 0;
+    }
+    //else
     if (options.names_only) {
         for (const auto& volume : volumes) {
             if (options.online_only && !volume.second.online) continue;
@@ -431,61 +1063,200 @@ int snapshot(const std::filesystem::path& vm_root, const std::string& volume_nam
     return 0;
 }
 
-int backup(const std::filesystem::path& vm_root)
+int backup(const std::filesystem::path& vm_root, const BackupOptions& options/* = {}*/)
 {
+    if (options.method != "auto" && options.method != "send" && options.method != "rdiff-backup") {
+        throw std::runtime_error("Unknown backup method: " + options.method);
+    }
     auto volumes = get_volume_list(vm_root);
-    bool all_success = true;
+
+    // volumes sharing any disk are backed up one after another.  disjoint sets of disks in parallel
+    std::vector<std::pair<Volume,std::map<std::string,std::string/*MAJ:MIN*/>>> online_volumes;
+    std::map<std::string,std::string> disk_parent; // union-find over disk names
+    std::function<std::string(const std::string&)> find_root = [&disk_parent,&find_root](const std::string& disk) {
+        auto& parent = disk_parent[disk];
+        if (parent.empty() || parent == disk) return parent = disk;
+        //else
+        return parent = find_root(parent);
+    };
     for (const auto& volume : volumes) {
         if (!volume.second.online) continue; // volume not mounted
-        try {
-            ::backup(volume.second.path);
+        //else
+        auto disks = blockdev::get_underlying_disks(volume.second.device_or_uuid);
+        if (disks.empty()) disks[volume.second.device_or_uuid] = ""; // unknown disk.  treat as independent
+        auto first = find_root(disks.begin()->first);
+        for (const auto& disk : disks) {
+            disk_parent[find_root(disk.first)] = first;
         }
-        catch (const std::runtime_error& e) {
-            std::cerr << e.what() << std::endl;
-            all_success = false;
+        online_volumes.emplace_back(volume.second, disks);
+    }
+    struct Group {
+        std::map<std::string,std::string/*MAJ:MIN*/> disks;
+        std::vector<Volume> volumes;
+    };
+    std::map<std::string/*root disk*/,Group> merged_groups;
+    for (const auto& [volume, disks] : online_volumes) {
+        auto& group = merged_groups[find_root(disks.begin()->first)];
+        for (const auto& [disk, devno] : disks) {
+            if (!devno.empty()) group.disks[disk] = devno;
+        }
+        group.volumes.push_back(volume);
+    }
+    std::map<std::string/*comma-joined disk names*/,Group> groups;
+    for (auto& [root, group] : merged_groups) {
+        std::string key;
+        for (const auto& disk : group.disks) {
+            key += (key.empty()? "" : ",") + disk.first;
         }
+        if (key.empty()) key = root;
+        groups[key] = std::move(group);
+    }
+
+    struct Result {
+        std::string disk;
+        std::string method = "-";
+        std::optional<uint64_t> bytes = std::nullopt;
+        double duration = 0.0;
+        bool success = false;
+    };
+    std::map<std::string,Result> results;
+    std::mutex results_mutex;
+
+    auto old_sigpipe = signal(SIGPIPE, SIG_IGN); // receiver of relayed stream may die
+    std::shared_ptr<void> sigpipe_guard(nullptr, [old_sigpipe](auto){ signal(SIGPIPE, old_sigpipe); });
+    WorkerPool pool(options.concurrency);
+    int group_no = 0;
+    for (const auto& [key, group] : groups) {
+        pool.post([&options,&results,&results_mutex,key,group,group_no]() {
+            std::optional<IOThrottle> throttle;
+            try {
+                throttle.emplace(std::to_string(group_no), group.disks, options.bandwidth);
+            }
+            catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl; // volumes of this group are reported as failed below
+            }
+            for (const auto& volume : group.volumes) {
+                Result result = { .disk = key };
+                auto start = std::chrono::steady_clock::now();
+                try {
+                    if (throttle) {
+                        std::tie(result.method, result.bytes) = ::backup(volume.path, options.method, *throttle);
+                        result.success = true;
+                    }
+                }
+                catch (const std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                }
+                result.duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::lock_guard<std::mutex> lock(results_mutex);
+                results[volume.name] = result;
+            }
+        });
+        group_no++;
     }
+    pool.wait();
+
+    std::shared_ptr<libscols_table> table(scols_new_table(), scols_unref_table);
+    if (!table) throw std::runtime_error("scols_new_table() failed");
+    scols_table_new_column(table.get(), "VOLUME", 0.1, 0);
+    scols_table_new_column(table.get(), "DISK", 0.1, 0);
+    scols_table_new_column(table.get(), "METHOD", 0.1, 0);
+    scols_table_new_column(table.get(), "SENT", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "DURATION", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "THROUGHPUT", 0.1, SCOLS_FL_RIGHT);
+    scols_table_new_column(table.get(), "RESULT", 0.1, 0);
+    auto sep = scols_table_new_line(table.get(), NULL);
+    scols_line_set_data(sep, 0, "--------");
+    scols_line_set_data(sep, 1, "--------");
+    scols_line_set_data(sep, 2, "------------");
+    scols_line_set_data(sep, 3, "-------");
+    scols_line_set_data(sep, 4, "--------");
+    scols_line_set_data(sep, 5, "----------");
+    scols_line_set_data(sep, 6, "------");
+
+    bool all_success = true;
+    for (const auto& [name, result] : results) {
+        if (!result.success) all_success = false;
+        auto line = scols_table_new_line(table.get(), NULL);
+        if (!line) throw std::runtime_error("scols_table_new_line() failed");
+        //else
+        char duration[32];
+        sprintf(duration, "%.1fs", result.duration);
+        scols_line_set_data(line, 0, name.c_str());
+        scols_line_set_data(line, 1, result.disk.c_str());
+        scols_line_set_data(line, 2, result.method.c_str());
+        scols_line_set_data(line, 3, result.bytes? human_readable(*result.bytes).c_str() : "-");
+        scols_line_set_data(line, 4, duration);
+        scols_line_set_data(line, 5, result.bytes && result.duration > 0.0?
+            (human_readable(*result.bytes / result.duration) + "/s").c_str() : "-");
+        scols_line_set_data(line, 6, result.success? "OK" : "FAILED");
+    }
+    scols_print_table(table.get());
 
     return all_success? 0 : 1;
 }
 
-int clean(const std::filesystem::path& vm_root, const std::optional<std::string>& volume_name)
+int clean(const std::filesystem::path& vm_root, const std::optional<std::string>& volume_name, const CleanOptions& options/* = {}*/)
 {
+    std::vector<std::filesystem::path> trash_dirs;
     if (volume_name) {
-        ::clean(vm_root, *volume_name);
-        return 0;
-    }
-    // else 
-    auto volumes = get_volume_list(vm_root);
-    bool all_success = true;
-    for (const auto& volume : volumes) {
-        if (!volume.second.online) continue; // volume not mounted
-        try {
-            ::clean(vm_root, volume.first);
-        }
-        catch (const std::runtime_error& e) {
-            std::cerr << e.what() << std::endl;
-            all_success = false;
+        auto volume_dir = get_volume_dir(vm_root, *volume_name);
+        if (!volume_dir) throw std::runtime_error("No such volume: " + *volume_name);
+        //else
+        trash_dirs.push_back(*volume_dir / ".trash");
+    } else {
+        for (const auto& volume : get_volume_list(vm_root)) {
+            if (!volume.second.online) continue; // volume not mounted
+            //else
+            trash_dirs.push_back(volume.second.path / ".trash");
         }
     }
-    return all_success? 0 : 1;
+    return reclaim_trashes(trash_dirs, options);
 }
 
-int optimize(const std::filesystem::path& vm_root, const std::string& volume_name)
+int reclaim(const std::filesystem::path& trash_dir, const CleanOptions& options/* = {}*/)
+{
+    return reclaim_trashes({trash_dir}, options);
+}
+
+int optimize(const std::filesystem::path& vm_root, const std::string& volume_name, const OptimizeOptions& options/* = {}*/)
 {
     auto volume = get_volume(vm_root, volume_name);
     if (!volume) {
         std::cerr << "Volume " + volume_name + " does not exist" << std::endl;
         return 1;
     }
-    ::optimize(volume->path);
+    ::optimize(volume->path, options);
     return 0;
 }
 
 } // namespace volume
 
 #ifdef __VSCODE_ACTIVE_FILE__
+#include "vm.h"
+// usage: volume.bin <vm_root> <volume>  (volume must be online btrfs)
 int main(int argc, char* argv[])
 {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " vm_root volume" << std::endl;
+        return 1;
+    }
+    std::filesystem::path vm_root(argv[1]);
+    std::string volume_name(argv[2]);
+    auto vmname = "snapshot-test-" + std::to_string(getpid());
+
+    // VM created by vm::create must be backed up with its files
+    vm::create(vm_root, vmname, {.volume = volume_name});
+    std::shared_ptr<void> vm_guard(nullptr, [&](auto) { vm::_delete(vm_root, vmname, true); });
+    if (volume::snapshot(vm_root, volume_name) != 0) return 1;
+    //else
+    auto head = volume::get_volume_dir(vm_root, volume_name).value() / ".snapshots/head";
+    auto vm_ini = head / vmname / "vm.ini";
+    if (!std::filesystem::exists(vm_ini)) {
+        std::cerr << "FAIL: " << vm_ini << " doesn't exist in snapshot" << std::endl;
+        return 1;
+    }
+    std::cout << "OK: " << vm_ini << std::endl;
+    return 0;
 }
 #endif
\ No newline at end of file
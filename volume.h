@@ -1,6 +1,7 @@
 #ifndef __VOLUME_H__
 #define __VOLUME_H__
 
+#include <string>
 #include <optional>
 #include <filesystem>
 
@@ -10,17 +11,42 @@ namespace volume {
 
     int add(const std::filesystem::path& vm_root, const std::string& name, const std::filesystem::path& device);
     int remove(const std::filesystem::path& vm_root, const std::string& name);
-    int scan(const std::filesystem::path& vm_root);
+
+    struct ScanOptions {
+        size_t concurrency = 4;
+    };
+    int scan(const std::filesystem::path& vm_root, const ScanOptions& options = {});
 
     struct ListOptions {
         bool online_only = false;
         bool names_only = false;
+        bool json = false;
+        std::optional<uint32_t> cache_ttl = std::nullopt; // seconds to reuse result of previous call.  no cache if omitted
     };
     int list(const std::filesystem::path& vm_root, const ListOptions& options = {});
     int snapshot(const std::filesystem::path& vm_root, const std::string& volume_name);
-    int backup(const std::filesystem::path& vm_root);
-    int clean(const std::filesystem::path& vm_root, const std::optional<std::string>& volume_name);
-    int optimize(const std::filesystem::path& vm_root, const std::string& volume_name);
+
+    struct BackupOptions {
+        std::string method = "auto"; // "auto", "send" or "rdiff-backup"
+        size_t concurrency = 4; // number of disks processed at once
+        std::optional<uint64_t> bandwidth = std::nullopt; // limit of reading from each source disk in bytes/sec
+    };
+    int backup(const std::filesystem::path& vm_root, const BackupOptions& options = {});
+
+    struct CleanOptions {
+        std::optional<uint64_t> bandwidth = 1024ULL * 1024 * 1024; // bytes freed per second(nullopt for unlimited)
+        bool background = false;
+    };
+    int clean(const std::filesystem::path& vm_root, const std::optional<std::string>& volume_name, const CleanOptions& options = {});
+    int reclaim(const std::filesystem::path& trash_dir, const CleanOptions& options = {});
+
+    struct OptimizeOptions {
+        double threshold = 64.0; // extents per GiB above which a file is defragmented
+        std::optional<uint64_t> bandwidth = std::nullopt; // limit of rewriting in bytes/sec
+        bool unshare = false; // defragment files sharing extents with snapshots too
+        bool dry_run = false;
+    };
+    int optimize(const std::filesystem::path& vm_root, const std::string& volume_name, const OptimizeOptions& options = {});
 }
 
 #endif
@@ -1,14 +1,21 @@
 #include <pwd.h>
 #include <unistd.h>
 
+#include <span>
+#include <limits>
+#include <algorithm>
+
 #include <argparse/argparse.hpp>
 
 #include "vm.h"
 #include "volume.h"
 #include "install.h"
+#include "image.h"
 #include "wg.h"
 #include "misc.h"
 #include "invoke.h"
+#include "top.h"
+#include "trace.h"
 
 static const char* VERSION = "20240609";
 
@@ -39,26 +46,49 @@ static std::filesystem::path vm_root()
 class Command : public argparse::ArgumentParser {
     typedef std::function<void(argparse::ArgumentParser&)> SetupFunc;
     typedef std::function<int(const argparse::ArgumentParser&)> RunFunc;
+    std::string name;
     SetupFunc setupFunc;
     RunFunc runFunc;
     std::vector<std::reference_wrapper<Command>> subcommands;
 public:
-    Command(const std::string &name, const std::optional<std::string>& version,
+    Command(const std::string &_name, const std::optional<std::string>& version,
             SetupFunc _setupFunc, RunFunc _runFunc,
             const std::vector<std::reference_wrapper<Command>>& _subcommands = {})
-        : argparse::ArgumentParser(name, version? version.value() : "0.0", 
+        : argparse::ArgumentParser(_name, version? version.value() : "0.0", 
             version? argparse::default_arguments::all : argparse::default_arguments::help), 
-        setupFunc(_setupFunc), runFunc(_runFunc), subcommands(_subcommands) {
+        name(_name), setupFunc(_setupFunc), runFunc(_runFunc), subcommands(_subcommands) {
     }
 
-    void setup() {
+    /**
+     * @brief Set up this command and only the branches of subcommands named in args
+     * @details Any subcommand whose name appears in args is set up with the args following its first appearance.
+     * Which appearance argparse takes depends on whether preceding options take a value(eg. in
+     * "--trace-json start stop vm1" "start" is a value), so every candidate is set up rather than guessed.
+     * Other subcommands are registered by name only, or set up without their own subcommands when none is named
+     * or help is requested so that they are listed with description.
+     * @param args Command line arguments following this command's name
+     */
+    void setup(std::span<char*> args) {
+        bool help = std::any_of(args.begin(), args.end(), [](const char* arg) {
+            return std::string_view(arg) == "-h" || std::string_view(arg) == "--help";
+        });
+        bool any_named = false;
+        for (const auto &subcommand : subcommands) {
+            auto first = std::find(args.begin(), args.end(), subcommand.get().name);
+            if (first != args.end()) {
+                subcommand.get().setup(std::span<char*>(first + 1, args.end()));
+                any_named = true;
+            }
+        }
         for (const auto &subcommand : subcommands) {
-            subcommand.get().setup();
+            bool named = std::find(args.begin(), args.end(), subcommand.get().name) != args.end();
+            if (!named && (!any_named || help)) subcommand.get().setupFunc(subcommand.get());
             add_subparser(subcommand);
         }
         setupFunc(*this);
     }
     int run() {
+        trace::Scope scope("command", name);
         for (const auto &subcommand : subcommands) {
             if (is_subcommand_used(subcommand))
                 return subcommand.get().run();
@@ -88,24 +118,67 @@ namespace subcommand {
 
     static Command start("start", std::nullopt, 
         [](argparse::ArgumentParser& parser) {
-            parser.add_description("Start VM");
+            parser.add_description("Start VM(s)");
             parser.add_argument("-c", "--console").default_value(false).implicit_value(true);
-            parser.add_argument("vmname").nargs(1);
+            parser.add_argument("--force").default_value(false).implicit_value(true)
+                .help("Start even if host seems to lack memory or disk space");
+            parser.add_argument("--pin").default_value(false).implicit_value(true)
+                .help("Assign CPUs not used by other VMs if not assigned yet");
+            parser.add_argument("--all").default_value(false).implicit_value(true).help("Start all VMs");
+            parser.add_argument("-j", "--jobs").default_value<size_t>(4).scan<'u',size_t>()
+                .help("Number of VMs to start in parallel");
+            parser.add_argument("--rate").scan<'g',double>().help("Start at most specified number of VMs per second");
+            parser.add_argument("vmname").nargs(argparse::nargs_pattern::any);
         },
         [](const argparse::ArgumentParser& parser) {
-            return vm::start(parser.get("vmname"), parser.get<bool>("-c"));
+            auto vmnames = parser.get<std::vector<std::string>>("vmname");
+            auto all = parser.get<bool>("--all");
+            if (all == !vmnames.empty()) throw std::runtime_error("Specify VM name(s) or --all");
+            //else
+            if (!all && vmnames.size() == 1) {
+                return vm::start(vm_root(), vmnames[0], {
+                    .console = parser.get<bool>("-c"),
+                    .force = parser.get<bool>("--force"),
+                    .pin = parser.get<bool>("--pin")
+                });
+            }
+            //else
+            if (parser.get<bool>("-c")) throw std::runtime_error("--console cannot be used with multiple VMs");
+            return vm::start(vm_root(), vmnames, {
+                .concurrency = parser.get<size_t>("--jobs"),
+                .rate = parser.present<double>("--rate"),
+                .force = parser.get<bool>("--force"),
+                .pin = parser.get<bool>("--pin")
+            });
         }
     );
 
     static Command stop("stop", std::nullopt, 
         [](argparse::ArgumentParser& parser) {
-            parser.add_description("Stop VM");
+            parser.add_description("Stop VM(s)");
             parser.add_argument("-c", "--console").default_value(false).implicit_value(true);
             parser.add_argument("-f", "--force").default_value(false).implicit_value(true);
-            parser.add_argument("vmname").nargs(1);
+            parser.add_argument("--all").default_value(false).implicit_value(true).help("Stop all running VMs");
+            parser.add_argument("-j", "--jobs").default_value<size_t>(4).scan<'u',size_t>()
+                .help("Number of VMs to stop in parallel");
+            parser.add_argument("-t", "--timeout").default_value<uint32_t>(300).scan<'u',uint32_t>()
+                .help("Seconds to wait for each VM to stop when stopping multiple VMs(0 for no limit)");
+            parser.add_argument("vmname").nargs(argparse::nargs_pattern::any);
         },
         [](const argparse::ArgumentParser& parser) {
-            return vm::stop(parser.get("vmname"), parser.get<bool>("-f"), parser.get<bool>("-c"));
+            auto vmnames = parser.get<std::vector<std::string>>("vmname");
+            auto all = parser.get<bool>("--all");
+            if (all == !vmnames.empty()) throw std::runtime_error("Specify VM name(s) or --all");
+            //else
+            if (!all && vmnames.size() == 1) {
+                return vm::stop(vmnames[0], parser.get<bool>("-f"), parser.get<bool>("-c"));
+            }
+            //else
+            if (parser.get<bool>("-c")) throw std::runtime_error("--console cannot be used with multiple VMs");
+            return vm::stop(vm_root(), vmnames, parser.get<bool>("-f"), {
+                .concurrency = parser.get<size_t>("--jobs"),
+                .stop_timeout = parser.get<uint32_t>("--timeout")
+            });
         }
     );
 
@@ -151,9 +224,40 @@ namespace subcommand {
     static Command list("list", std::nullopt, 
         [](auto& parser) {
             parser.add_description("List VMs");
+            parser.add_argument("-j", "--jobs").template default_value<size_t>(8).template scan<'u',size_t>().help("Number of parallel queries");
+            parser.add_argument("--timeout").template default_value<uint32_t>(3000).template scan<'u',uint32_t>().help("Give up collecting information after specified milliseconds");
+            parser.add_argument("--json").default_value(false).implicit_value(true).help("Print as JSON array");
+            parser.add_argument("--cache").template scan<'u',uint32_t>()
+                .help("Reuse result of previous call made within specified seconds unless VMs or mounts changed");
         },
         [](const auto& parser) {
-            return vm::list(vm_root());
+            return vm::list(vm_root(), {
+                .concurrency = parser.template get<size_t>("--jobs"),
+                .timeout_ms = parser.template get<uint32_t>("--timeout"),
+                .json = parser.template get<bool>("--json"),
+                .cache_ttl = parser.template present<uint32_t>("--cache")
+            });
+        }
+    );
+
+    static Command top("top", std::nullopt,
+        [](auto& parser) {
+            parser.add_description("Show resource usage of running VMs");
+            parser.add_argument("-d", "--interval").template default_value<double>(2.0).template scan<'g',double>()
+                .help("Refresh interval in seconds");
+            parser.add_argument("-s", "--sort").template default_value<std::string>("cpu")
+                .help("Sort by 'name', 'cpu', 'memory', 'read', 'write', 'iops', 'rx' or 'tx'");
+            parser.add_argument("-n", "--count").template scan<'u',uint64_t>().help("Exit after specified number of refreshes");
+            parser.add_argument("--json").default_value(false).implicit_value(true)
+                .help("Print one JSON object per refresh instead of table");
+        },
+        [](const auto& parser) {
+            return top::top({
+                .interval = parser.template get<double>("--interval"),
+                .sort = parser.get("--sort"),
+                .count = parser.template present<uint64_t>("--count"),
+                .json = parser.template get<bool>("--json")
+            });
         }
     );
 
@@ -168,6 +272,13 @@ namespace subcommand {
                 .nargs(1)
                 .template scan<'u',uint32_t>()
                 .help("Create uninitialized data partition with specified size in GiB");
+            parser.add_argument("--preallocation")
+                .template default_value<std::string>("fallocate")
+                .help("Allocation of data partition: 'sparse'(thin), 'fallocate' or 'zeroed'(fully written, for latency-critical workloads)");
+            parser.add_argument("--force").default_value(false).implicit_value(true)
+                .help("Create even if volume lacks space for data partition");
+            parser.add_argument("--pin").default_value(false).implicit_value(true)
+                .help("Assign CPUs not used by other VMs");
             parser.add_argument("vmname").nargs(1).help("VM name");
             parser.add_argument("system-file").nargs(argparse::nargs_pattern::optional);
         },
@@ -177,7 +288,10 @@ namespace subcommand {
                 .memory = parser.template present<uint32_t>("--memory"),
                 .cpu = parser.template present<uint16_t>("--cpu"),
                 .data_partition = parser.template present<uint32_t>("--data-partition"),
-                .system_file = parser.present("system-file")
+                .data_preallocation = parser.get("--preallocation"),
+                .system_file = parser.present("system-file"),
+                .force = parser.template get<bool>("--force"),
+                .pin = parser.template get<bool>("--pin")
             });
         }
     );
@@ -185,10 +299,23 @@ namespace subcommand {
     static Command _delete("delete", std::nullopt,
         [](auto& parser) {
             parser.add_description("Delete VM");
+            parser.add_argument("--purge").default_value(false).implicit_value(true)
+                .help("Reclaim space of the VM in background instead of leaving it in trash");
             parser.add_argument("vmname").help("VM name");
         },
         [](const auto& parser) {
-            return vm::_delete(vm_root(), parser.get("vmname"));
+            return vm::_delete(vm_root(), parser.get("vmname"), parser.template get<bool>("--purge"));
+        }
+    );
+
+    static Command clone("clone", std::nullopt,
+        [](auto& parser) {
+            parser.add_description("Clone VM(by snapshot if possible)");
+            parser.add_argument("src").help("Source VM name");
+            parser.add_argument("dst").help("New VM name");
+        },
+        [](const auto& parser) {
+            return vm::clone(vm_root(), parser.get("src"), parser.get("dst"));
         }
     );
 
@@ -197,12 +324,13 @@ namespace subcommand {
             parser.add_argument("-i", "--system-image").nargs(1).template default_value<std::string>("/run/initramfs/boot/system.img");
             parser.add_argument("--text-mode").default_value(false).implicit_value(true);
             parser.add_argument("--installer").default_value(false).implicit_value(true);
-            parser.add_argument("disk").nargs(argparse::nargs_pattern::optional);
+            parser.add_argument("disk").nargs(argparse::nargs_pattern::any).help("Disk(s) to install to.  Multiple disks are installed in parallel");
         },
         [](const auto& parser) {
             must_be_root();
-            if (parser.is_used("disk")) {
-                return install::install(parser.get("disk"), parser.get("-i"), 
+            auto disks = parser.template get<std::vector<std::string>>("disk");
+            if (!disks.empty()) {
+                return install::install(std::vector<std::filesystem::path>(disks.begin(), disks.end()), parser.get("-i"), 
                     parser.template get<bool>("--text-mode"), parser.template get<bool>("--installer"));
             }
             //else
@@ -215,8 +343,13 @@ namespace subcommand {
 
     static Command invoke("invoke", std::nullopt,
         [](auto& parser) {
+            parser.add_argument("--serve").default_value(false).implicit_value(true)
+                .help("Keep serving newline-delimited requests with ids instead of executing one");
+            parser.add_argument("--socket").help("UNIX domain socket to serve on(stdin/stdout if omitted)");
         },
         [](const auto& parser) {
+            if (parser.template get<bool>("--serve")) return invoke::serve(parser.present("--socket"));
+            //else
             return invoke::invoke();
         }
     );
@@ -243,9 +376,12 @@ namespace subcommand {
 
     static Command volume_scan("scan", std::nullopt,
         [](argparse::ArgumentParser& parser) {
+            parser.add_argument("-j", "--jobs").default_value<size_t>(4).scan<'u',size_t>().help("Number of volumes mounted in parallel");
         },[](const argparse::ArgumentParser& parser) {
             must_be_root();
-            return volume::scan(vm_root());
+            return volume::scan(vm_root(), {
+                .concurrency = parser.get<size_t>("--jobs")
+            });
         }
     );
 
@@ -253,11 +389,16 @@ namespace subcommand {
         [](argparse::ArgumentParser& parser) {
             parser.add_argument("-n", "--names-only").default_value(false).implicit_value(true);
             parser.add_argument("-o", "--online-only").default_value(false).implicit_value(true);
+            parser.add_argument("--json").default_value(false).implicit_value(true).help("Print as JSON array");
+            parser.add_argument("--cache").scan<'u',uint32_t>()
+                .help("Reuse result of previous call made within specified seconds unless volumes or mounts changed");
         },[](const argparse::ArgumentParser& parser) {
             must_be_root();
             return volume::list(vm_root(), {
                 .online_only = parser.get<bool>("-o"),
-                .names_only = parser.get<bool>("-n")
+                .names_only = parser.get<bool>("-n"),
+                .json = parser.get<bool>("--json"),
+                .cache_ttl = parser.present<uint32_t>("--cache")
             });
         }
     );
@@ -273,27 +414,55 @@ namespace subcommand {
 
     static Command volume_backup("backup", std::nullopt, 
         [](argparse::ArgumentParser& parser) {
+            parser.add_argument("-m", "--method").default_value<std::string>("auto")
+                .help("'send'(incremental btrfs send/receive), 'rdiff-backup' or 'auto'(send if backup target is on btrfs)");
+            parser.add_argument("-j", "--jobs").default_value<size_t>(4).scan<'u',size_t>().help("Number of disks backed up in parallel");
+            parser.add_argument("--bandwidth").scan<'u',uint32_t>().help("Limit reading from each source disk in MiB/s");
         },[](const argparse::ArgumentParser& parser) {
             must_be_root();
-            return volume::backup(vm_root());
+            auto bandwidth = parser.present<uint32_t>("--bandwidth");
+            return volume::backup(vm_root(), {
+                .method = parser.get("--method"),
+                .concurrency = parser.get<size_t>("--jobs"),
+                .bandwidth = bandwidth? std::make_optional(*bandwidth * 1024ULL * 1024) : std::nullopt
+            });
         }
     );
 
     static Command volume_clean("clean", std::nullopt,
         [](argparse::ArgumentParser& parser) {
             parser.add_argument("name").nargs(argparse::nargs_pattern::optional);
+            parser.add_argument("--bandwidth").default_value<uint32_t>(1024).scan<'u',uint32_t>()
+                .help("Limit freeing space in MiB/s(0 for unlimited)");
+            parser.add_argument("--background").default_value(false).implicit_value(true);
         },[](const argparse::ArgumentParser& parser) {
             must_be_root();
-            return volume::clean(vm_root(), parser.present("name"));
+            auto bandwidth = parser.get<uint32_t>("--bandwidth");
+            return volume::clean(vm_root(), parser.present("name"), {
+                .bandwidth = bandwidth > 0? std::make_optional(bandwidth * 1024ULL * 1024) : std::nullopt,
+                .background = parser.get<bool>("--background")
+            });
         }
     );
 
     static Command volume_optimize("optimize", std::nullopt,
         [](argparse::ArgumentParser& parser) {
             parser.add_argument("name").nargs(1);
+            parser.add_argument("--threshold").default_value<double>(64.0).scan<'g',double>()
+                .help("Defragment files having more extents per GiB than this");
+            parser.add_argument("--bandwidth").scan<'u',uint32_t>().help("Limit rewriting in MiB/s");
+            parser.add_argument("--unshare").default_value(false).implicit_value(true)
+                .help("Defragment files sharing extents with snapshots too(consumes extra space)");
+            parser.add_argument("-n", "--dry-run").default_value(false).implicit_value(true);
         },[](const argparse::ArgumentParser& parser) {
             must_be_root();
-            return volume::optimize(vm_root(), parser.get("name"));
+            auto bandwidth = parser.present<uint32_t>("--bandwidth");
+            return volume::optimize(vm_root(), parser.get("name"), {
+                .threshold = parser.get<double>("--threshold"),
+                .bandwidth = bandwidth? std::make_optional(*bandwidth * 1024ULL * 1024) : std::nullopt,
+                .unshare = parser.get<bool>("--unshare"),
+                .dry_run = parser.get<bool>("--dry-run")
+            });
         }
     );
 
@@ -310,6 +479,52 @@ namespace subcommand {
         }
     );
 
+    // image subcommands
+    static Command image_pack("pack", std::nullopt,
+        [](argparse::ArgumentParser& parser) {
+            parser.add_description("Pack system image into chunked, compressed container");
+            parser.add_argument("--chunk-size").default_value<uint32_t>(4).scan<'u',uint32_t>().help("Chunk size in MiB");
+            parser.add_argument("-l", "--level").default_value<int>(3).scan<'i',int>().help("zstd compression level");
+            parser.add_argument("-j", "--jobs").default_value<size_t>(0).scan<'u',size_t>().help("Number of threads(0 for number of CPUs)");
+            parser.add_argument("src").nargs(1);
+            parser.add_argument("dst").nargs(1);
+        },[](const argparse::ArgumentParser& parser) {
+            // chunk size is stored as uint32_t in bytes
+            uint64_t chunk_size = (uint64_t)parser.get<uint32_t>("--chunk-size") * 1024 * 1024;
+            if (chunk_size == 0 || chunk_size > std::numeric_limits<uint32_t>::max()) {
+                throw std::runtime_error("Chunk size must be between 1 and "
+                    + std::to_string(std::numeric_limits<uint32_t>::max() / 1024 / 1024) + " MiB");
+            }
+            return image::pack(parser.get("src"), parser.get("dst"), {
+                .chunk_size = (uint32_t)chunk_size,
+                .level = parser.get<int>("--level"),
+                .concurrency = parser.get<size_t>("--jobs")
+            });
+        }
+    );
+
+    static Command image_unpack("unpack", std::nullopt,
+        [](argparse::ArgumentParser& parser) {
+            parser.add_description("Unpack container into raw system image");
+            parser.add_argument("src").nargs(1);
+            parser.add_argument("dst").nargs(1);
+        },[](const argparse::ArgumentParser& parser) {
+            return image::unpack(parser.get("src"), parser.get("dst"));
+        }
+    );
+
+    static Command image("image", std::nullopt, 
+        [](argparse::ArgumentParser&){}, 
+        [](const argparse::ArgumentParser& parser){
+            std::cerr << "No subcommand specified for image" << std::endl;
+            std::cout << parser << std::endl;
+            return -1;
+        },
+        {
+            image_pack, image_unpack
+        }
+    );
+
     // wg subcommands
     static Command wg_genkey("genkey", std::nullopt,
         [](argparse::ArgumentParser& parser) {
@@ -341,19 +556,34 @@ namespace subcommand {
     static Command wg_notify("notify", std::nullopt,
         [](argparse::ArgumentParser& parser) {
             parser.add_description("Send notification message via HTTP over WireGuard");
-            parser.add_argument("uri").nargs(1).help("URI to get");
+            parser.add_argument("uri").nargs(argparse::nargs_pattern::at_least_one).help("URI(s) to get");
         },[](const argparse::ArgumentParser& parser) {
-            return wg::notify(parser.get("uri"));
+            return wg::notify(parser.get<std::vector<std::string>>("uri"));
         }
     );
 
     static Command wg_ping("ping", std::nullopt,
         [](argparse::ArgumentParser& parser) {
             parser.add_description("Ping WireGuard peer");
-            parser.add_argument("-q", "--quiet").default_value(false).implicit_value(true);
+            parser.add_argument("-q", "--quiet").default_value(false).implicit_value(true)
+                .help("Print nothing and return on the first reply");
+            parser.add_argument("--first").default_value(false).implicit_value(true)
+                .help("Return on the first reply without RTT/loss statistics");
             parser.add_argument("--success-if-not-active").default_value(false).implicit_value(true);
+            parser.add_argument("-c", "--count").default_value<uint16_t>(5).scan<'u',uint16_t>().help("Number of echo requests");
+            parser.add_argument("-i", "--interval").default_value<double>(0.2).scan<'g',double>()
+                .help("Seconds between echo requests");
+            parser.add_argument("-W", "--timeout").default_value<double>(2.0).scan<'g',double>()
+                .help("Seconds to wait for whole probing including replies");
         },[](const argparse::ArgumentParser& parser) {
-            return wg::ping(parser.get<bool>("--success-if-not-active"), 5, !parser.get<bool>("--quiet"));
+            return wg::ping({
+                .count = parser.get<uint16_t>("--count"),
+                .interval = parser.get<double>("--interval"),
+                .timeout = parser.get<double>("--timeout"),
+                .verbose = !parser.get<bool>("--quiet"),
+                .first = parser.get<bool>("--quiet") || parser.get<bool>("--first"),
+                .success_if_not_active = parser.get<bool>("--success-if-not-active")
+            });
         }
     );
 
@@ -418,7 +648,9 @@ namespace subcommand {
 static int _main(int argc, char* argv[])
 {
     Command program(argv[0], VERSION, [](argparse::ArgumentParser& parser){
-
+        parser.add_argument("--trace").default_value(false).implicit_value(true)
+            .help("Print latency summary of forks, socket round trips etc. at exit(same as WB_TRACE=1)");
+        parser.add_argument("--trace-json").help("Write Chrome trace JSON to specified file at exit");
     }, [&program](const argparse::ArgumentParser& parser){
         auto subcommand = program.get_used_subcommand();
         if (subcommand) {
@@ -430,11 +662,11 @@ static int _main(int argc, char* argv[])
         return -1;
     }, {
         subcommand::start, subcommand::stop, subcommand::restart, subcommand::console, subcommand::autostart,
-        subcommand::list, subcommand::create, subcommand::_delete, subcommand::install, subcommand::invoke,
-        subcommand::volume, subcommand::wg, subcommand::misc
+        subcommand::list, subcommand::top, subcommand::create, subcommand::clone, subcommand::_delete, subcommand::install, subcommand::invoke,
+        subcommand::volume, subcommand::image, subcommand::wg, subcommand::misc
     });
 
-    program.setup();
+    program.setup(std::span<char*>(argv + 1, argc - 1));
 
     try {
         program.parse_args(argc, argv);
@@ -445,6 +677,11 @@ static int _main(int argc, char* argv[])
         return -1;
     }
 
+    trace::enable_from_env();
+    if (program.get<bool>("--trace")) trace::enable();
+    if (auto trace_json = program.present("--trace-json")) trace::enable(*trace_json);
+    std::shared_ptr<void> trace_guard(nullptr, [](auto) { trace::flush(); }); // also on exception
+
     return program.run();
 }
 
@@ -3,12 +3,20 @@
 #include <arpa/inet.h>
 #include <netinet/icmp6.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <linux/genetlink.h>
+#include <linux/wireguard.h>
 
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <memory>
-#include <ext/stdio_filebuf.h> // for __gnu_cxx::stdio_filebuf
+#include <functional>
+#include <chrono>
+#include <numeric>
+#include <algorithm>
 
 #include <qrencode.h>
 #include <curl/curl.h>
@@ -16,6 +24,9 @@
 #include <wghub.h>
 
 #include "wg.h"
+#include "misc.h"
+#include "trace.h"
+#include "dl.h"
 
 static const std::filesystem::path privkey_path("/etc/walbrix/privkey"), wireguard_dir("/etc/wireguard");
 static const std::string base_url("https://hub.walbrix.net/wghub");
@@ -93,51 +104,154 @@ static size_t curl_callback(char *buffer, size_t size, size_t nmemb, void *f)
     return size * nmemb;
 }
 
-static std::optional<std::string> get_wg_peer_address(const std::string& tunnel_name)
+static int genl_request(int sock, uint16_t family, uint8_t cmd, uint16_t flags,
+    const std::vector<std::pair<uint16_t,std::string>>& attrs, std::function<void(const void*,size_t)> on_message)
 {
-    int fd[2];
-    if (pipe(fd) < 0) throw std::runtime_error("pipe() failed");
-
-    auto pid = fork();
-    if (pid < 0) throw std::runtime_error("fork() failed");
-    if (pid == 0) {
-        dup2(fd[1], STDOUT_FILENO);
-        close(fd[0]);
-        _exit(execlp("wg", "wg", "show", "all", "allowed-ips", NULL));
+    static uint32_t seq = 0;
+    std::string req(NLMSG_HDRLEN + GENL_HDRLEN, '\0');
+    for (const auto& [type, value] : attrs) {
+        struct nlattr attr = { (uint16_t)(NLA_HDRLEN + value.length()), type };
+        req.append((const char*)&attr, sizeof(attr));
+        req.append(value);
+        req.resize(NLA_ALIGN(req.length()), '\0');
     }
-    //else
-    close(fd[1]);
-
-    std::optional<std::string> peer_address;
-    {
-        __gnu_cxx::stdio_filebuf<char> filebuf(fd[0], std::ios::in);
-        std::istream f(&filebuf);
-        std::string line;
-        while (std::getline(f, line)) {
-            if (!line.starts_with(tunnel_name + "\t")) continue;
-            line.erase(0, 11);
-            auto delim_pos = line.find_first_of('\t');
-            if (delim_pos == line.npos) continue;
+    auto nlh = (struct nlmsghdr*)req.data();
+    nlh->nlmsg_len = req.length();
+    nlh->nlmsg_type = family;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = ++seq;
+    auto genlh = (struct genlmsghdr*)NLMSG_DATA(nlh);
+    genlh->cmd = cmd;
+    genlh->version = 1;
+    if (send(sock, req.data(), req.length(), 0) < 0) throw std::runtime_error("send() to netlink failed");
+
+    alignas(struct nlmsghdr) char buf[32768];
+    while (true) {
+        auto n = recv(sock, buf, sizeof(buf), 0);
+        if (n < 0) throw std::runtime_error("recv() from netlink failed");
+        for (auto msg = (struct nlmsghdr*)buf; NLMSG_OK(msg, (size_t)n); msg = NLMSG_NEXT(msg, n)) {
+            if (msg->nlmsg_seq != seq) continue;
+            if (msg->nlmsg_type == NLMSG_DONE) return 0;
+            if (msg->nlmsg_type == NLMSG_ERROR) return -((struct nlmsgerr*)NLMSG_DATA(msg))->error; // 0 means ack
             //else
-            line.erase(0, delim_pos + 1);
-            if (!line.ends_with("/128")) continue;
-            line.resize(line.length() - 4);
-            peer_address = line;
-            break;
+            if (msg->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN)) continue;
+            on_message((const char*)NLMSG_DATA(msg) + GENL_HDRLEN, msg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN));
         }
     }
+}
+
+static void for_each_attr(const void* data, size_t len, std::function<void(uint16_t,const void*,size_t)> func)
+{
+    auto attr = (const struct nlattr*)data;
+    while (len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && attr->nla_len <= len) {
+        func(attr->nla_type & NLA_TYPE_MASK, (const char*)attr + NLA_HDRLEN, attr->nla_len - NLA_HDRLEN);
+        size_t aligned = NLA_ALIGN(attr->nla_len);
+        if (aligned >= len) break;
+        //else
+        len -= aligned;
+        attr = (const struct nlattr*)((const char*)attr + aligned);
+    }
+}
+
+/**
+ * @brief Query first /128 allowed-ip of the tunnel over WireGuard generic netlink
+ */
+static std::optional<std::string> query_wg_peer_address(const std::string& tunnel_name)
+{
+    trace::Scope scope("netlink", "wg get device");
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (sock < 0) throw std::runtime_error("socket(AF_NETLINK) failed");
+    std::shared_ptr<void> sock_guard(nullptr, [sock](auto){ close(sock); });
+
+    std::optional<uint16_t> family;
+    auto err = genl_request(sock, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0,
+        {{CTRL_ATTR_FAMILY_NAME, std::string(WG_GENL_NAME, sizeof(WG_GENL_NAME))}},
+        [&family](const void* data, size_t len) {
+            for_each_attr(data, len, [&family](uint16_t type, const void* value, size_t len) {
+                if (type == CTRL_ATTR_FAMILY_ID && len >= sizeof(uint16_t)) family = *(const uint16_t*)value;
+            });
+        });
+    if (err == ENOENT) return std::nullopt; // wireguard module is not loaded
+    if (err != 0 || !family) throw std::runtime_error("Resolving generic netlink family '" WG_GENL_NAME "' failed: " + std::string(strerror(err)));
+
+    std::optional<std::string> peer_address;
+    auto on_allowedip = [&peer_address](uint16_t, const void* data, size_t len) {
+        int addr_family = AF_UNSPEC;
+        uint8_t cidr = 0;
+        const void* addr = nullptr;
+        size_t addr_len = 0;
+        for_each_attr(data, len, [&](uint16_t type, const void* value, size_t len) {
+            if (type == WGALLOWEDIP_A_FAMILY && len >= sizeof(uint16_t)) addr_family = *(const uint16_t*)value;
+            else if (type == WGALLOWEDIP_A_CIDR_MASK && len >= sizeof(uint8_t)) cidr = *(const uint8_t*)value;
+            else if (type == WGALLOWEDIP_A_IPADDR) { addr = value; addr_len = len; }
+        });
+        if (peer_address || addr_family != AF_INET6 || cidr != 128 || !addr || addr_len != sizeof(struct in6_addr)) return;
+        //else
+        char str[INET6_ADDRSTRLEN];
+        if (inet_ntop(AF_INET6, addr, str, sizeof(str))) peer_address = str;
+    };
+    err = genl_request(sock, *family, WG_CMD_GET_DEVICE, NLM_F_DUMP,
+        {{WGDEVICE_A_IFNAME, std::string(tunnel_name.c_str(), tunnel_name.length() + 1)}},
+        [&on_allowedip](const void* data, size_t len) {
+            for_each_attr(data, len, [&](uint16_t type, const void* value, size_t len) {
+                if (type != WGDEVICE_A_PEERS) return;
+                for_each_attr(value, len, [&](uint16_t, const void* peer, size_t len) {
+                    for_each_attr(peer, len, [&](uint16_t type, const void* value, size_t len) {
+                        if (type == WGPEER_A_ALLOWEDIPS) for_each_attr(value, len, on_allowedip);
+                    });
+                });
+            });
+        });
+    if (err == ENODEV) return std::nullopt; // not a wireguard interface
+    if (err != 0) throw std::runtime_error("Getting wireguard device " + tunnel_name + " failed: " + std::string(strerror(err)));
+    //else
+    return peer_address;
+}
 
-    int wstatus;
-    if (waitpid(pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
-        throw std::runtime_error("wg command failed");
+/**
+ * @brief Get peer address of the tunnel
+ * @details Result is cached in runtime directory with the ifindex and the mtime of its config as key so that
+ * recreating the interface or fetching new config invalidates it.
+ */
+static std::optional<std::string> get_wg_peer_address(const std::string& tunnel_name)
+{
+    auto ifindex = if_nametoindex(tunnel_name.c_str());
+    if (ifindex == 0) return std::nullopt; // interface doesn't exist
+    //else
+    struct stat st;
+    auto conf = wireguard_dir / (tunnel_name + ".conf");
+    auto key = std::to_string(ifindex) + '-' + (stat(conf.c_str(), &st) == 0?
+        std::to_string(st.st_mtim.tv_sec) + '.' + std::to_string(st.st_mtim.tv_nsec) : "none");
+    auto cached = load_state_cache("wg-peer", key, std::chrono::minutes(10));
+    if (cached) return cached->empty()? std::nullopt : cached;
     //else
+    auto peer_address = query_wg_peer_address(tunnel_name);
+    save_state_cache("wg-peer", key, peer_address.value_or(""));
     return peer_address;
 }
 
-static bool ping(const std::string& peer_address, uint16_t count = 5, bool verbose = false)
+struct PingStats {
+    uint16_t transmitted = 0;
+    std::vector<double> rtts; // in milliseconds
+};
+
+/**
+ * @brief Send echo requests at fixed interval without waiting for replies in between
+ * @details Replies are matched by id, seq and source address.  Probing ends when all replies(the first one if options.first) have
+ * arrived or the deadline passes.
+ */
+static PingStats ping(const std::string& peer_address, const wg::PingOptions& options)
 {
-    int sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+    int sock = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_ICMPV6);
     if (sock < 0) throw std::runtime_error("socket() failed");
+    std::shared_ptr<void> sock_guard(nullptr, [sock](auto){ close(sock); });
+
+    struct icmp6_filter filter;
+    ICMP6_FILTER_SETBLOCKALL(&filter);
+    ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+    if (setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter)) < 0)
+        throw std::runtime_error("setsockopt(ICMP6_FILTER) failed");
+
     struct sockaddr_in6 addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin6_family = AF_INET6;
@@ -147,37 +261,66 @@ static bool ping(const std::string& peer_address, uint16_t count = 5, bool verbo
     memset(&icmp6, 0, sizeof(icmp6));
     icmp6.icmp6_type = ICMP6_ECHO_REQUEST;
     icmp6.icmp6_code = 0;
-    icmp6.icmp6_id = htons(getpid());
-    int seq = 0;
+    icmp6.icmp6_id = htons(getpid() & 0xffff);
     icmp6.icmp6_cksum = 0; // leave 0 to let kernel fill it
 
-    char buf[1024];
-    struct sockaddr_in6 peer_addr;
-    socklen_t peer_addr_len = sizeof(peer_addr);
-
-    for (int i = 0; i < count; i++) {
-        if (verbose) std::cout << "Sending echo request to " << peer_address << " with seq=" << seq << std::endl;
-        icmp6.icmp6_seq = htons(seq++);
-        if (sendto(sock, &icmp6, sizeof(icmp6), 0, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-            throw std::runtime_error("sendto() failed");
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(sock, &fds);
-        struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        int ret = select(sock + 1, &fds, NULL, NULL, &tv);
-        if (ret < 0) throw std::runtime_error("select() failed");
-        if (ret > 0) {
-            ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&peer_addr, &peer_addr_len);
-            if (n < 0) throw std::runtime_error("recvfrom() failed");
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.interval));
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.timeout));
+    std::vector<std::optional<std::chrono::steady_clock::time_point>> sent(options.count);
+    std::vector<bool> received(options.count, false);
+    PingStats stats;
+    auto next_send = start;
+
+    while (stats.transmitted < options.count || stats.rtts.size() < stats.transmitted) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) break;
+        //else
+        if (stats.transmitted < options.count && now >= next_send) {
+            auto seq = stats.transmitted;
+            icmp6.icmp6_seq = htons(seq);
+            if (options.verbose) std::cout << "Sending echo request to " << peer_address << " with seq=" << seq << std::endl;
+            if (sendto(sock, &icmp6, sizeof(icmp6), 0, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+                throw std::runtime_error("sendto() failed");
+            sent[seq] = now;
+            stats.transmitted++;
+            next_send += interval;
+            continue;
+        }
+        //else
+        auto wake = stats.transmitted < options.count? std::min(next_send, deadline) : deadline;
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(wake - now).count();
+        int ret = poll(&pfd, 1, (int)ms);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
             //else
-            if (verbose) std::cout << "Received echo reply with seq=" << ntohs(((struct icmp6_hdr*)buf)->icmp6_seq) << std::endl;
-            return true;
+            throw std::runtime_error("poll() failed");
         }
+        if (ret == 0) continue;
+        //else
+        char buf[1024];
+        struct sockaddr_in6 peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        if (n < 0) throw std::runtime_error("recvfrom() failed");
+        auto received_at = std::chrono::steady_clock::now();
+        if (n < (ssize_t)sizeof(struct icmp6_hdr)) continue;
+        if (memcmp(&peer_addr.sin6_addr, &addr.sin6_addr, sizeof(addr.sin6_addr)) != 0) continue;
+        //else
+        auto reply = (const struct icmp6_hdr*)buf;
+        if (reply->icmp6_type != ICMP6_ECHO_REPLY || reply->icmp6_id != icmp6.icmp6_id) continue;
+        //else
+        auto seq = ntohs(reply->icmp6_seq);
+        if (seq >= options.count || !sent[seq] || received[seq]) continue; // unknown or duplicate
+        //else
+        received[seq] = true;
+        auto rtt = std::chrono::duration<double,std::milli>(received_at - *sent[seq]).count();
+        stats.rtts.push_back(rtt);
+        if (options.verbose) std::cout << "Received echo reply with seq=" << seq << " time=" << rtt << " ms" << std::endl;
+        if (options.first) break;
     }
-    if (verbose) std::cout << "No echo reply received" << std::endl;
-    return false;
+    return stats;
 }
 
 namespace wg {
@@ -208,7 +351,7 @@ int pubkey(bool qrcode)
     auto pubkey = wghub::get_public_key_from_private_key(privkey);
 
     if (qrcode) {
-        std::shared_ptr<QRcode> qrcode(QRcode_encodeString(pubkey.c_str(), 0, QR_ECLEVEL_L, QR_MODE_8, 1), QRcode_free);
+        std::shared_ptr<QRcode> qrcode(WB_DLSYM(dl::libqrencode, QRcode_encodeString)(pubkey.c_str(), 0, QR_ECLEVEL_L, QR_MODE_8, 1), WB_DLSYM(dl::libqrencode, QRcode_free));
         if (!qrcode) throw std::runtime_error("Failed to generate QR code. " + std::string(strerror(errno)));
         print_qrcode(qrcode.get());
     } else {
@@ -224,17 +367,17 @@ int getconfig(bool accept_ssh_key)
     auto pubkey = wghub::get_public_key_from_private_key(privkey);
     std::string url = wghub::get_authorization_url(base_url, pubkey);
 
-    std::shared_ptr<CURL> curl(curl_easy_init(), curl_easy_cleanup);
-    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+    std::shared_ptr<CURL> curl(WB_DLSYM(dl::libcurl, curl_easy_init)(), WB_DLSYM(dl::libcurl, curl_easy_cleanup));
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_URL, url.c_str());
     std::string buf;
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curl_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &buf);
-    auto res = curl_easy_perform(curl.get());
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_WRITEFUNCTION, curl_callback);
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_WRITEDATA, &buf);
+    auto res = WB_DLSYM(dl::libcurl, curl_easy_perform)(curl.get());
     if (res != CURLE_OK) {
-        throw std::runtime_error(curl_easy_strerror(res));
+        throw std::runtime_error(WB_DLSYM(dl::libcurl, curl_easy_strerror)(res));
     }
     long http_code = 0;
-    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
+    WB_DLSYM(dl::libcurl, curl_easy_getinfo)(curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
 
     if (http_code == 404) {
         std::cerr << "Not authorized yet" << std::endl;
@@ -260,6 +403,7 @@ int getconfig(bool accept_ssh_key)
     }
 
     if (config.serial) {
+        trace::Scope scope("exec", "hostnamectl");
         auto pid = fork();
         if (pid < 0) throw std::runtime_error("fork() failed");
         if (pid == 0) {
@@ -307,32 +451,53 @@ int getconfig(bool accept_ssh_key)
     return 0;
 }
 
-int notify(const std::string& uri)
+int notify(const std::vector<std::string>& uris)
 {
     auto peer_address = get_wg_peer_address(tunnel_name);
     if (!peer_address) return 0; // just return success if wg-walbrix is not connected
 
-    std::string url = "http://[" + (*peer_address) + "]" + (uri.starts_with('/')? "" : "/") + uri;
+    // one handle for all URIs so that the connection to the peer is kept alive and reused
+    std::shared_ptr<CURL> curl(WB_DLSYM(dl::libcurl, curl_easy_init)(), WB_DLSYM(dl::libcurl, curl_easy_cleanup));
     std::string buf;
-    std::shared_ptr<CURL> curl(curl_easy_init(), curl_easy_cleanup);
-    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl.get(), CURLOPT_TIMEOUT, 3);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curl_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &buf);
-    curl_easy_perform(curl.get());
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_TIMEOUT, 3L);
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_TCP_KEEPALIVE, 1L);
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_WRITEFUNCTION, curl_callback);
+    WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_WRITEDATA, &buf);
+    for (const auto& uri : uris) {
+        std::string url = "http://[" + (*peer_address) + "]" + (uri.starts_with('/')? "" : "/") + uri;
+        WB_DLSYM(dl::libcurl, curl_easy_setopt)(curl.get(), CURLOPT_URL, url.c_str());
+        buf.clear();
+        WB_DLSYM(dl::libcurl, curl_easy_perform)(curl.get());
+    }
 
     return 0;
 }
 
-int ping(bool success_if_not_active, uint16_t count, bool verbose)
+int ping(const PingOptions& options/* = {}*/)
 {
+    if (options.interval <= 0.0) throw std::runtime_error("Interval must be positive");
+    if (options.timeout <= 0.0) throw std::runtime_error("Timeout must be positive");
+    //else
     auto peer_address = get_wg_peer_address(tunnel_name);
     if (!peer_address) {
-        if (verbose) std::cout << "Tunnel '" << tunnel_name << "' is not active" << std::endl;
-        return success_if_not_active? 0 : 1;
+        if (options.verbose) std::cout << "Tunnel '" << tunnel_name << "' is not active" << std::endl;
+        return options.success_if_not_active? 0 : 1;
     }
 
-    return ::ping(*peer_address, count, verbose)? 0 : 1;
+    auto stats = ::ping(*peer_address, options);
+    if (options.verbose && !options.first) {
+        auto received = stats.rtts.size();
+        std::cout << stats.transmitted << " packets transmitted, " << received << " received, "
+            << (stats.transmitted > 0? 100 * (stats.transmitted - received) / stats.transmitted : 0) << "% packet loss" << std::endl;
+        if (received > 0) {
+            auto [min, max] = std::minmax_element(stats.rtts.begin(), stats.rtts.end());
+            auto avg = std::accumulate(stats.rtts.begin(), stats.rtts.end(), 0.0) / received;
+            std::cout << "rtt min/avg/max = " << *min << '/' << avg << '/' << *max << " ms" << std::endl;
+        } else {
+            std::cout << "No echo reply received" << std::endl;
+        }
+    }
+    return stats.rtts.empty()? 1 : 0;
 }
 
 } // namespace wg
@@ -9,8 +9,24 @@ namespace wg {
     int genkey(bool force);
     int pubkey(bool qrcode);
     int getconfig(bool accept_ssh_key);
-    int notify(const std::string& uri);
-    int ping(bool success_if_not_active, uint16_t count, bool verbose);
+    /**
+     * @brief Send HTTP GET to each URI on the peer reusing one connection
+     */
+    int notify(const std::vector<std::string>& uris);
+
+    struct PingOptions {
+        uint16_t count = 5;
+        double interval = 0.2; // seconds between echo requests
+        double timeout = 2.0; // seconds for whole probing including replies
+        bool verbose = false;
+        bool first = false; // return on the first reply instead of collecting RTT/loss statistics of all requests
+        bool success_if_not_active = false;
+    };
+    /**
+     * @brief Probe peer with echo requests
+     * @return 0 if any reply arrived within the timeout
+     */
+    int ping(const PingOptions& options = {});
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+/**
+ * @file workerpool.cpp
+ * @brief Bounded pool of detached worker threads
+ */
+#include <thread>
+#include <iostream>
+
+#include "workerpool.h"
+
+WorkerPool::~WorkerPool()
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->closed = true;
+    state->task_available.notify_all();
+}
+
+void WorkerPool::post(std::function<void()> task)
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->queue.push_back(task);
+    // idle threads which are notified but not woken yet still count as idle.  compare with queued tasks
+    if (state->queue.size() > state->idle && state->threads < concurrency) {
+        state->threads++;
+        std::thread([state = this->state]() {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            while (true) {
+                state->idle++;
+                state->task_available.wait(lock, [&state]() { return !state->queue.empty() || state->closed; });
+                state->idle--;
+                if (state->queue.empty()) break; // closed
+                //else
+                auto task = state->queue.front();
+                state->queue.pop_front();
+                state->running++;
+                lock.unlock();
+                try {
+                    task();
+                }
+                catch (const std::exception& err) {
+                    // tasks from submit() never get here.  their exception goes to the future
+                    std::cerr << "Unhandled exception in worker thread: " << err.what() << std::endl;
+                }
+                catch (...) {
+                    std::cerr << "Unhandled exception in worker thread" << std::endl;
+                }
+                lock.lock();
+                state->running--;
+                if (state->queue.empty() && state->running == 0) state->all_done.notify_all();
+            }
+            state->threads--;
+        }).detach();
+    }
+    state->task_available.notify_one();
+}
+
+bool WorkerPool::wait_until(std::chrono::steady_clock::time_point deadline)
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+    return state->all_done.wait_until(lock, deadline, [this]() { return state->queue.empty() && state->running == 0; });
+}
+
+void WorkerPool::wait()
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->all_done.wait(lock, [this]() { return state->queue.empty() && state->running == 0; });
+}
+
+void WorkerPool::cancel()
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->queue.clear();
+    if (state->running == 0) state->all_done.notify_all();
+}
@@ -0,0 +1,54 @@
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * @brief Bounded pool of worker threads
+ * @details Threads are spawned on demand up to the concurrency limit and are detached, so that destroying
+ * the pool never blocks on a task which is stuck(eg. waiting for unresponsive guest agent).
+ * Such task keeps running in background until it finishes or the process exits.
+ */
+class WorkerPool {
+    struct State {
+        std::mutex mutex;
+        std::condition_variable task_available, all_done;
+        std::deque<std::function<void()>> queue;
+        size_t threads = 0, idle = 0, running = 0;
+        bool closed = false;
+    };
+    std::shared_ptr<State> state;
+    size_t concurrency;
+public:
+    WorkerPool(size_t _concurrency) : state(std::make_shared<State>()), concurrency(std::max(_concurrency, (size_t)1)) {}
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void post(std::function<void()> task);
+
+    template <typename F> std::future<std::invoke_result_t<F>> submit(F&& func) {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(func));
+        auto future = task->get_future();
+        post([task]() { (*task)(); });
+        return future;
+    }
+
+    /**
+     * @brief Wait until all posted tasks are finished
+     * @return false if deadline has passed
+     */
+    bool wait_until(std::chrono::steady_clock::time_point deadline);
+    void wait();
+    /**
+     * @brief Discard tasks which are not started yet.  Their futures get broken_promise
+     */
+    void cancel();
+};
+
+#endif // __WORKERPOOL_H__